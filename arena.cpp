@@ -0,0 +1,103 @@
+/* Monotonic allocator for per-sync state; see arena.h. */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Small allocations are carved out of chunks of this size; anything over a
+ * quarter of it gets a chunk of its own, so that big tables don't waste the
+ * rest of the current chunk. */
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;				/* Bytes of data after the header */
+	size_t used;
+};
+
+/* The arena lives at the start of its first chunk. chunks is the one small
+ * allocations come from, followed by all the others. */
+struct arena {
+	struct arena_chunk *chunks;
+};
+
+#define ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define HEADER ROUND(sizeof(struct arena_chunk))
+
+static inline unsigned char *chunk_data(struct arena_chunk *c) {
+	return (unsigned char *)c + HEADER;
+}
+
+/* new_chunk(size)
+ * Returns a zeroed chunk with room for size bytes, or NULL. Large chunks come
+ * from calloc as fresh anonymous mappings, so untouched pages cost nothing. */
+static struct arena_chunk *new_chunk(size_t size) {
+	struct arena_chunk *c = (struct arena_chunk *)calloc(1, HEADER + size);
+	if (c)
+		c->size = size;
+	return c;
+}
+
+/* arena_new()
+ * Returns a new, empty arena, or NULL if out of memory. */
+struct arena *arena_new(void) {
+	struct arena_chunk *c = new_chunk(ARENA_CHUNK);
+	if (!c)
+		return NULL;
+
+	struct arena *a = (struct arena *)chunk_data(c);
+	c->used = ROUND(sizeof *a);
+	a->chunks = c;
+	return a;
+}
+
+/* arena_free(self)
+ * Free the arena and everything allocated from it. */
+void arena_free(struct arena *a) {
+	if (!a)
+		return;
+
+	/* The chunk holding the arena itself goes last */
+	struct arena_chunk *first = (struct arena_chunk *)((unsigned char *)a - HEADER);
+	struct arena_chunk *c = a->chunks;
+
+	while (c) {
+		struct arena_chunk *next = c->next;
+
+		if (c != first)
+			free(c);
+		c = next;
+	}
+	free(first);
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+	struct arena_chunk *c = a->chunks;
+
+	size = ROUND(size);
+	if (size <= c->size - c->used) {
+		void *p = chunk_data(c) + c->used;
+		c->used += size;
+		return p;
+	}
+
+	if (size > ARENA_CHUNK / 4) {
+		/* Behind the current chunk, which still has room for small ones */
+		struct arena_chunk *big = new_chunk(size);
+		if (!big)
+			return NULL;
+		big->used = size;
+		big->next = c->next;
+		c->next = big;
+		return chunk_data(big);
+	}
+
+	struct arena_chunk *n = new_chunk(ARENA_CHUNK);
+	if (!n)
+		return NULL;
+	n->used = size;
+	n->next = c;
+	a->chunks = n;
+	return chunk_data(n);
+}
@@ -0,0 +1,21 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A monotonic allocator: memory is handed out from a few large chunks and
+ * never given back one allocation at a time, only all at once when the arena
+ * is freed. Everything belonging to one sync comes from its arena, so ending
+ * the sync can't leak or leave fragments of it behind.
+ *
+ * Memory from an arena is zeroed and 16 byte aligned. An arena is not thread
+ * safe; allocate from one thread, or with a lock held. */
+struct arena;
+
+struct arena *arena_new(void);
+void arena_free(struct arena *a);
+
+/* Returns size bytes, or NULL if out of memory */
+void *arena_alloc(struct arena *a, size_t size);
+
+#endif
@@ -0,0 +1,71 @@
+/* Content-defined chunking; see cdc.h. */
+
+#include "cdc.h"
+
+/* The gear table: a random 64-bit value for each byte value. It is part of
+ * the control file format, so it comes from a fixed seed (with splitmix64)
+ * rather than being stored anywhere. */
+struct gear_table {
+	unsigned long long g[256];
+};
+
+static struct gear_table make_gear(void) {
+	struct gear_table t;
+	unsigned long long x = 0x6a09e667f3bcc908ULL;
+
+	for (int i = 0; i < 256; i++) {
+		unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		t.g[i] = z ^ (z >> 31);
+	}
+	return t;
+}
+
+static const struct gear_table gear = make_gear();
+
+/* cdc_init(self, min, avg, max)
+ * The masks test the top bits of the hash, which depend on the last 64 bytes
+ * hashed; one bit more than log2(avg) before avg bytes and one bit less
+ * after it (FastCDC's normalised chunking, at level 1). */
+int cdc_init(struct cdc_params *p, size_t min, size_t avg, size_t max) {
+	int bits = 0;
+
+	if (avg < 64 || (avg & (avg - 1)) || min > avg || avg > max || min < 1)
+		return -1;
+	while ((1ULL << bits) < avg)
+		bits++;
+
+	p->min = min;
+	p->avg = avg;
+	p->max = max;
+	p->mask_s = ~0ULL << (64 - (bits + 1));
+	p->mask_l = ~0ULL << (64 - (bits - 1));
+	return 0;
+}
+
+/* cdc_cut(self, data, len)
+ * The first min bytes are skipped without hashing, as no cut can fall in
+ * them. */
+size_t cdc_cut(const struct cdc_params *p, const unsigned char *data, size_t len) {
+	size_t n = len < p->max ? len : p->max;
+	size_t normal = n < p->avg ? n : p->avg;
+	unsigned long long h = 0;
+	size_t i = p->min;
+
+	if (len <= p->min)
+		return len;
+
+	for (; i < normal; i++) {
+		h = (h << 1) + gear.g[data[i]];
+		if (!(h & p->mask_s))
+			return i + 1;
+	}
+	for (; i < n; i++) {
+		h = (h << 1) + gear.g[data[i]];
+		if (!(h & p->mask_l))
+			return i + 1;
+	}
+	return n;
+}
@@ -0,0 +1,33 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+
+/* Content-defined chunking, as in FastCDC: a file is cut into chunks where a
+ * gear hash of the data before the cut point has enough zero bits, so a cut
+ * depends only on the bytes near it. An insert or delete then only changes
+ * the chunks around it, and the chunks after it are found again however far
+ * they moved, without looking at every offset.
+ *
+ * Chunks are at least min and at most max bytes. The cut condition is harder
+ * to meet before avg bytes and easier after it, which keeps most chunks
+ * close to avg. zsyncmake and the client must use the same parameters, which
+ * the control file's Chunking header gives. */
+
+struct cdc_params {
+	size_t min, avg, max;
+	unsigned long long mask_s;	/* Mask of the bits that must be zero to cut
+								 * before avg bytes */
+	unsigned long long mask_l;	/* ... and after */
+};
+
+/* Set up the parameters; returns -1 if they are nonsensical (avg must be a
+ * power of two, and min <= avg <= max) */
+int cdc_init(struct cdc_params *p, size_t min, size_t avg, size_t max);
+
+/* Length of the chunk at the start of data, given len bytes of it. The data
+ * must run to at least max bytes, or to the end of the file, so that the cut
+ * doesn't depend on how much of the file the caller has at hand. */
+size_t cdc_cut(const struct cdc_params *p, const unsigned char *data, size_t len);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The strong checksums of blocks. Which algorithm a control file uses is
+ * given by its Hash-Algo header; MD4 if there is none. The faster ones are
+ * only available if zsync was built with the library for them (see the
+ * Makefile). All produce CHECKSUM_SIZE bytes, of which the control file
+ * carries the leading checksum_bytes. */
+
+#include <string.h>
+#include <strings.h>
+
+#include "rcksum.h"
+#include "md4.h"
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+static const char *const hash_names[] = {
+	"MD4",
+	"XXH3-128",
+	"BLAKE3",
+};
+
+/* rcksum_hash_by_name(name)
+ * Returns the RCKSUM_HASH_ value for the named algorithm, or -1 if it is not
+ * one we know or not one this build supports. */
+int rcksum_hash_by_name(const char *name) {
+	for (int i = 0; i < (int)(sizeof hash_names / sizeof hash_names[0]); i++) {
+		if (!strcasecmp(name, hash_names[i]))
+			return rcksum_hash_supported(i) ? i : -1;
+	}
+	return -1;
+}
+
+const char *rcksum_hash_name(int hash) {
+	return hash_names[hash];
+}
+
+/* rcksum_hash_supported(hash)
+ * Whether this build can calculate checksums with the given algorithm. */
+int rcksum_hash_supported(int hash) {
+	switch (hash) {
+	case RCKSUM_HASH_MD4:
+		return 1;
+#ifdef HAVE_XXHASH
+	case RCKSUM_HASH_XXH3_128:
+		return 1;
+#endif
+#ifdef HAVE_BLAKE3
+	case RCKSUM_HASH_BLAKE3:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* rcksum_calc_checksum(hash, checksum_buf, data, len)
+ * Returns the strong checksum (in checksum_buf, CHECKSUM_SIZE bytes) of the
+ * given data block with the given algorithm, which must be supported. */
+void rcksum_calc_checksum(int hash, unsigned char *c, const unsigned char *data,
+						  size_t len) {
+	switch (hash) {
+#ifdef HAVE_XXHASH
+	case RCKSUM_HASH_XXH3_128: {
+		XXH128_canonical_t canon;
+
+		XXH128_canonicalFromHash(&canon, XXH3_128bits(data, len));
+		memcpy(c, canon.digest, CHECKSUM_SIZE);
+		break;
+	}
+#endif
+#ifdef HAVE_BLAKE3
+	case RCKSUM_HASH_BLAKE3: {
+		blake3_hasher hasher;
+
+		blake3_hasher_init(&hasher);
+		blake3_hasher_update(&hasher, data, len);
+		blake3_hasher_finalize(&hasher, c, CHECKSUM_SIZE);
+		break;
+	}
+#endif
+	default: {
+		struct md4_ctx ctx;
+
+		MD4Init(&ctx);
+		MD4Update(&ctx, data, len);
+		MD4Final(c, &ctx);
+		break;
+	}
+	}
+}
@@ -0,0 +1,198 @@
+/* Compression of literal data for the upload; see compress.h. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+static const char *const codec_names[] = {
+	"none",
+	"deflate",
+	"zstd",
+};
+
+struct compressor {
+	int codec;
+	int level;
+	z_stream zs;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+/* compress_by_name(name)
+ * Returns the COMPRESS_ value for the named codec, or -1 if it is not one we
+ * know. */
+int compress_by_name(const char *name) {
+	for (int i = 0; i < (int)(sizeof codec_names / sizeof codec_names[0]); i++) {
+		if (!strcasecmp(name, codec_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+const char *compress_name(int codec) {
+	return codec_names[codec];
+}
+
+/* compress_supported(codec)
+ * Whether this build can (de)compress with the given codec. */
+int compress_supported(int codec) {
+	switch (codec) {
+	case COMPRESS_NONE:
+	case COMPRESS_DEFLATE:
+		return 1;
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+size_t compress_max_dict(int codec) {
+	switch (codec) {
+	case COMPRESS_DEFLATE:
+		return COMPRESS_MAX_DICT_DEFLATE;
+	case COMPRESS_ZSTD:
+		return COMPRESS_MAX_DICT_ZSTD;
+	default:
+		return 0;
+	}
+}
+
+/* compressor_new(codec, level)
+ * Returns a compressor for the given (supported) codec, or NULL if out of
+ * memory. A level of 0 means the codec's default. */
+struct compressor *compressor_new(int codec, int level) {
+	struct compressor *c = (struct compressor *)calloc(1, sizeof *c);
+	if (!c)
+		return NULL;
+
+	c->codec = codec;
+	c->level = level;
+
+	switch (codec) {
+	case COMPRESS_DEFLATE:
+		/* Raw deflate; the request says what it is, so no zlib header */
+		if (deflateInit2(&c->zs, level ? level : Z_DEFAULT_COMPRESSION,
+						 Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(c);
+			return NULL;
+		}
+		break;
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		c->zstd = ZSTD_createCCtx();
+		if (!c->zstd) {
+			free(c);
+			return NULL;
+		}
+		ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel,
+							   level ? level : ZSTD_CLEVEL_DEFAULT);
+		break;
+#endif
+	}
+	return c;
+}
+
+void compressor_free(struct compressor *c) {
+	if (!c)
+		return;
+	if (c->codec == COMPRESS_DEFLATE)
+		deflateEnd(&c->zs);
+#ifdef HAVE_ZSTD
+	if (c->codec == COMPRESS_ZSTD)
+		ZSTD_freeCCtx(c->zstd);
+#endif
+	free(c);
+}
+
+int compressor_codec(const struct compressor *c) {
+	return c->codec;
+}
+
+/* compress_block(self, out, outlen, in, len, dict, dictlen)
+ * See compress.h. The dictionary is at most compress_max_dict() bytes. */
+size_t compress_block(struct compressor *c, unsigned char *out, size_t outlen,
+					  const unsigned char *in, size_t len,
+					  const unsigned char *dict, size_t dictlen) {
+	size_t n = 0;
+
+	switch (c->codec) {
+	case COMPRESS_DEFLATE:
+		deflateReset(&c->zs);
+		if (dictlen && deflateSetDictionary(&c->zs, dict, dictlen) != Z_OK)
+			return 0;
+		c->zs.next_in = (Bytef *)in;
+		c->zs.avail_in = len;
+		c->zs.next_out = out;
+		c->zs.avail_out = outlen;
+		if (deflate(&c->zs, Z_FINISH) != Z_STREAM_END)
+			return 0;
+		n = outlen - c->zs.avail_out;
+		break;
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		/* The dictionary is just raw content, referenced for this block */
+		if (dictlen && ZSTD_isError(ZSTD_CCtx_refPrefix(c->zstd, dict, dictlen)))
+			return 0;
+		n = ZSTD_compress2(c->zstd, out, outlen, in, len);
+		if (ZSTD_isError(n))
+			return 0;
+		break;
+#endif
+	}
+	return n < len ? n : 0;
+}
+
+/* decompress_block(codec, out, outlen, in, len, dict, dictlen)
+ * See compress.h. */
+int decompress_block(int codec, unsigned char *out, size_t outlen,
+					 const unsigned char *in, size_t len,
+					 const unsigned char *dict, size_t dictlen) {
+	switch (codec) {
+	case COMPRESS_DEFLATE: {
+		z_stream zs;
+		int rc;
+
+		memset(&zs, 0, sizeof zs);
+		if (inflateInit2(&zs, -15) != Z_OK)
+			return -1;
+		if (dictlen && inflateSetDictionary(&zs, dict, dictlen) != Z_OK) {
+			inflateEnd(&zs);
+			return -1;
+		}
+		zs.next_in = (Bytef *)in;
+		zs.avail_in = len;
+		zs.next_out = out;
+		zs.avail_out = outlen;
+		rc = inflate(&zs, Z_FINISH);
+		inflateEnd(&zs);
+		return rc == Z_STREAM_END && !zs.avail_out ? 0 : -1;
+	}
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD: {
+		ZSTD_DCtx *d = ZSTD_createDCtx();
+		size_t n;
+
+		if (!d)
+			return -1;
+		if (dictlen)
+			ZSTD_DCtx_refPrefix(d, dict, dictlen);
+		n = ZSTD_decompressDCtx(d, out, outlen, in, len);
+		ZSTD_freeDCtx(d);
+		return !ZSTD_isError(n) && n == outlen ? 0 : -1;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
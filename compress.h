@@ -0,0 +1,43 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/* Compression of literal data for the upload. deflate (zlib) is always
+ * available; zstd if built with it (see the Makefile). Either can be primed
+ * with a dictionary of bytes the server already has, namely the part of the
+ * new file just before the data. */
+
+#include <stddef.h>
+
+enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_DEFLATE = 1,
+	COMPRESS_ZSTD = 2,
+};
+
+/* Most dictionary bytes worth using: zlib's window is 32 KB */
+#define COMPRESS_MAX_DICT_DEFLATE 32768
+#define COMPRESS_MAX_DICT_ZSTD (128 * 1024)
+
+int compress_by_name(const char *name);
+const char *compress_name(int codec);
+int compress_supported(int codec);
+size_t compress_max_dict(int codec);
+
+/* Compressing state for one codec and level, reused across blocks */
+struct compressor;
+struct compressor *compressor_new(int codec, int level);
+void compressor_free(struct compressor *c);
+int compressor_codec(const struct compressor *c);
+
+/* Compress len bytes into out (of outlen bytes). Returns the compressed
+ * length, or 0 if it failed or the data wouldn't get any smaller. */
+size_t compress_block(struct compressor *c, unsigned char *out, size_t outlen,
+					  const unsigned char *in, size_t len,
+					  const unsigned char *dict, size_t dictlen);
+
+/* Decompress exactly outlen bytes; returns 0 if successful. */
+int decompress_block(int codec, unsigned char *out, size_t outlen,
+					 const unsigned char *in, size_t len,
+					 const unsigned char *dict, size_t dictlen);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+/* The delta instruction stream: all the moves and adds of a sync sent as one
+ * request body, instead of a request each.
+ *
+ * The stream is DELTA_MAGIC, the length of the new file as a varint, then
+ * instructions. Each is a one byte opcode followed by varint arguments:
+ *   DELTA_COPY from to len   copy len bytes at from in the old file to to
+ *   DELTA_DATA to len bytes  len bytes of literal data for offset to
+ *   DELTA_ZDATA to len codec dictlen zlen bytes
+ *                            as DATA, compressed to zlen bytes with a codec
+ *                            from compress.h, whose dictionary is the
+ *                            dictlen bytes of the new file before to
+ *   DELTA_DISCARD from len   no copy reads the len bytes at from in the old
+ *                            file, so they may be freed; these come before
+ *                            any other instruction
+ *   DELTA_END                end of the stream
+ * The new file starts out as the old one, cut or zero extended to its
+ * length; copies read from the old file as it was before the sync.
+ * Instructions are applied in order, so a dictionary is whatever the new
+ * file holds by then.
+ *
+ * A stream with discards can instead be applied to the old file in place,
+ * without keeping a copy of it: extend the file first if it grows, apply the
+ * instructions in order, copies as by memmove, and cut it to length last.
+ * Its copies are ordered so that none reads what an earlier one wrote, and
+ * what cycles of copies would have overwritten is sent as data instead,
+ * after all the copies.
+ *
+ * Varints are LEB128: 7 bits a byte, least significant first, with the top
+ * bit set on every byte but the last. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DELTA_MAGIC "ZSDELTA1"
+#define DELTA_MAGIC_LEN 8
+
+enum {
+	DELTA_END = 0,
+	DELTA_COPY = 1,
+	DELTA_DATA = 2,
+	DELTA_ZDATA = 3,
+	DELTA_DISCARD = 4,
+};
+
+/* Longest varint, and longest instruction (not counting DATA's bytes) */
+#define DELTA_MAX_VARINT 10
+#define DELTA_MAX_OP (1 + 3 * DELTA_MAX_VARINT)
+#define DELTA_MAX_ZOP (1 + 5 * DELTA_MAX_VARINT)
+
+/* delta_put_varint(buf, value)
+ * Write value as a varint; returns the number of bytes written. */
+static inline size_t delta_put_varint(unsigned char *p, uint64_t v) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (unsigned char)v;
+	return n;
+}
+
+/* delta_get_varint(stream, &value)
+ * Read a varint; returns 0 at the end of the stream or on a bad varint. */
+static inline int delta_get_varint(FILE *f, uint64_t *v) {
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = getc(f);
+
+		if (c == EOF)
+			return 0;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 1;
+	}
+	return 0;
+}
+
+/* delta_put_copy(buf, from, to, len)
+ * Write a COPY instruction; returns its length. */
+static inline size_t delta_put_copy(unsigned char *p, uint64_t from, uint64_t to, uint64_t len) {
+	size_t n = 0;
+
+	p[n++] = DELTA_COPY;
+	n += delta_put_varint(p + n, from);
+	n += delta_put_varint(p + n, to);
+	n += delta_put_varint(p + n, len);
+	return n;
+}
+
+/* delta_put_discard(buf, from, len)
+ * Write a DISCARD instruction; returns its length. */
+static inline size_t delta_put_discard(unsigned char *p, uint64_t from, uint64_t len) {
+	size_t n = 0;
+
+	p[n++] = DELTA_DISCARD;
+	n += delta_put_varint(p + n, from);
+	n += delta_put_varint(p + n, len);
+	return n;
+}
+
+/* delta_put_data(buf, to, len)
+ * Write the start of a DATA instruction; the len bytes of data follow it. */
+static inline size_t delta_put_data(unsigned char *p, uint64_t to, uint64_t len) {
+	size_t n = 0;
+
+	p[n++] = DELTA_DATA;
+	n += delta_put_varint(p + n, to);
+	n += delta_put_varint(p + n, len);
+	return n;
+}
+
+/* delta_put_zdata(buf, to, len, codec, dictlen, zlen)
+ * Write the start of a ZDATA instruction; the zlen bytes follow it. */
+static inline size_t delta_put_zdata(unsigned char *p, uint64_t to, uint64_t len, int codec,
+									 uint64_t dictlen, uint64_t zlen) {
+	size_t n = 0;
+
+	p[n++] = DELTA_ZDATA;
+	n += delta_put_varint(p + n, to);
+	n += delta_put_varint(p + n, len);
+	n += delta_put_varint(p + n, codec);
+	n += delta_put_varint(p + n, dictlen);
+	n += delta_put_varint(p + n, zlen);
+	return n;
+}
+
+#endif
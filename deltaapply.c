@@ -0,0 +1,247 @@
+/* deltaapply - reference decoder for the delta instruction stream.
+ *
+ * Applies a stream as the upload client sends it in delta mode (see delta.h)
+ * to a copy of the old file, the way the server does, so that the client can
+ * be tested without one. With -i, a stream with discards is applied to the
+ * old file in place instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+#include "compress.h"
+
+/* copy_range(old, new, from, to, len)
+ * Copy len bytes at from in the old file to to in the new one. Reads past the
+ * end of the old file give zeros. If they are the same file, the copy is done
+ * as by memmove: back to front when the target overlaps the end of the
+ * source. */
+static int copy_range(int oldfd, int newfd, off_t from, off_t to, uint64_t len) {
+	char buf[65536];
+	int backwards = oldfd == newfd && to > from && (uint64_t)(to - from) < len;
+
+	while (len) {
+		size_t n = len < sizeof buf ? len : sizeof buf;
+		off_t at = backwards ? (off_t)(len - n) : 0;
+		ssize_t r = pread(oldfd, buf, n, from + at);
+
+		if (r < 0)
+			return -1;
+		memset(buf + r, 0, n - r);
+		if (pwrite(newfd, buf, n, to + at) != (ssize_t)n)
+			return -1;
+		if (!backwards) {
+			from += n;
+			to += n;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* write_data(stream, new, to, len)
+ * Write the next len bytes of the stream to to in the new file. */
+static int write_data(FILE *f, int newfd, off_t to, uint64_t len) {
+	char buf[65536];
+
+	while (len) {
+		size_t n = len < sizeof buf ? len : sizeof buf;
+
+		if (fread(buf, 1, n, f) != n)
+			return -1;
+		if (pwrite(newfd, buf, n, to) != (ssize_t)n)
+			return -1;
+		to += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* write_zdata(stream, new, to, len, codec, dictlen, zlen)
+ * Decompress the next zlen bytes of the stream to len bytes at to in the new
+ * file, with the dictlen bytes before it there as the dictionary. */
+static int write_zdata(FILE *f, int newfd, off_t to, uint64_t len, uint64_t codec,
+					   uint64_t dictlen, uint64_t zlen) {
+	unsigned char *in = (unsigned char *)malloc(zlen ? zlen : 1);
+	unsigned char *dict = (unsigned char *)malloc(dictlen ? dictlen : 1);
+	unsigned char *out = (unsigned char *)malloc(len ? len : 1);
+	int rc = -1;
+
+	if (in && dict && out && fread(in, 1, zlen, f) == zlen
+		&& pread(newfd, dict, dictlen, to - dictlen) == (ssize_t)dictlen
+		&& decompress_block(codec, out, len, in, zlen, dict, dictlen) == 0
+		&& pwrite(newfd, out, len, to) == (ssize_t)len) {
+		rc = 0;
+	}
+	free(in);
+	free(dict);
+	free(out);
+	return rc;
+}
+
+/* The ranges of the old file that the stream discarded, in order */
+struct discards {
+	uint64_t *r;				/* Start and end of each */
+	size_t n, alloc;
+};
+
+/* add_discard(self, from, len)
+ * Note a discarded range; returns -1 if it isn't after the last one. */
+static int add_discard(struct discards *d, uint64_t from, uint64_t len) {
+	if (d->n && from < d->r[2 * d->n - 1])
+		return -1;
+	if (d->n == d->alloc) {
+		size_t alloc = d->alloc ? 2 * d->alloc : 64;
+		uint64_t *r = (uint64_t *)realloc(d->r, 2 * alloc * sizeof *r);
+
+		if (!r)
+			return -1;
+		d->r = r;
+		d->alloc = alloc;
+	}
+	d->r[2 * d->n] = from;
+	d->r[2 * d->n + 1] = from + len;
+	d->n++;
+	return 0;
+}
+
+/* discarded(self, from, len)
+ * Returns whether any of the len bytes at from were discarded. */
+static int discarded(const struct discards *d, uint64_t from, uint64_t len) {
+	size_t lo = 0, hi = d->n;
+
+	/* The first range ending after from */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (d->r[2 * mid + 1] <= from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < d->n && d->r[2 * lo] < from + len;
+}
+
+int main(int argc, char **argv) {
+	int in_place = argc == 4 && !strcmp(argv[1], "-i");
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s <old file> <delta|-> <new file>\n"
+				"       %s -i <file> <delta|->\n", argv[0], argv[0]);
+		return 1;
+	}
+	const char *oldname = argv[1 + in_place];
+	const char *deltaname = argv[2 + in_place];
+	const char *newname = in_place ? oldname : argv[3];
+
+	int oldfd = open(oldname, in_place ? O_RDWR : O_RDONLY);
+	if (oldfd == -1) {
+		perror(oldname);
+		return 1;
+	}
+	FILE *f = strcmp(deltaname, "-") ? fopen(deltaname, "rb") : stdin;
+	if (!f) {
+		perror(deltaname);
+		return 1;
+	}
+	int newfd = in_place ? oldfd : open(newname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (newfd == -1) {
+		perror(newname);
+		return 1;
+	}
+
+	char magic[DELTA_MAGIC_LEN];
+	uint64_t len;
+	if (fread(magic, 1, DELTA_MAGIC_LEN, f) != DELTA_MAGIC_LEN
+		|| memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_LEN) || !delta_get_varint(f, &len)) {
+		fprintf(stderr, "%s: not a delta stream\n", deltaname);
+		return 1;
+	}
+
+	/* The new file starts out as the old one, cut or extended to length. In
+	 * place, it is only extended now, as copies may still read past the new
+	 * length, and cut at the end. */
+	struct stat st;
+	if (in_place ? fstat(oldfd, &st) != 0 || ((off_t)len > st.st_size && ftruncate(oldfd, len) != 0)
+		: copy_range(oldfd, newfd, 0, 0, len) != 0) {
+		perror(newname);
+		return 1;
+	}
+
+	/* The server may have freed discarded ranges of the old file, so a copy
+	 * from one is an error */
+	struct discards disc = { NULL, 0, 0 };
+	long copies = 0, datas = 0;
+	for (;;) {
+		int op = getc(f);
+		uint64_t a, b, c, d, e;
+
+		if (op == DELTA_END) {
+			break;
+		}
+		else if (op == DELTA_DISCARD && delta_get_varint(f, &a) && delta_get_varint(f, &b)) {
+			if (copies || datas || add_discard(&disc, a, b) != 0) {
+				fprintf(stderr, "discard out of order in delta stream\n");
+				return 1;
+			}
+		}
+		else if (op == DELTA_COPY && delta_get_varint(f, &a) && delta_get_varint(f, &b) && delta_get_varint(f, &c)) {
+			if (in_place && !disc.n) {
+				fprintf(stderr, "%s: no discards, so can't be applied in place\n", deltaname);
+				return 1;
+			}
+			if (discarded(&disc, a, c)) {
+				fprintf(stderr, "copy from a discarded range\n");
+				return 1;
+			}
+			/* Don't write past the end of the new file */
+			if (b < len && copy_range(oldfd, newfd, a, b, c < len - b ? c : len - b) != 0) {
+				perror("copy");
+				return 1;
+			}
+			copies++;
+		}
+		else if (op == DELTA_DATA && delta_get_varint(f, &b) && delta_get_varint(f, &c)) {
+			if (b + c > len) {
+				fprintf(stderr, "data past the end of the file\n");
+				return 1;
+			}
+			if (write_data(f, newfd, b, c) != 0) {
+				fprintf(stderr, "short data in delta stream\n");
+				return 1;
+			}
+			datas++;
+		}
+		else if (op == DELTA_ZDATA && delta_get_varint(f, &b) && delta_get_varint(f, &c) && delta_get_varint(f, &a)
+				 && delta_get_varint(f, &d) && delta_get_varint(f, &e)) {
+			if (b + c > len || d > b || !compress_supported(a)) {
+				fprintf(stderr, "bad compressed data in delta stream\n");
+				return 1;
+			}
+			if (write_zdata(f, newfd, b, c, a, d, e) != 0) {
+				fprintf(stderr, "corrupt compressed data in delta stream\n");
+				return 1;
+			}
+			datas++;
+		}
+		else {
+			fprintf(stderr, "%s: bad instruction %d in delta stream\n", deltaname, op);
+			return 1;
+		}
+	}
+
+	printf("%ld copies, %ld data, %lu discards\n", copies, datas, (unsigned long)disc.n);
+	free(disc.r);
+	if ((in_place && ftruncate(newfd, len) != 0) || close(newfd) != 0) {
+		perror(newname);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,315 @@
+#include "download.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* One ranged GET, and the state of parsing its response */
+struct range_request {
+	download *d;
+	vector<off_t> ranges;		/* First and last byte of each range */
+	off_t want, got;			/* Bytes of range data asked for and received */
+	struct curl_slist *headers;
+
+	long status;				/* Of the response */
+	string boundary;			/* Of a multipart response, else empty */
+	off_t pos, left;			/* Where the next data goes, and how much more
+								 * goes there (-1 for up to the end) */
+	bool in_headers;			/* In the headers of a part */
+	off_t part_pos, part_len;	/* From the part's Content-Range */
+	string line;				/* A part's boundary or header so far */
+};
+
+download::download(const char *host, const char *user, const char *pass, const char *path) {
+	_url = host;
+	_url = _url + "/remote.php/webdav/" + path;
+	_user = user;
+	_pass = pass;
+	_gap = DOWNLOAD_GAP;
+	_fd = -1;
+	_requests = 0;
+	_bytes = 0;
+}
+
+/* parse_range(text, &first, &last)
+ * Parse the value of a Content-Range header: "bytes first-last/length". */
+static bool parse_range(const char *p, off_t *first, off_t *last) {
+	long long a, b;
+
+	while (*p == ' ')
+		p++;
+	if (strncasecmp(p, "bytes ", 6) || sscanf(p + 6, "%lld-%lld", &a, &b) != 2 || b < a)
+		return false;
+	*first = a;
+	*last = b;
+	return true;
+}
+
+/* header(line, size, nitems, request)
+ * Called for each response header line; notes the status, and where the
+ * data goes or how it is split into parts. */
+size_t download::header(char *buf, size_t size, size_t nitems, void *userdata) {
+	struct range_request *r = (struct range_request *)userdata;
+	size_t n = size * nitems;
+	string line(buf, n);
+
+	while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+		line.pop_back();
+
+	/* A new response (after a redirect or 100 Continue) starts over */
+	if (!strncmp(line.c_str(), "HTTP/", 5)) {
+		size_t sp = line.find(' ');
+
+		r->status = sp == string::npos ? 0 : atol(line.c_str() + sp + 1);
+		r->boundary.clear();
+		r->pos = 0;
+		r->left = -1;
+		r->in_headers = false;
+		r->line.clear();
+	}
+	else if (!strncasecmp(line.c_str(), "Content-Range:", 14)) {
+		off_t first, last;
+
+		if (parse_range(line.c_str() + 14, &first, &last)) {
+			r->pos = first;
+			r->left = last - first + 1;
+		}
+	}
+	else if (!strncasecmp(line.c_str(), "Content-Type:", 13)) {
+		size_t b = line.find("boundary=");
+
+		if (strcasestr(line.c_str(), "multipart/byteranges") && b != string::npos) {
+			r->boundary = line.substr(b + 9);
+			r->boundary = r->boundary.substr(0, r->boundary.find(';'));
+			if (r->boundary.size() >= 2 && r->boundary[0] == '"')
+				r->boundary = r->boundary.substr(1, r->boundary.size() - 2);
+			r->left = 0;
+		}
+	}
+	return n;
+}
+
+/* body(data, size, nmemb, request)
+ * Write range data to where it belongs as it arrives. In a multipart
+ * response, the boundary and header lines between parts are collected a
+ * line at a time, and say where the following data goes. */
+size_t download::body(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	struct range_request *r = (struct range_request *)userdata;
+	size_t n = size * nmemb, i = 0;
+
+	/* An error page, or a server that ignored the ranges and sent all of
+	 * the file (which is written as it comes, from the start) */
+	if (r->status != 206 && r->status != 200)
+		return n;
+
+	/* A 206 must say where its data goes; without a range, it isn't the
+	 * start of the file */
+	if (r->status == 206 && r->left < 0 && r->boundary.empty()) {
+		fprintf(stderr, "206 response without a Content-Range\n");
+		return 0;
+	}
+
+	while (i < n) {
+		if (r->left) {
+			size_t w = n - i;
+
+			if (r->left > 0 && (off_t)w > r->left)
+				w = r->left;
+			if (pwrite(r->d->_fd, ptr + i, w, r->pos) != (ssize_t)w) {
+				perror("write");
+				return 0;
+			}
+			r->pos += w;
+			r->got += w;
+			if (r->left > 0)
+				r->left -= w;
+			i += w;
+			continue;
+		}
+
+		/* A single range that is complete has nothing after it */
+		if (r->boundary.empty())
+			return n;
+
+		char c = ptr[i++];
+		if (c != '\n') {
+			if (c != '\r' && r->line.size() < 1024)
+				r->line += c;
+			continue;
+		}
+
+		if (r->line == "--" + r->boundary) {
+			r->in_headers = true;
+			r->part_pos = -1;
+		}
+		else if (r->in_headers && r->line.empty()) {
+			/* End of the part's headers: its data follows */
+			r->in_headers = false;
+			if (r->part_pos < 0) {
+				fprintf(stderr, "part without a Content-Range in multipart response\n");
+				return 0;
+			}
+			r->pos = r->part_pos;
+			r->left = r->part_len;
+		}
+		else if (r->in_headers && !strncasecmp(r->line.c_str(), "Content-Range:", 14)) {
+			off_t first, last;
+
+			if (parse_range(r->line.c_str() + 14, &first, &last)) {
+				r->part_pos = first;
+				r->part_len = last - first + 1;
+			}
+		}
+		r->line.clear();
+	}
+	return n;
+}
+
+/* start_request(request)
+ * Returns a handle for the request, set up to ask for its ranges. */
+CURL *download::start_request(struct range_request *r) {
+	CURL *h = curl_easy_init();
+	string range = "Range: bytes=";
+
+	for (size_t i = 0; i < r->ranges.size(); i += 2) {
+		range += (i ? "," : "") + to_string(r->ranges[i]) + "-" + to_string(r->ranges[i + 1]);
+	}
+	r->headers = curl_slist_append(NULL, range.c_str());
+
+	curl_easy_setopt(h, CURLOPT_URL, _url.c_str());
+	curl_easy_setopt(h, CURLOPT_USERNAME, _user);
+	curl_easy_setopt(h, CURLOPT_PASSWORD, _pass);
+	curl_easy_setopt(h, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(h, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(h, CURLOPT_PIPEWAIT, 1L);
+	curl_easy_setopt(h, CURLOPT_HTTPHEADER, r->headers);
+	curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, header);
+	curl_easy_setopt(h, CURLOPT_HEADERDATA, r);
+	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, body);
+	curl_easy_setopt(h, CURLOPT_WRITEDATA, r);
+	curl_easy_setopt(h, CURLOPT_PRIVATE, r);
+
+	r->d = this;
+	r->got = 0;
+	r->status = 0;
+	r->left = -1;
+	return h;
+}
+
+/* fetch(ranges, nrange, fd, window)
+ * Split the ranges, joined where they are close, into requests of up to
+ * DOWNLOAD_RANGES each, and keep up to window of them running until all are
+ * done. */
+int download::fetch(const off_t *ranges, int nrange, int fd, int window) {
+	vector<struct range_request> reqs;
+	int failed = 0, whole = 0;
+
+	if (!nrange)
+		return 0;
+
+	for (int i = 0; i < nrange; i++) {
+		off_t first = ranges[2 * i], last = ranges[2 * i + 1];
+
+		if (!reqs.empty()) {
+			vector<off_t> &rs = reqs.back().ranges;
+
+			if (first - rs.back() - 1 <= (off_t)_gap) {
+				reqs.back().want += last - rs.back();
+				rs.back() = last;
+				continue;
+			}
+		}
+		if (reqs.empty() || reqs.back().ranges.size() == 2 * DOWNLOAD_RANGES) {
+			reqs.emplace_back();
+			reqs.back().want = 0;
+		}
+		reqs.back().ranges.push_back(first);
+		reqs.back().ranges.push_back(last);
+		reqs.back().want += last - first + 1;
+	}
+
+	_fd = fd;
+	if (window < 1)
+		window = 1;
+
+	CURLM *mh = curl_multi_init();
+	curl_multi_setopt(mh, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	vector<CURL *> active;
+	size_t next = 0;
+	for (;;) {
+		/* Once a server has sent the whole file, there is nothing left */
+		while (!whole && next < reqs.size() && (int)active.size() < window) {
+			active.push_back(start_request(&reqs[next++]));
+			curl_multi_add_handle(mh, active.back());
+		}
+		if (active.empty())
+			break;
+
+		int running;
+		curl_multi_perform(mh, &running);
+
+		CURLMsg *msg;
+		int left;
+		while ((msg = curl_multi_info_read(mh, &left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			CURL *h = msg->easy_handle;
+			struct range_request *r;
+			curl_easy_getinfo(h, CURLINFO_PRIVATE, (char **)&r);
+
+			/* A server may join ranges, and send more than we asked for */
+			if (msg->data.result != CURLE_OK) {
+				printf("ERROR %s\n", curl_easy_strerror(msg->data.result));
+				failed++;
+			}
+			else if (r->status == 200) {
+				whole = 1;
+			}
+			else if (r->status != 206 || r->got < r->want) {
+				printf("ERROR HTTP %ld, got %lld of %lld bytes\n", r->status,
+					   (long long)r->got, (long long)r->want);
+				failed++;
+			}
+			_bytes += r->got;
+			_requests++;
+
+			curl_multi_remove_handle(mh, h);
+			curl_easy_cleanup(h);
+			curl_slist_free_all(r->headers);
+			active.erase(find(active.begin(), active.end(), h));
+		}
+
+		/* The rest would only fetch what we have now */
+		if (whole) {
+			for (auto h = active.begin(); h != active.end(); h++) {
+				struct range_request *r;
+
+				curl_easy_getinfo(*h, CURLINFO_PRIVATE, (char **)&r);
+				curl_multi_remove_handle(mh, *h);
+				curl_easy_cleanup(*h);
+				curl_slist_free_all(r->headers);
+			}
+			active.clear();
+			break;
+		}
+		curl_multi_poll(mh, NULL, 0, 1000, NULL);
+	}
+	curl_multi_cleanup(mh);
+
+	size_t joined = 0;
+	for (auto r = reqs.begin(); r != reqs.end(); r++)
+		joined += r->ranges.size() / 2;
+	printf("Fetched %d ranges as %lu in %ld requests, %lld bytes%s\n", nrange, joined,
+		   _requests, (long long)_bytes, whole ? " (server sent the whole file)" : "");
+	return failed ? -1 : 0;
+}
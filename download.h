@@ -0,0 +1,59 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+using namespace std;
+
+/* Most ranges asked for in one request; servers refuse or ignore Range
+ * headers with too many (Apache's default MaxRanges is 200) */
+#define DOWNLOAD_RANGES 64
+
+/* Ranges this close together are fetched as one by default: the bytes
+ * in between cost less than the part header and share of a request that a
+ * separate range does */
+#define DOWNLOAD_GAP 4096
+
+struct range_request;
+
+/* Fetches byte ranges of the server's copy of a file with ranged GETs,
+ * writing them straight to their place in a local file. Ranges closer than
+ * the gap are fetched as one, and each request asks for up to
+ * DOWNLOAD_RANGES of them, which the server sends as a multipart response.
+ * Up to window requests are in flight at once, multiplexed over one
+ * connection where the server speaks HTTP/2. */
+class download {
+
+public:
+	download(const char *host, const char *user, const char *pass, const char *path);
+
+	/* Join ranges with at most gap bytes between them (default
+	 * DOWNLOAD_GAP) */
+	void set_gap(size_t gap) { _gap = gap; }
+
+	/* Fetch the nrange byte ranges, as pairs of first and last byte, into
+	 * fd, with at most window requests in flight. Returns 0 if all of them
+	 * arrived. */
+	int fetch(const off_t *ranges, int nrange, int fd, int window);
+
+private:
+	CURL *start_request(struct range_request *r);
+
+	static size_t header(char *buf, size_t size, size_t nitems, void *userdata);
+	static size_t body(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+	string _url;
+	const char *_user;
+	const char *_pass;
+	size_t _gap;
+	int _fd;
+
+	long _requests;
+	off_t _bytes;				/* Range data received */
+};
+
+#endif
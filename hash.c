@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <sys/types.h>
 
 #include "rcksum.h"
@@ -31,92 +32,362 @@
 void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b,
                              struct rsum r, void *checksum) {
     if (b < z->blocks) {
-        /* Get hash entry with checksums for this block */
-        struct hash_entry *e = &(z->blockhashes[b]);
-
         /* Enter checksums */
-        memcpy(e->checksum, checksum, z->checksum_bytes);
-        e->r.a = r.a & z->rsum_a_mask;
-        e->r.b = r.b;
+        memcpy(z->checksums + (size_t)b * z->checksum_bytes, checksum,
+               z->checksum_bytes);
+        z->rsums[b].a = r.a & z->rsum_a_mask;
+        z->rsums[b].b = r.b;
 
-        /* New checksums invalidate any existing checksum hash tables */
-        if (z->rsum_hash) {
-            free(z->rsum_hash);
-            z->rsum_hash = NULL;
-            free(z->bithash);
-            z->bithash = NULL;
-        }
+        /* New checksums invalidate any existing checksum hash tables, but
+         * build_hash rebuilds them, in place, before every scan */
+    }
+}
+
+/* chunk_rsum(checksum)
+ * The rsum that stands in for a chunk's in the hash table: the start of its
+ * checksum, which is as good a hash of it as any. */
+static struct rsum chunk_rsum(const unsigned char *c) {
+    struct rsum r;
+
+    r.a = c[0] << 8 | c[1];
+    r.b = c[2] << 8 | c[3];
+    return r;
+}
+
+/* rcksum_add_target_chunk(self, blockid, length, checksum)
+ * Sets the length and checksum of the given chunk of the target. Chunks must
+ * be added in order, as each starts where the one before it ends. */
+void rcksum_add_target_chunk(struct rcksum_state *z, zs_blockid b,
+                             size_t len, void *checksum) {
+    if (b < z->blocks) {
+        z->chunk_off[b + 1] = z->chunk_off[b] + len;
+        rcksum_add_target_block(z, b, chunk_rsum((const unsigned char *)checksum), checksum);
     }
 }
 
+/* bloom_update(self, blockid, delta)
+ * Add (delta 1) or remove (delta -1) a block from the Bloom filter. */
+static void bloom_update(struct rcksum_state *z, zs_blockid id, int delta) {
+    unsigned long long bits = bloom_bits(calc_rkey(z, z->rsums[id], z->rsums[id + 1]));
+    unsigned int w = bloom_word(z, bits);
+    unsigned char *count = z->bloomcount + (size_t)w * 32;
+
+    for (int i = 0; i < BLOOM_K; i++, bits >>= 6) {
+        unsigned int c = bits & 63;
+        int shift = c & 1 ? 4 : 0;
+        unsigned int v = (count[c >> 1] >> shift) & 0xf;
+
+        /* Two of the bits can coincide; and saturated counters have lost
+         * count, so can never go down again */
+        if (v == 0xf || (delta < 0 && v == 0))
+            continue;
+        v += delta;
+        count[c >> 1] += delta << shift;
+        if (v)
+            z->bloom[w] |= 1ULL << c;
+        else
+            z->bloom[w] &= ~(1ULL << c);
+    }
+}
+
+/* hash_geometry(self, num_blocks)
+ * Size the hash table and Bloom filter for the given number of blocks. */
+static void hash_geometry(struct rcksum_state *z, zs_blockid n) {
+    int i;
+
+    /* Size the Bloom filter for our false positive rate: about 1.44 log2(1/p)
+     * bits per block for an ideal filter, plus a third for the cost of
+     * keeping each value's bits within one word. */
+    {
+        double bits = (double)n * 1.44 * log2(1 / BLOOM_FPR) * 1.33;
+
+        z->bloomwords = (unsigned int)ceil(bits / 64);
+        if (z->bloomwords < 1)
+            z->bloomwords = 1;
+    }
+
+    /* The hash table is open-addressed, so it needs a slot per block; keep it
+     * at most half full so probe sequences stay short. */
+    for (i = 4; i < 32 && (1u << i) < 2u * n; i++);
+    z->hashmask = (i < 32 ? 1u << i : 0u) - 1;
+    z->hashshift = 32 - i;
+}
+
 /* build_hash(self)
  * Build hash tables to quickly lookup a block based on its rsum value.
  * Returns non-zero if successful.
  */
 int build_hash(struct rcksum_state *z) {
-    int i = 16;
-
-    /* Try hash size of 2^i; step down the value of i until we find a good size
-     */
-    while ((2 << (i - 1)) > z->blocks && i > 4)
-        i--;
-
-    /* Allocate hash based on rsum */
-    z->hashmask = (2 << i) - 1;
-    z->rsum_hash = (hash_entry **)calloc(z->hashmask + 1, sizeof *(z->rsum_hash));
-    if (!z->rsum_hash)
-        return 0;
-
-    /* Allocate bit-table based on rsum */
-    z->bithashmask = (2 << (i + BITHASHBITS)) - 1;
-    z->bithash = (unsigned char *)calloc(z->bithashmask + 1, 1);
-    if (!z->bithash) {
-        free(z->rsum_hash);
-        z->rsum_hash = NULL;
-        return 0;
+    /* Tables loaded with the control file are already built */
+    if (z->hash_ready) {
+        z->hash_ready = 0;
+        return 1;
+    }
+
+    /* Only the blocks we still need go in; the number of those never grows,
+     * so tables from an earlier scan are big enough to reuse */
+    hash_geometry(z, z->blocks - rcksum_blocks_got(z));
+
+    if (!z->rsum_hash) {
+        z->bloom = (unsigned long long *)arena_alloc(z->arena, (size_t)z->bloomwords * sizeof *(z->bloom));
+        z->bloomcount = (unsigned char *)arena_alloc(z->arena, (size_t)z->bloomwords * 32);
+        z->rsum_hash = (hash_slot *)arena_alloc(z->arena, ((size_t)z->hashmask + 1) * sizeof *(z->rsum_hash));
+        z->hash_next = (int *)arena_alloc(z->arena, (size_t)z->blocks * sizeof *(z->hash_next));
+        z->hash_prev = (int *)arena_alloc(z->arena, (size_t)z->blocks * sizeof *(z->hash_prev));
+        if (!z->bloom || !z->bloomcount || !z->rsum_hash || !z->hash_next || !z->hash_prev) {
+            z->rsum_hash = NULL;
+            return 0;
+        }
+    }
+    else {
+        memset(z->bloom, 0, (size_t)z->bloomwords * sizeof *(z->bloom));
+        memset(z->bloomcount, 0, (size_t)z->bloomwords * 32);
     }
+    memset(z->rsum_hash, 0xff, ((size_t)z->hashmask + 1) * sizeof *(z->rsum_hash));
 
     /* Now fill in the hash tables.
-     * Minor point: We do this in reverse order, because we're adding entries
-     * to the hash chains by prepending, so if we iterate over the data in
-     * reverse then the resulting hash chains have the blocks in normal order.
-     * That's improves our pattern of I/O when writing out identical blocks
-     * once we are processing data; we will write them in order. */
-    for (zs_blockid id = z->blocks; id > 0;) {
-        /* Decrement the loop variable here, and get the hash entry. */
-        struct hash_entry *e = z->blockhashes + (--id);
-	
-        /* Prepend to linked list for this hash entry */
-        unsigned int h = calc_rhash(z, e);
-        e->next = z->rsum_hash[h & z->hashmask];
-        z->rsum_hash[h & z->hashmask] = e;
-
-        /* And set relevant bit in the bithash to 1 */
-        z->bithash[(h & z->bithashmask) >> 3] |= 1 << (h & 7);
+     * Minor point: We do this in block order, so that blocks with the same
+     * hash value are found in normal order when probing. That improves our
+     * pattern of I/O when writing out identical blocks once we are processing
+     * data; we will write them in order. */
+    for (zs_blockid id = 0; id < z->blocks; id++) {
+        if (already_got_block(z, id)) {
+            z->hash_next[id] = z->hash_prev[id] = -1;
+            continue;
+        }
+
+        unsigned int h = calc_rhash(z, id);
+        unsigned int n = hash_slot_index(z, h);
+
+        /* Linear probe for this tag's chain, or an empty slot to start one */
+        while (z->rsum_hash[n].id != HASH_EMPTY && z->rsum_hash[n].tag != h)
+            n = (n + 1) & z->hashmask;
+
+        z->hash_next[id] = -1;
+        if (z->rsum_hash[n].id == HASH_EMPTY) {
+            z->rsum_hash[n].tag = h;
+            z->rsum_hash[n].id = (int)id;
+            z->hash_prev[id] = (int)id;
+        }
+        else {
+            /* Append, so the chain stays in block order */
+            int first = z->rsum_hash[n].id;
+            int last = z->hash_prev[first];
+
+            z->hash_next[last] = (int)id;
+            z->hash_prev[id] = last;
+            z->hash_prev[first] = (int)id;
+        }
+
+        /* And count it in the filter */
+        bloom_update(z, id, 1);
+    }
+    return 1;
+}
+
+/* The tables of an index image, in order, each starting at a multiple of
+ * INDEX_ALIGN bytes */
+#define INDEX_ALIGN 64
+#define INDEX_TABLES 5
+
+/* index_layout(self, offsets, sizes)
+ * Work out where each table goes in an index image: the hash slots,
+ * hash_next, hash_prev, the Bloom filter and its counters. Returns the size
+ * of the image. */
+static size_t index_layout(struct rcksum_state *z, size_t off[INDEX_TABLES], size_t size[INDEX_TABLES]) {
+    size_t len = 0;
+
+    hash_geometry(z, z->blocks);
+    size[0] = ((size_t)z->hashmask + 1) * sizeof *(z->rsum_hash);
+    size[1] = (size_t)z->blocks * sizeof *(z->hash_next);
+    size[2] = (size_t)z->blocks * sizeof *(z->hash_prev);
+    size[3] = (size_t)z->bloomwords * sizeof *(z->bloom);
+    size[4] = (size_t)z->bloomwords * 32;
+    for (int i = 0; i < INDEX_TABLES; i++) {
+        off[i] = len;
+        len = (len + size[i] + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+    }
+    return len;
+}
+
+size_t rcksum_index_size(struct rcksum_state *z) {
+    size_t off[INDEX_TABLES], size[INDEX_TABLES];
+
+    return index_layout(z, off, size);
+}
+
+/* rcksum_get_index(self, buf)
+ * Build the hash tables and copy them into buf, which has room for
+ * rcksum_index_size() bytes. Returns 0 if successful. */
+int rcksum_get_index(struct rcksum_state *z, void *buf) {
+    size_t off[INDEX_TABLES], size[INDEX_TABLES];
+    size_t len = index_layout(z, off, size);
+    const void *tables[INDEX_TABLES];
+
+    if (!build_hash(z))
+        return -1;
+    tables[0] = z->rsum_hash;
+    tables[1] = z->hash_next;
+    tables[2] = z->hash_prev;
+    tables[3] = z->bloom;
+    tables[4] = z->bloomcount;
+
+    memset(buf, 0, len);
+    for (int i = 0; i < INDEX_TABLES; i++)
+        memcpy((unsigned char *)buf + off[i], tables[i], size[i]);
+    return 0;
+}
+
+/* index_ok(self, slots, next, prev)
+ * Check the tables of an index image from a file before they are used to
+ * index the block sums: every id in them must be a block, or -1 (or for a
+ * slot, HASH_EMPTY or HASH_DELETED), and each chain must run forward in
+ * block order, as build_hash makes them, so that walking it ends. */
+static int index_ok(const struct rcksum_state *z, const struct hash_slot *slots,
+                    const int *next, const int *prev) {
+    for (size_t n = 0; n <= z->hashmask; n++) {
+        if (slots[n].id < HASH_DELETED || slots[n].id >= z->blocks)
+            return 0;
+    }
+    for (zs_blockid id = 0; id < z->blocks; id++) {
+        if (next[id] != -1 && (next[id] <= id || next[id] >= z->blocks))
+            return 0;
+        if (prev[id] < -1 || prev[id] >= z->blocks)
+            return 0;
     }
     return 1;
 }
 
+/* rcksum_use_index(self, buf, len)
+ * Use the index image in buf, made by rcksum_get_index for the same block
+ * sums, as the hash tables. Returns 0 if successful, or -1 if it isn't the
+ * right size for them or holds ids that aren't blocks; the tables are then
+ * built as usual. */
+int rcksum_use_index(struct rcksum_state *z, void *buf, size_t len) {
+    size_t off[INDEX_TABLES], size[INDEX_TABLES];
+    unsigned char *p = (unsigned char *)buf;
+
+    if (index_layout(z, off, size) != len)
+        return -1;
+    if (!index_ok(z, (const struct hash_slot *)(p + off[0]), (const int *)(p + off[1]),
+                  (const int *)(p + off[2])))
+        return -1;
+
+    z->rsum_hash = (struct hash_slot *)(p + off[0]);
+    z->hash_next = (int *)(p + off[1]);
+    z->hash_prev = (int *)(p + off[2]);
+    z->bloom = (unsigned long long *)(p + off[3]);
+    z->bloomcount = p + off[4];
+    z->hash_ready = 1;
+    return 0;
+}
+
+/* same_block(self, a, b)
+ * Whether blocks a and b have the same checksums, so that data matching one
+ * matches the other just as well. */
+static int same_block(const struct rcksum_state *z, zs_blockid a, zs_blockid b) {
+    return z->rsums[a].a == z->rsums[b].a && z->rsums[a].b == z->rsums[b].b
+        && !memcmp(get_checksum(z, a), get_checksum(z, b), z->checksum_bytes);
+}
+
+/* find_same_block(self, block_id, hint)
+ * Find a block in the hash table that is the same as the given one (e.g.
+ * another block of zeros) and that we haven't got yet, trying hint first and
+ * then the chain for its tag. Returns -1 if there is none. */
+zs_blockid find_same_block(const struct rcksum_state *z, zs_blockid id, zs_blockid hint) {
+    if (!z->hash_prev)
+        return -1;
+    if (hint >= 0 && hint < z->blocks && z->hash_prev[hint] != -1
+        && !already_got_block(z, hint) && same_block(z, id, hint))
+        return hint;
+
+    unsigned int h = calc_rhash(z, id);
+
+    for (unsigned int n = hash_slot_index(z, h);
+         z->rsum_hash[n].id != HASH_EMPTY;
+         n = (n + 1) & z->hashmask) {
+        const struct hash_slot *slot = &z->rsum_hash[n];
+
+        if (slot->tag != h || slot->id == HASH_DELETED)
+            continue;
+        for (zs_blockid b = slot->id; b != -1; b = z->hash_next[b]) {
+            if (!already_got_block(z, b) && same_block(z, id, b))
+                return b;
+        }
+        break;
+    }
+    return -1;
+}
+
+/* find_chunk(self, checksum, len)
+ * Find a chunk in the hash table with the given checksum and length, or -1
+ * if there is none. Of identical chunks, the first left is returned. */
+zs_blockid find_chunk(const struct rcksum_state *z, const unsigned char *checksum, size_t len) {
+    struct rsum r = chunk_rsum(checksum);
+    unsigned int h = calc_rhash2(calc_rkey(z, r, r));
+
+    for (unsigned int n = hash_slot_index(z, h);
+         z->rsum_hash[n].id != HASH_EMPTY;
+         n = (n + 1) & z->hashmask) {
+        const struct hash_slot *slot = &z->rsum_hash[n];
+
+        if (slot->tag != h || slot->id == HASH_DELETED)
+            continue;
+        for (zs_blockid b = slot->id; b != -1; b = z->hash_next[b]) {
+            if (block_len(z, b) == len
+                && !memcmp(get_checksum(z, b), checksum, z->checksum_bytes))
+                return b;
+        }
+        break;
+    }
+    return -1;
+}
+
 /* remove_block_from_hash(self, block_id)
  * Remove the given data block from the rsum hash table, so it won't be
- * returned in a hash lookup again (e.g. because we now have the data)
+ * returned in a hash lookup again (e.g. because we now have the data). It is
+ * unlinked from its tag's chain; a slot whose chain is left empty is marked
+ * deleted rather than emptied, so probe sequences running through it still
+ * reach the blocks after it.
  */
 void remove_block_from_hash(struct rcksum_state *z, zs_blockid id) {
-    struct hash_entry *t = &(z->blockhashes[id]);
+    /* Blocks out of the table have no chain */
+    if (!z->hash_prev || z->hash_prev[id] == -1)
+        return;
+
+    unsigned int h = calc_rhash(z, id);
+    unsigned int n = hash_slot_index(z, h);
+
+    for (; z->rsum_hash[n].id != HASH_EMPTY; n = (n + 1) & z->hashmask) {
+        struct hash_slot *slot = &z->rsum_hash[n];
 
-    struct hash_entry **p = &(z->rsum_hash[calc_rhash(z, t) & z->hashmask]);
+        if (slot->tag != h || slot->id == HASH_DELETED)
+            continue;
 
-    while (*p != NULL) {
-        if (*p == t) {
-            if (t == z->rover) {
-                z->rover = t->next;
+        /* Unlink it from the tag's chain */
+        int first = slot->id;
+        int next = z->hash_next[id];
+
+        if (id == first) {
+            if (next == -1) {
+                slot->id = HASH_DELETED;
+            }
+            else {
+                slot->id = next;
+                z->hash_prev[next] = z->hash_prev[id];
             }
-            *p = (*p)->next;
-            return;
         }
         else {
-            p = &((*p)->next);
+            int prev = z->hash_prev[id];
+
+            z->hash_next[prev] = next;
+            if (next == -1)
+                z->hash_prev[first] = prev;
+            else
+                z->hash_prev[next] = prev;
         }
+        z->hash_prev[id] = z->hash_next[id] = -1;
+        bloom_update(z, id, -1);
+        return;
     }
 }
-
@@ -19,20 +19,51 @@
 
 /* Two types of checksum -
  * rsum: rolling Adler-style checksum
- * checksum: hopefully-collision-resistant MD4 checksum of the block
+ * checksum: hopefully-collision-resistant checksum of the block, MD4 or
+ *           another algorithm given in the control file (see checksum.cpp)
  */
 
-#include <list>
-#include <map>
+#include <vector>
+
+#include "arena.h"
+#include "cdc.h"
 
 using namespace std;
 
-struct hash_entry {
-    struct hash_entry *next;    /* next entry with the same rsum */
-    struct rsum r;
-    unsigned char checksum[CHECKSUM_SIZE];
+/* A match: the data at offset in the source file is block id of the target */
+struct rcksum_match {
+    size_t offset;
+    zs_blockid id;
+};
+
+/* Counts of how far lookups got, kept per scan and added up afterwards */
+struct rcksum_stats {
+    long long lookups;          /* Offsets looked up in the filter */
+    long long filterhit;        /* ... that the filter let through */
+    long long hashhit;          /* ... that the hash table had a tag for */
+    long long rsumhit;          /* ... that a block had the same rsums for */
+    long long weakhit;          /* ... that matched a block's rsum */
+    long long checksummed;      /* Strong checksums calculated */
+    long long stronghit;        /* ... that matched */
+};
+
+/* A slot in the rsum hash table. The table is open-addressed with linear
+ * probing; tag is the full 32-bit calc_rhash value of the block, so most probes that
+ * are not for our block are rejected without touching the block's rsum.
+ * There is one slot per tag: blocks with the same tag (usually identical
+ * blocks, like runs of zeros) are chained from it through hash_next, so that
+ * neither building the table nor removing blocks from it has to probe past
+ * all the others. */
+struct hash_slot {
+    unsigned int tag;
+    int id;                     /* HASH_EMPTY, HASH_DELETED or the first block
+                                 * of the chain; ids fit, as there are at most
+                                 * RCKSUM_MAX_BLOCKS */
 };
 
+#define HASH_EMPTY   (-1)
+#define HASH_DELETED (-2)
+
 /* An rcksum_state contains the set of checksums of the blocks of a target
  * file, and is used to apply the rsync algorithm to detect data in common with
  * a local file. It essentially contains as rsum and a checksum per block of
@@ -40,81 +71,189 @@ struct hash_entry {
  * over data looking for matching blocks. */
 
 struct rcksum_state {
-    struct rsum r[2];           /* Current rsums */
-
     zs_blockid blocks;          /* Number of blocks in the target file */
     size_t blocksize;           /* And how many bytes per block */
     int blockshift;             /* log2(blocksize) */
     unsigned short rsum_a_mask; /* The mask to apply to rsum values before looking up */
-    int checksum_bytes;         /* How many bytes of the MD4 checksum are available */
+    int checksum_bytes;         /* How many bytes of the checksum are available */
+    int hash_algo;              /* RCKSUM_HASH_* algorithm of the checksums */
     int seq_matches;
 
     unsigned int context;       /* precalculated blocksize * seq_matches */
+    int threads;                /* Number of threads to scan source files with */
+
+    /* With content-defined chunking, the blocks are the chunks of the target
+     * (see cdc.h), and chunk_off has the offset of each and then the length
+     * of the target. The rsum of a chunk is just the start of its checksum,
+     * and the source is cut into chunks and looked up a chunk at a time
+     * rather than searched for blocks at every offset. NULL for fixed size
+     * blocks. */
+    off_t *chunk_off;
+    struct cdc_params cdc;
 
-    /* These are used by the library. Note, not thread safe. */
-    const struct hash_entry *rover;
-    int skip;                   /* skip forward on next submit_source_data */
+    /* The next coarser level of blocks of the same target, if any (see
+     * rcksum_add_level). Its blocks are scanned for first, and each one it
+     * matches is a run of ours; we then only scan what it left unmatched. */
+    struct rcksum_state *coarse;
 
-    /* Internal; hint to rcksum_submit_source_data that it should try matching
-     * the following block of input data against the block ->next_match.
-     * next_known is a cached lookup of the id of the next block after that
-     * that we already have data for. */
-    const struct hash_entry *next_match;
-    zs_blockid next_known;
+    /* The rsum and checksum of each block, as separate arrays so that
+     * comparing rsums doesn't drag the checksums through the cache. Both have
+     * seq_matches extra zeroed entries after the last block. The checksums
+     * are checksum_bytes apart. */
+    struct rsum *rsums;
+    unsigned char *checksums;
 
     /* Hash table for rsync algorithm */
     unsigned int hashmask;
-    struct hash_entry *blockhashes;
-    struct hash_entry **rsum_hash;
-
-    /* And a 1-bit per rsum value table to allow fast negative lookups for hash
-     * values that don't occur in the target file. */
-    unsigned int bithashmask;
-    unsigned char *bithash;
-
-    /* Current state and stats for data collected by algorithm */
-    int numranges;
-    zs_blockid *ranges;
-    int gotblocks;
-    struct {
-        int hashhit, weakhit, stronghit, checksummed;
-    } stats;
-
-	list<size_t> *offsets;
-	map<long long, list<size_t> > *moves;
-	map<size_t, size_t> *add;
-	map<size_t, size_t> *del;
+    int hashshift;              /* 32 - log2(hashmask + 1) */
+    struct hash_slot *rsum_hash;
+    int *hash_next;             /* Next block in the chain, in block order, or -1 */
+    int *hash_prev;             /* Previous block; for the first, the last */
+    int hash_ready;             /* The tables above came ready built */
+
+    /* And a counting Bloom filter over the rsums (see calc_rkey), to allow fast
+     * negative lookups for rsum values that don't occur in the target file.
+     * It is register-blocked: each value maps to one 64-bit word and sets
+     * BLOOM_K bits in it, so a lookup is a single load. Behind each bit is a
+     * 4-bit counter in bloomcount, so blocks can be removed again; a counter
+     * that reaches 15 stays there. */
+    unsigned int bloomwords;
+    unsigned long long *bloom;
+    unsigned char *bloomcount;  /* 32 bytes per word of bloom */
+
+    /* Current state and stats for data collected by algorithm: 1 bit per
+     * block that a match has been recorded for (see range.cpp) */
+    unsigned long long *gotmap;
+    struct rcksum_stats stats;
+
+    /* Where matches go instead of the match log while streaming */
+    struct rcksum_stream *stream;
+
+    /* Every match, in order of offset; parseMove and parseAdd work from
+     * this once the scan is done. Room for one per block, as note_match
+     * records each block at most once, whatever the source files. */
+    struct rcksum_match *matches;
+    size_t nmatches;
+
+    /* The ranges of the target that parseMove cut out of moves to break
+     * cycles, as ncuts (start, length) pairs in order of offset. parseAdd
+     * sends them as literal data along with the gaps between matches. */
+    off_t *cuts;
+    size_t ncuts;
+
+    /* Where this state and everything else for the sync is allocated */
+    struct arena *arena;
 };
 
-#define BITHASHBITS 3
+/* Bloom filter geometry; the number of words is chosen in build_hash for a
+ * false positive rate of BLOOM_FPR. */
+#define BLOOM_K 5
+#define BLOOM_FPR 0.01
+
+/* The state of one pass over (part of) a source file. The sequential scan
+ * removes matched blocks from the hash table and records matches directly in
+ * the rcksum_state. Parallel scans share a read-only hash table instead, and
+ * collect their matches here to be merged afterwards. */
+struct rcksum_scan {
+    struct rsum r[2];           /* Current rsums */
+    int have_rsum;              /* r is valid for the next offset to scan */
+    size_t skip;                /* skip forward on next buffer */
+    zs_blockid prev_id;         /* block matched just before the next offset
+                                 * to scan, or -1 */
+
+    int shared;                 /* hash table is shared with other scans */
+    unsigned char *claimed;     /* 1 bit per block matched by this scan */
+    struct rcksum_stats stats;
+    vector<struct rcksum_match> matches;
+};
 
 /* rcksum_state methods */
 
-/* From a hash entry, return the corresponding blockid */
-static inline zs_blockid get_HE_blockid(const struct rcksum_state *z,
-                                        const struct hash_entry *e) {
-    return e - z->blockhashes;
+/* Where the given block starts in the target, and its length; the last of
+ * fixed size blocks runs past the end of the target */
+static inline off_t block_start(const struct rcksum_state *z, zs_blockid id) {
+    return z->chunk_off ? z->chunk_off[id] : (off_t)id << z->blockshift;
+}
+
+static inline size_t block_len(const struct rcksum_state *z, zs_blockid id) {
+    return z->chunk_off ? (size_t)(z->chunk_off[id + 1] - z->chunk_off[id]) : z->blocksize;
+}
+
+/* Return the stored checksum of the given block */
+static inline const unsigned char *get_checksum(const struct rcksum_state *z,
+                                                zs_blockid id) {
+    return z->checksums + (size_t)id * z->checksum_bytes;
+}
+
+void mark_block_got(struct rcksum_state *z, zs_blockid n);
+int already_got_block(const struct rcksum_state *z, zs_blockid n);
+zs_blockid next_known_block(const struct rcksum_state *rs, zs_blockid x);
+zs_blockid next_needed_block(const struct rcksum_state *rs, zs_blockid x);
+
+/* calc_rkey(self, rsum0, rsum1)
+ * All the bits of the rsums that identify a block, as one value. */
+static inline unsigned long long calc_rkey(const struct rcksum_state *const z, const struct rsum r0, const struct rsum r1) {
+    unsigned long long k = ((unsigned long long)(r0.a & z->rsum_a_mask) << 16) | r0.b;
+
+    if (z->seq_matches > 1)
+        k = (k << 32) | ((unsigned long long)(r1.a & z->rsum_a_mask) << 16) | r1.b;
+    return k;
 }
 
-void add_to_ranges(struct rcksum_state *z, zs_blockid n);
-int already_got_block(struct rcksum_state *z, zs_blockid n);
-zs_blockid next_known_block(struct rcksum_state *rs, zs_blockid x);
+/* calc_rhash2(rkey)
+ * Fold an rsum key into the 32-bit hash value used to index the hash table.
+ * Every bit of the key feeds the top bits of the product, which is what
+ * hash_slot_index uses, so large tables are evenly filled. */
+static inline unsigned int calc_rhash2(unsigned long long k) {
+    return (k * 0x9e3779b97f4a7c15ULL) >> 32;
+}
 
-struct hash_entry *calc_hash_entry(void *data, size_t len);
+/* Hash the checksum values for the given block and return the hash value */
+static inline unsigned int calc_rhash(const struct rcksum_state *const z, zs_blockid id) {
+	return calc_rhash2(calc_rkey(z, z->rsums[id], z->rsums[id + 1]));
+}
 
-static inline unsigned int calc_rhash2(const struct rcksum_state *const z, const struct rsum r0, const struct rsum r1) {
-	unsigned int h = r0.b;
+/* Return the first slot of the hash table to probe for the given hash value:
+ * its top bits, as many as the table needs. */
+static inline unsigned int hash_slot_index(const struct rcksum_state *const z, unsigned int h) {
+	return h >> z->hashshift;
+}
 
-    h ^= ((z->seq_matches > 1) ? r1.b
-        : r0.a & z->rsum_a_mask) << BITHASHBITS;
+/* bloom_bits(key)
+ * Scramble an rsum key; the top 32 bits pick the filter word, and successive
+ * 6 bit fields from the bottom the bits within it. */
+static inline unsigned long long bloom_bits(unsigned long long k) {
+    unsigned long long x = (k ^ (k >> 29)) * 0xbf58476d1ce4e5b9ULL;
+    return x ^ (x >> 32);
+}
 
-	return h;
+static inline unsigned int bloom_word(const struct rcksum_state *z, unsigned long long bits) {
+    return ((bits >> 32) * z->bloomwords) >> 32;
 }
 
-/* Hash the checksum values for the given hash entry and return the hash value */
-static inline unsigned int calc_rhash(const struct rcksum_state *const z, const struct hash_entry *const e) {
-	return calc_rhash2(z, e[0].r, e[1].r);
+static inline unsigned long long bloom_mask(unsigned long long bits) {
+    unsigned long long m = 0;
+
+    for (int i = 0; i < BLOOM_K; i++, bits >>= 6)
+        m |= 1ULL << (bits & 63);
+    return m;
 }
 
+/* bloom_test(self, key)
+ * Returns 0 if no block of the target has these rsums, non-zero if one
+ * might. */
+static inline int bloom_test(const struct rcksum_state *z, unsigned long long k) {
+    unsigned long long bits = bloom_bits(k);
+    unsigned long long m = bloom_mask(bits);
+
+    return (z->bloom[bloom_word(z, bits)] & m) == m;
+}
+
+struct mapfile;
+void add_range(const struct mapfile *m, size_t start, size_t len, upload *u);
+void stream_match(struct rcksum_state *z, size_t offset, zs_blockid id);
+
 int build_hash(struct rcksum_state *z);
 void remove_block_from_hash(struct rcksum_state *z, zs_blockid id);
+zs_blockid find_same_block(const struct rcksum_state *z, zs_blockid id, zs_blockid hint);
+zs_blockid find_chunk(const struct rcksum_state *z, const unsigned char *checksum, size_t len);
@@ -0,0 +1,95 @@
+/* Memory mapped input files, used for scanning local files in place. Data to
+ * be sent is read into transfer buffers instead (see xfer.h), so that how
+ * much of the file is resident doesn't grow with its size. */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+
+/* mapfile_open(stream, pad)
+ * Map the whole of the regular file open on the given stream. Returns NULL if
+ * it can't be mapped (e.g. it's a pipe), in which case the caller has to read
+ * it the old-fashioned way. */
+struct mapfile *mapfile_open(FILE *f, size_t pad) {
+	struct stat st;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	struct mapfile *m = (struct mapfile *)malloc(sizeof *m);
+	if (!m)
+		return NULL;
+
+	/* The file's pages, then enough whole pages to hold the padding */
+	size_t filepages = (st.st_size + pagesize - 1) / pagesize * pagesize;
+	m->len = st.st_size;
+	m->size = filepages + (pad + pagesize - 1) / pagesize * pagesize;
+
+	/* Reserve the whole range with anonymous zero pages, then map the file
+	 * over the start of it. The rest of the file's last page reads as zeros
+	 * too, so the padding is there without copying anything. */
+	void *p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		free(m);
+		return NULL;
+	}
+	if (filepages
+		&& mmap(p, filepages, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(f), 0) == MAP_FAILED) {
+		munmap(p, m->size);
+		free(m);
+		return NULL;
+	}
+	m->data = (const unsigned char *)p;
+
+	/* Our own descriptor, as the caller may close the stream */
+	m->fd = dup(fileno(f));
+	if (m->fd == -1) {
+		munmap(p, m->size);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* mapfile_close(self) - destructor */
+void mapfile_close(struct mapfile *m) {
+	munmap((void *)m->data, m->size);
+	close(m->fd);
+	free(m);
+}
+
+/* mapfile_read(self, offset, buf, len)
+ * Read part of the file with pread, which leaves it in the page cache rather
+ * than in our mapping. */
+int mapfile_read(const struct mapfile *m, off_t off, void *buf, size_t len) {
+	unsigned char *p = (unsigned char *)buf;
+
+	while (len) {
+		ssize_t n = pread(m->fd, p, len, off);
+
+		if (n <= 0)
+			return -1;
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* mapfile_advise(self, offset, len, advice)
+ * Pass on a madvise() hint for the given range of the file. */
+void mapfile_advise(const struct mapfile *m, off_t off, size_t len, int advice) {
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = off / pagesize * pagesize;
+
+	if (start >= (off_t)m->size)
+		return;
+	if (off + len > m->size)
+		len = m->size - off;
+
+	madvise((void *)(m->data + start), len + (off - start), advice);
+}
@@ -0,0 +1,26 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* A read-only memory mapping of a whole file, followed by at least pad bytes
+ * of zeros, so that code looking ahead past the end of the file sees zero
+ * padding without the file data being copied anywhere. */
+struct mapfile {
+	const unsigned char *data;
+	off_t len;			/* Length of the file */
+	size_t size;		/* Length of the mapping, including the padding */
+	int fd;				/* The file, for reading data without mapping it in */
+};
+
+struct mapfile *mapfile_open(FILE *f, size_t pad);
+void mapfile_close(struct mapfile *m);
+
+/* Read len bytes at off into buf; returns 0 if successful */
+int mapfile_read(const struct mapfile *m, off_t off, void *buf, size_t len);
+
+/* Hint to the kernel how the range off..off+len-1 will be used (MADV_*) */
+void mapfile_advise(const struct mapfile *m, off_t off, size_t len, int advice);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * MD4 message digest, as described in RFC 1320.
+ *
+ * This code is in the public domain; do with it what you wish.
+ */
+
+#include <string.h>
+
+#include "md4.h"
+
+/* The three MD4 round functions */
+#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define STEP(f, a, b, c, d, x, s) do { (a) += f((b), (c), (d)) + (x); (a) = ROTL((a), (s)); } while (0)
+
+/* le32(p)
+ * Read a little-endian 32 bit word; compilers turn this into a plain load on
+ * little-endian machines. */
+static inline uint32_t le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+        | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* md4_transform(state, block)
+ * The core of MD4: mix one 64 byte block into the state. */
+static void md4_transform(uint32_t state[4], const unsigned char *block) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        x[i] = le32(block + 4 * i);
+
+    /* Round 1 */
+    for (i = 0; i < 16; i += 4) {
+        STEP(F, a, b, c, d, x[i], 3);
+        STEP(F, d, a, b, c, x[i + 1], 7);
+        STEP(F, c, d, a, b, x[i + 2], 11);
+        STEP(F, b, c, d, a, x[i + 3], 19);
+    }
+
+    /* Round 2 */
+    for (i = 0; i < 4; i++) {
+        STEP(G, a, b, c, d, x[i] + 0x5a827999, 3);
+        STEP(G, d, a, b, c, x[i + 4] + 0x5a827999, 5);
+        STEP(G, c, d, a, b, x[i + 8] + 0x5a827999, 9);
+        STEP(G, b, c, d, a, x[i + 12] + 0x5a827999, 13);
+    }
+
+    /* Round 3 */
+    static const int order[4] = { 0, 2, 1, 3 };
+    for (i = 0; i < 4; i++) {
+        int j = order[i];
+        STEP(H, a, b, c, d, x[j] + 0x6ed9eba1, 3);
+        STEP(H, d, a, b, c, x[j + 8] + 0x6ed9eba1, 9);
+        STEP(H, c, d, a, b, x[j + 4] + 0x6ed9eba1, 11);
+        STEP(H, b, c, d, a, x[j + 12] + 0x6ed9eba1, 15);
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/* MD4Init(ctx)
+ * Start a new digest. */
+void MD4Init(struct md4_ctx *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+/* MD4Update(ctx, data, len)
+ * Add len bytes of data to the digest. */
+void MD4Update(struct md4_ctx *ctx, const unsigned char *input, size_t len) {
+    size_t have = ctx->count % MD4_BLOCK_LENGTH;
+
+    ctx->count += len;
+
+    /* Complete a partial block first */
+    if (have) {
+        size_t need = MD4_BLOCK_LENGTH - have;
+
+        if (len < need) {
+            memcpy(ctx->buffer + have, input, len);
+            return;
+        }
+        memcpy(ctx->buffer + have, input, need);
+        md4_transform(ctx->state, ctx->buffer);
+        input += need;
+        len -= need;
+    }
+
+    /* Then whole blocks straight from the input */
+    for (; len >= MD4_BLOCK_LENGTH; input += MD4_BLOCK_LENGTH, len -= MD4_BLOCK_LENGTH)
+        md4_transform(ctx->state, input);
+
+    memcpy(ctx->buffer, input, len);
+}
+
+/* MD4Final(digest, ctx)
+ * Pad the message out, and return the digest. */
+void MD4Final(unsigned char digest[MD4_DIGEST_LENGTH], struct md4_ctx *ctx) {
+    uint64_t bits = ctx->count << 3;
+    size_t have = ctx->count % MD4_BLOCK_LENGTH;
+    unsigned char pad[MD4_BLOCK_LENGTH * 2];
+    size_t padlen = (have < 56 ? 56 : 120) - have;
+    int i;
+
+    /* A one bit, zeroes, then the message length in bits */
+    memset(pad, 0, padlen);
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[padlen + i] = (unsigned char)(bits >> (8 * i));
+    MD4Update(ctx, pad, padlen + 8);
+
+    for (i = 0; i < 4; i++) {
+        digest[4 * i] = (unsigned char)ctx->state[i];
+        digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4 * i + 3] = (unsigned char)(ctx->state[i] >> 24);
+    }
+    memset(ctx, 0, sizeof *ctx);
+}
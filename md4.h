@@ -0,0 +1,30 @@
+/*
+ * MD4 message digest, as described in RFC 1320.
+ *
+ * This code is in the public domain; do with it what you wish.
+ *
+ * The OpenSSL low-level MD4 functions are deprecated, and MD4 is only
+ * available through EVP with the legacy provider loaded, so zsync's block
+ * checksums carry their own implementation.
+ */
+
+#ifndef MD4_H
+#define MD4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MD4_BLOCK_LENGTH 64
+#define MD4_DIGEST_LENGTH 16
+
+struct md4_ctx {
+    uint32_t state[4];          /* ABCD */
+    uint64_t count;             /* Bytes processed */
+    unsigned char buffer[MD4_BLOCK_LENGTH];     /* Input not yet processed */
+};
+
+void MD4Init(struct md4_ctx *ctx);
+void MD4Update(struct md4_ctx *ctx, const unsigned char *input, size_t len);
+void MD4Final(unsigned char digest[MD4_DIGEST_LENGTH], struct md4_ctx *ctx);
+
+#endif
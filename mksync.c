@@ -5,20 +5,37 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
 
-#include <openssl/md4.h>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <arpa/inet.h>
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
 #include "rcksum.h"
+#include "zsyncbin.h"
+#include "cdc.h"
+#include "delta.h"
 
 #define VERSION "0.0.1"
 
+using namespace std;
+
 size_t blocksize = 0;
+int hash_algo = RCKSUM_HASH_MD4;
 
-SHA_CTX shactx;
+/* Number of blocks read and handed to a worker in one go */
+#define BLOCKS_PER_CHUNK 256
 
-int get_len(FILE * f) {
+off_t get_len(FILE * f) {
 	struct stat s;
 
 	if (fstat(fileno(f), &s) == -1) {
@@ -28,111 +45,1142 @@ int get_len(FILE * f) {
 	return s.st_size;
 }
 
-void write_block_sums(unsigned char *buf, size_t got, FILE * f) {
-	struct rsum r;
-	unsigned char checksum[MD4_DIGEST_LENGTH];
+/* A chunk of the input file, read by the reader and then checksummed by one
+ * of the workers and by the SHA-1 thread. It goes back to the free list once
+ * both are done with it. */
+struct chunk {
+	unsigned char *buf;
+	size_t len;					/* Bytes of file data in buf */
+	size_t first;				/* Block id of the first block in buf */
+	int pending;				/* Threads yet to finish with this chunk */
+};
+
+/* The block sums pipeline. The per-block rsums and checksums are stored
+ * straight into arrays indexed by block id, so workers can complete chunks
+ * in any order. */
+struct blocksums {
+	size_t blocksize;
+	mutex lock;
+	condition_variable cv;
+	deque<struct chunk *> free, work, sha;
+	int eof;
+
+	size_t nblocks;				/* Blocks read so far */
+	size_t maxblocks;			/* Allocated size of the arrays below */
+	struct rsum *rsums;
+	unsigned char *checksums;	/* CHECKSUM_SIZE bytes per block */
+	uint32_t *lens;				/* Length of each content-defined chunk */
 
-	if (got < blocksize) {
-		memset(buf + got, 0, blocksize - got);
+	EVP_MD_CTX *shactx;			/* NULL if we don't need the SHA-1 */
+};
+
+/* release_chunk(self, chunk)
+ * Called by a thread that is finished with the given chunk; puts it back on
+ * the free list if nobody else needs it. */
+static void release_chunk(struct blocksums *bs, struct chunk *c) {
+	unique_lock<mutex> l(bs->lock);
+
+	if (!--c->pending) {
+		bs->free.push_back(c);
+		bs->cv.notify_all();
 	}
+}
+
+/* Worker thread - calculate the rsum and strong checksum of every block in the
+ * chunks on the work queue. */
+static void blocksum_worker(struct blocksums *bs) {
+	for (;;) {
+		struct chunk *c;
+		{
+			unique_lock<mutex> l(bs->lock);
+			bs->cv.wait(l, [bs] { return !bs->work.empty() || bs->eof; });
+			if (bs->work.empty())
+				return;
+			c = bs->work.front();
+			bs->work.pop_front();
+		}
 
-	r = rcksum_calc_rsum_block(buf, blocksize);
-	rcksum_calc_checksum(&checksum[0], buf, blocksize);
-	r.a = htons(r.a);
-	r.b = htons(r.b);
+		size_t bsz = bs->blocksize;
+		size_t n = (c->len + bsz - 1) / bsz;
+		rcksum_calc_rsum_blocks(bs->rsums + c->first, c->buf, bsz, n);
+		for (size_t i = 0; i < n; i++) {
+			rcksum_calc_checksum(hash_algo, bs->checksums + (c->first + i) * CHECKSUM_SIZE,
+								 c->buf + i * bsz, bsz);
+		}
 
-	fwrite(&r, sizeof(r), 1, f);
-	fwrite(checksum, sizeof(checksum), 1, f);
+		release_chunk(bs, c);
+	}
 }
 
-size_t read_stream_write_blocksums(FILE *fin, FILE * fout) {
-	unsigned char *buf = (unsigned char *)malloc(blocksize);
+/* SHA-1 thread - the whole file checksum has to see the chunks in order, so
+ * it runs on its own thread, consuming chunks in the order they were read. */
+static void sha1_worker(struct blocksums *bs) {
+	for (;;) {
+		struct chunk *c;
+		{
+			unique_lock<mutex> l(bs->lock);
+			bs->cv.wait(l, [bs] { return !bs->sha.empty() || bs->eof; });
+			if (bs->sha.empty())
+				return;
+			c = bs->sha.front();
+			bs->sha.pop_front();
+		}
 
-	size_t len = 0;
+		EVP_DigestUpdate(bs->shactx, c->buf, c->len);
 
-	while (!feof(fin)) {
-		int got = fread(buf, 1, blocksize, fin);
+		release_chunk(bs, c);
+	}
+}
 
-		if (got > 0) {
-			SHA1_Update(&shactx, buf, got);
+/* read_stream_blocksums(self, stream, jobs)
+ * Read the stream to the end, calculating the block sums on jobs worker
+ * threads and the SHA-1 of the whole stream on another. Returns the length of
+ * the stream, or -1 if we ran out of memory. */
+static off_t read_stream_blocksums(struct blocksums *bs, FILE *fin, int jobs) {
+	size_t blocksize = bs->blocksize;
+	size_t chunksize = blocksize * BLOCKS_PER_CHUNK;
+	int nchunks = jobs * 2 + 2;
+	vector<struct chunk> chunks(nchunks);
+	vector<thread> threads;
+	off_t len = 0;
 
-			write_block_sums(buf, got, fout);
-			len += got;
+	for (int i = 0; i < nchunks; i++) {
+		chunks[i].buf = (unsigned char *)malloc(chunksize);
+		if (!chunks[i].buf) {
+			len = -1;
+			break;
 		}
+		bs->free.push_back(&chunks[i]);
 	}
-	free(buf);
+
+	bs->eof = 0;
+	for (int i = 0; len >= 0 && i < jobs; i++)
+		threads.push_back(thread(blocksum_worker, bs));
+	if (len >= 0 && bs->shactx)
+		threads.push_back(thread(sha1_worker, bs));
+
+	while (len >= 0 && !feof(fin)) {
+		struct chunk *c;
+		{
+			unique_lock<mutex> l(bs->lock);
+			bs->cv.wait(l, [bs] { return !bs->free.empty(); });
+			c = bs->free.front();
+			bs->free.pop_front();
+		}
+
+		c->len = fread(c->buf, 1, chunksize, fin);
+		if (!c->len) {
+			unique_lock<mutex> l(bs->lock);
+			bs->free.push_back(c);
+			break;
+		}
+
+		size_t n = (c->len + blocksize - 1) / blocksize;
+
+		/* Zero pad the last block */
+		memset(c->buf + c->len, 0, n * blocksize - c->len);
+
+		unique_lock<mutex> l(bs->lock);
+
+		/* The file grew since we sized the arrays; wait for all the other
+		 * chunks to come back before moving the arrays under the workers */
+		if (bs->nblocks + n > bs->maxblocks) {
+			bs->cv.wait(l, [bs, nchunks] { return bs->free.size() == (size_t)nchunks - 1; });
+
+			size_t maxblocks = (bs->nblocks + n) * 2;
+			struct rsum *r = (struct rsum *)realloc(bs->rsums, maxblocks * sizeof *r);
+			if (r)
+				bs->rsums = r;
+			unsigned char *ck = (unsigned char *)realloc(bs->checksums, maxblocks * CHECKSUM_SIZE);
+			if (ck)
+				bs->checksums = ck;
+			if (!r || !ck) {
+				bs->free.push_back(c);
+				len = -1;
+				break;
+			}
+			bs->maxblocks = maxblocks;
+		}
+
+		c->first = bs->nblocks;
+		c->pending = bs->shactx ? 2 : 1;
+		bs->nblocks += n;
+		len += c->len;
+
+		bs->work.push_back(c);
+		if (bs->shactx)
+			bs->sha.push_back(c);
+		bs->cv.notify_all();
+	}
+
+	{
+		unique_lock<mutex> l(bs->lock);
+		bs->eof = 1;
+		bs->cv.notify_all();
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	for (int i = 0; i < nchunks; i++)
+		free(chunks[i].buf);
 
 	return len;
 }
 
-void fcopy_hashes(FILE * fin, FILE * fout, size_t rsum_bytes, size_t hash_bytes) {
-	unsigned char buf[20];
-	size_t len;
+/* grow_blocksums(self, n)
+ * Make room for at least n blocks. Returns 0 if successful. */
+static int grow_blocksums(struct blocksums *bs, size_t n) {
+	if (n <= bs->maxblocks)
+		return 0;
 
-	while ((len = fread(buf, 1, sizeof(buf), fin)) > 0) {
-        /* write trailing rsum_bytes of the rsum (trailing because the second part of the rsum is more useful in practice for hashing), and leading checksum_bytes of the checksum */
-        if (fwrite(buf + 4 - rsum_bytes, 1, rsum_bytes, fout) < rsum_bytes)
-            break;
-        if (fwrite(buf + 4, 1, hash_bytes, fout) < hash_bytes)
-            break;
-    }           
+	size_t maxblocks = n * 2;
+	unsigned char *ck = (unsigned char *)realloc(bs->checksums, maxblocks * CHECKSUM_SIZE);
+	if (ck)
+		bs->checksums = ck;
+	uint32_t *l = (uint32_t *)realloc(bs->lens, maxblocks * sizeof *l);
+	if (l)
+		bs->lens = l;
+	if (!ck || !l)
+		return -1;
+	bs->maxblocks = maxblocks;
+	return 0;
 }
 
+/* read_stream_chunksums(self, stream, cdc)
+ * As read_stream_blocksums, for content-defined chunks: the stream is read
+ * into a buffer that always holds at least a maximal chunk until the end of
+ * the stream, which is cut into chunks in order. Returns the length of the
+ * stream, or -1 if we ran out of memory. */
+static off_t read_stream_chunksums(struct blocksums *bs, FILE *fin, const struct cdc_params *cdc) {
+	size_t bufsize = cdc->max * 16;
+	unsigned char *buf = (unsigned char *)malloc(bufsize);
+	size_t have = 0, at = 0;
+	off_t len = 0;
 
-int main(int argc, char **argv) {
+	if (!buf)
+		return -1;
+
+	for (;;) {
+		/* Refill once less than a maximal chunk is left */
+		if (have - at < cdc->max && !feof(fin)) {
+			memmove(buf, buf + at, have - at);
+			have -= at;
+			at = 0;
+
+			size_t n = fread(buf + have, 1, bufsize - have, fin);
+			EVP_DigestUpdate(bs->shactx, buf + have, n);
+			have += n;
+			len += n;
+			if (ferror(fin))
+				break;
+		}
+		if (at == have)
+			break;
+
+		size_t n = cdc_cut(cdc, buf + at, have - at);
 
-	char *infname = (char *)malloc(sizeof(char) * strlen(argv[1]) + 1);
-	strcpy(infname, argv[1]);
-	FILE *instream = fopen(infname, "rb");
-	free(infname);
+		if (grow_blocksums(bs, bs->nblocks + 1) != 0) {
+			len = -1;
+			break;
+		}
+		bs->lens[bs->nblocks] = n;
+		rcksum_calc_checksum(hash_algo, bs->checksums + bs->nblocks * CHECKSUM_SIZE, buf + at, n);
+		bs->nblocks++;
+		at += n;
+	}
 
-	blocksize = (get_len(instream) < 100000000) ? 2048 : 4096;
+	free(buf);
+	return len;
+}
 
-	FILE *tf = tmpfile();
+/* write_chunk_hashes(self, stream, hash_bytes)
+ * Write the length and checksum of each chunk to the control file. */
+static void write_chunk_hashes(const struct blocksums *bs, FILE * fout, size_t hash_bytes) {
+	for (size_t i = 0; i < bs->nblocks; i++) {
+		uint32_t l = htonl(bs->lens[i]);
 
-	SHA1_Init(&shactx);
-	size_t len = read_stream_write_blocksums(instream, tf);
+		if (fwrite(&l, 1, sizeof l, fout) < sizeof l)
+			break;
+		if (fwrite(bs->checksums + i * CHECKSUM_SIZE, 1, hash_bytes, fout) < hash_bytes)
+			break;
+	}
+}
 
-	int seq_matches = len > blocksize ? 2 : 1;
-	int rsum_len = ceil(((log(len) + log(blocksize)) / log(2) - 8.6) / seq_matches / 8);
+/* hash_lengths(len, blocksize, &seq_matches, &rsum_len, &checksum_len)
+ * Work out how many consecutive blocks have to match, and how much of the
+ * rsum and checksum to keep, for blocks of this size in a file this long. */
+static void hash_lengths(off_t len, size_t blocksize, int *seq_matches, int *rsum_len, int *checksum_len) {
+	*seq_matches = len > (off_t)blocksize ? 2 : 1;
+	*rsum_len = ceil(((log(len) + log(blocksize)) / log(2) - 8.6) / *seq_matches / 8);
 
-	if (rsum_len > 4) { rsum_len = 4; }
-	if (rsum_len < 2) { rsum_len = 2; }
+	if (*rsum_len > 4) { *rsum_len = 4; }
+	if (*rsum_len < 2) { *rsum_len = 2; }
 
-	int checksum_len = ceil((20 + (log(len) + log(1+len/blocksize))/log(2)) / seq_matches / 8);
+	*checksum_len = ceil((20 + (log(len) + log(1+len/blocksize))/log(2)) / *seq_matches / 8);
 
 	{
 		int checksum_len2 =  (7.9 + (20 + log(1 + len / blocksize) / log(2))) / 8;
-		if (checksum_len < checksum_len2) {
-			checksum_len = checksum_len2;
+		if (*checksum_len < checksum_len2) {
+			*checksum_len = checksum_len2;
 		}
 	}
+}
+
+/* A coarser level of blocks (see rcksum_add_level), whose block sums go in
+ * the control file after the main ones */
+struct level {
+	struct blocksums bs;
+	int seq_matches, rsum_len, checksum_len;
+};
+
+/* read_level(self, stream, blocksize, len, jobs)
+ * Read the stream again from the start for the block sums of a coarser
+ * level. Returns 0 if successful. */
+static int read_level(struct level *lv, FILE *fin, size_t blocksize, off_t len, int jobs) {
+	struct blocksums *bs = &lv->bs;
+
+	bs->blocksize = blocksize;
+	bs->nblocks = 0;
+	bs->maxblocks = len / blocksize + 1;
+	bs->rsums = (struct rsum *)malloc(bs->maxblocks * sizeof *bs->rsums);
+	bs->checksums = (unsigned char *)malloc(bs->maxblocks * CHECKSUM_SIZE);
+	bs->lens = NULL;
+	bs->shactx = NULL;
+	if (!bs->rsums || !bs->checksums)
+		return -1;
+
+	rewind(fin);
+	if (read_stream_blocksums(bs, fin, jobs) != len || ferror(fin))
+		return -1;
+
+	hash_lengths(len, blocksize, &lv->seq_matches, &lv->rsum_len, &lv->checksum_len);
+	return 0;
+}
+
+/* write_hashes(self, stream, rsum_bytes, hash_bytes)
+ * Write the block sums to the control file. */
+static void write_hashes(const struct blocksums *bs, FILE * fout, size_t rsum_bytes, size_t hash_bytes) {
+	for (size_t i = 0; i < bs->nblocks; i++) {
+		struct rsum r = bs->rsums[i];
+
+		r.a = htons(r.a);
+		r.b = htons(r.b);
+
+		/* write trailing rsum_bytes of the rsum (trailing because the second part of the rsum is more useful in practice for hashing), and leading checksum_bytes of the checksum */
+		if (fwrite(((char *)&r) + 4 - rsum_bytes, 1, rsum_bytes, fout) < rsum_bytes)
+			break;
+		if (fwrite(bs->checksums + i * CHECKSUM_SIZE, 1, hash_bytes, fout) < hash_bytes)
+			break;
+	}
+}
+
+/* write_section(stream, data, len, &offset)
+ * Write a section of a binary control file at offset, which is advanced past
+ * it and the padding to the next section. Returns 0 if successful. */
+static int write_section(FILE * fout, const void *data, size_t len, uint64_t *off) {
+	static const char zeros[ZSYNC_BIN_ALIGN] = { 0 };
+	size_t pad = (ZSYNC_BIN_ALIGN - len % ZSYNC_BIN_ALIGN) % ZSYNC_BIN_ALIGN;
+
+	if (fwrite(data, 1, len, fout) < len || fwrite(zeros, 1, pad, fout) < pad)
+		return -1;
+	*off += len + pad;
+	return 0;
+}
 
-	char *outfname = (char *)malloc(sizeof(char) * strlen(argv[2]) + 1);
-	strcpy(outfname, argv[2]);
-	FILE *fout = fopen(outfname, "wb");
-	free(outfname);
+/* write_binary(self, stream, len, seq_matches, rsum_bytes, hash_bytes, sha1, with_index)
+ * Write a binary control file (see zsyncbin.h). The block sums are loaded
+ * into an rcksum_state, as a client loading a text control file would, and
+ * written out as it lays them out, with the hash index it builds from them
+ * if asked for. Returns 0 if successful. */
+static int write_binary(const struct blocksums *bs, FILE * fout, off_t len,
+						int seq_matches, int rsum_bytes, int hash_bytes,
+						const unsigned char *sha1, int with_index) {
+	struct rcksum_state *z = rcksum_init(bs->nblocks, blocksize, rsum_bytes, hash_bytes, seq_matches);
+	if (!z)
+		return -1;
+	rcksum_set_hash_algo(z, hash_algo);
 
+	for (size_t i = 0; i < bs->nblocks; i++) {
+		/* Only the trailing rsum_bytes, as in a text control file */
+		uint32_t r = ((uint32_t)bs->rsums[i].a << 16 | bs->rsums[i].b)
+			& (rsum_bytes < 4 ? (1u << (8 * rsum_bytes)) - 1 : ~0u);
+		struct rsum t = { (unsigned short)(r >> 16), (unsigned short)r };
+
+		rcksum_add_target_block(z, i, t, bs->checksums + i * CHECKSUM_SIZE);
+	}
+
+	struct zsync_bin_header h;
+	void *index = NULL;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, ZSYNC_BIN_MAGIC, ZSYNC_BIN_MAGIC_LEN);
+	h.version = ZSYNC_BIN_VERSION;
+	h.byteorder = ZSYNC_BIN_BYTEORDER;
+	h.length = len;
+	h.blocks = bs->nblocks;
+	h.blocksize = blocksize;
+	h.seq_matches = seq_matches;
+	h.rsum_bytes = rsum_bytes;
+	h.checksum_bytes = hash_bytes;
+	h.hash_algo = hash_algo;
+	memcpy(h.sha1, sha1, sizeof h.sha1);
+	h.rsums_len = rcksum_rsums_size(z);
+	h.checksums_len = rcksum_checksums_size(z);
+
+	if (with_index) {
+		h.index_len = rcksum_index_size(z);
+		index = malloc(h.index_len);
+		if (!index || rcksum_get_index(z, index) != 0) {
+			fprintf(stderr, "out of memory\n");
+			free(index);
+			rcksum_end(z);
+			return -1;
+		}
+		h.index_version = RCKSUM_INDEX_VERSION;
+	}
+
+	uint64_t off = 0;
+	write_section(fout, &h, sizeof h, &off);
+	h.rsums_off = off;
+	write_section(fout, rcksum_rsums(z), h.rsums_len, &off);
+	h.checksums_off = off;
+	write_section(fout, rcksum_checksums(z), h.checksums_len, &off);
+	h.index_off = off;
+	if (index)
+		write_section(fout, index, h.index_len, &off);
+
+	/* Now that the offsets are known */
+	int rc = ferror(fout) || fseeko(fout, 0, SEEK_SET) != 0
+		|| fwrite(&h, sizeof h, 1, fout) < 1 ? -1 : 0;
+
+	free(index);
+	rcksum_end(z);
+	return rc;
+}
+
+/* write_text(stream, self, len, seq_matches, rsum_len, checksum_len, cdc, levels, nlevels, sha1)
+ * Write a text control file: the headers, the block sums, and then those of
+ * each coarser level. cdc is NULL unless the blocks are content-defined
+ * chunks. */
+static void write_text(FILE * fout, const struct blocksums *bs, off_t len,
+					   int seq_matches, int rsum_len, int checksum_len, const struct cdc_params *cdc,
+					   const struct level *levels, size_t nlevels, const unsigned char *sha1) {
 	fprintf(fout, "oc-zsync: " VERSION "\n");
-	fprintf(fout, "Blocksize: %zu\n", blocksize);
-	fprintf(fout, "Length: %zu\n", len);
+	fprintf(fout, "Blocksize: %zu\n", bs->blocksize);
+	fprintf(fout, "Length: %lld\n", (long long)len);
 	fprintf(fout, "Hash-Lengths: %d,%d,%d\n", seq_matches, rsum_len, checksum_len);
-	
-	{
-		unsigned char digest[SHA_DIGEST_LENGTH];
+	if (cdc) {
+		fprintf(fout, "Chunking: FastCDC %zu,%zu,%zu\n", cdc->min, cdc->avg, cdc->max);
+		fprintf(fout, "Chunks: %zu\n", bs->nblocks);
+	}
+	for (size_t i = 0; i < nlevels; i++) {
+		fprintf(fout, "Coarse-Level: %zu %d,%d,%d\n", levels[i].bs.blocksize,
+				levels[i].seq_matches, levels[i].rsum_len, levels[i].checksum_len);
+	}
 
-		fputs("SHA-1: ", fout);
-		SHA1_Final(digest, &shactx);
-		for (unsigned int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-			fprintf(fout, "%02x", digest[i]);
-		}
-		fputc('\n', fout);
+	/* MD4 is the default, and older clients reject headers they don't know */
+	if (hash_algo != RCKSUM_HASH_MD4)
+		fprintf(fout, "Hash-Algo: %s\n", rcksum_hash_name(hash_algo));
+
+	fputs("SHA-1: ", fout);
+	for (unsigned int i = 0; i < 20; i++) {
+		fprintf(fout, "%02x", sha1[i]);
 	}
+	fputc('\n', fout);
 
 	fputc('\n', fout);
 
-	rewind(tf);
-	fcopy_hashes(tf, fout, rsum_len, checksum_len);
+	if (cdc)
+		write_chunk_hashes(bs, fout, checksum_len);
+	else
+		write_hashes(bs, fout, rsum_len, checksum_len);
+	for (size_t i = 0; i < nlevels; i++)
+		write_hashes(&levels[i].bs, fout, levels[i].rsum_len, levels[i].checksum_len);
+}
+
+/* A text control file with fixed size blocks, read back for --update */
+struct old_level {
+	size_t blocksize;
+	int seq_matches, rsum_len, checksum_len;
+	vector<unsigned char> records;	/* rsum_len + checksum_len bytes a block */
+};
+
+struct old_control {
+	off_t len;
+	int hash_algo;
+	unsigned char sha1[20];
+	int have_sha1;
+	vector<struct old_level> levels;	/* The main blocks, then each coarser
+										 * level */
+};
+
+/* read_old_control(stream, self)
+ * Read a control file that zsyncmake wrote, with all its block sums. Only
+ * text ones with fixed size blocks can be updated. Returns 0 if
+ * successful. */
+static int read_old_control(FILE * f, struct old_control *oc) {
+	char buf[1024];
+	struct old_level main_level = { 0, 2, 4, 16, vector<unsigned char>() };
+
+	oc->len = -1;
+	oc->hash_algo = RCKSUM_HASH_MD4;
+	oc->have_sha1 = 0;
+	oc->levels.push_back(main_level);
+
+	if (getc(f) == (unsigned char)ZSYNC_BIN_MAGIC[0]) {
+		fprintf(stderr, "can't update a binary control file\n");
+		return -1;
+	}
+	rewind(f);
+
+	while (fgets(buf, sizeof buf, f) && buf[0] != '\n') {
+		size_t l = strlen(buf);
+		char *p = strchr(buf, ':');
+
+		while (l && (buf[l - 1] == '\n' || buf[l - 1] == '\r' || buf[l - 1] == ' '))
+			buf[--l] = 0;
+		if (!p || p[1] != ' ') {
+			fprintf(stderr, "bad line in control file: %s\n", buf);
+			return -1;
+		}
+		*p = 0;
+		p += 2;
+
+		struct old_level *lv = &oc->levels[0];
+		if (!strcmp(buf, "oc-zsync")) {
+		}
+		else if (!strcmp(buf, "Length")) {
+			oc->len = atoll(p);
+		}
+		else if (!strcmp(buf, "Blocksize")) {
+			lv->blocksize = atol(p);
+		}
+		else if (!strcmp(buf, "Hash-Lengths")) {
+			if (sscanf(p, "%d,%d,%d", &lv->seq_matches, &lv->rsum_len, &lv->checksum_len) != 3)
+				lv->blocksize = 0;
+		}
+		else if (!strcmp(buf, "Coarse-Level")) {
+			unsigned long bs;
+
+			oc->levels.push_back(main_level);
+			lv = &oc->levels.back();
+			if (sscanf(p, "%lu %d,%d,%d", &bs, &lv->seq_matches, &lv->rsum_len, &lv->checksum_len) == 4)
+				lv->blocksize = bs;
+		}
+		else if (!strcmp(buf, "Hash-Algo")) {
+			oc->hash_algo = rcksum_hash_by_name(p);
+			if (oc->hash_algo < 0) {
+				fprintf(stderr, "unknown or unsupported hash algorithm %s\n", p);
+				return -1;
+			}
+		}
+		else if (!strcmp(buf, "SHA-1")) {
+			unsigned int x;
+			size_t i;
+
+			for (i = 0; i < sizeof oc->sha1 && sscanf(p + 2 * i, "%2x", &x) == 1; i++)
+				oc->sha1[i] = x;
+			oc->have_sha1 = strlen(p) == 2 * sizeof oc->sha1 && i == sizeof oc->sha1;
+		}
+		else {
+			fprintf(stderr, "can't update a control file with a %s header\n", buf);
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < oc->levels.size(); i++) {
+		struct old_level *lv = &oc->levels[i];
+
+		if (oc->len <= 0 || !lv->blocksize || (lv->blocksize & (lv->blocksize - 1))
+			|| lv->rsum_len < 1 || lv->rsum_len > 4
+			|| lv->checksum_len < 1 || lv->checksum_len > CHECKSUM_SIZE) {
+			fprintf(stderr, "not a control file, or a nonsensical one\n");
+			return -1;
+		}
+
+		size_t n = (oc->len + lv->blocksize - 1) / lv->blocksize;
+		lv->records.resize(n * (lv->rsum_len + lv->checksum_len));
+		if (fread(lv->records.data(), 1, lv->records.size(), f) != lv->records.size()) {
+			fprintf(stderr, "short read on control file\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Where the bytes of the new file came from, as segments keyed by where they
+ * start: each runs to end, and was copied from the old file at from, or is
+ * new data (from -1) */
+struct origin {
+	off_t end;
+	off_t from;
+};
+typedef map<off_t, struct origin> origin_map;
+
+/* set_origin(map, start, end, from)
+ * Note that the new file's bytes start..end-1 now come from the old file at
+ * from (or are new, for -1), cutting short or splitting the segments that
+ * said otherwise. */
+static void set_origin(origin_map &o, off_t start, off_t end, off_t from) {
+	if (start >= end)
+		return;
+
+	origin_map::iterator it = o.lower_bound(start);
+
+	/* Split a segment that runs on into the range */
+	if (it != o.begin()) {
+		origin_map::iterator prev = it;
+
+		if ((--prev)->second.end > start) {
+			struct origin tail = { prev->second.end,
+				prev->second.from < 0 ? -1 : prev->second.from + (start - prev->first) };
+
+			prev->second.end = start;
+			it = o.insert(it, make_pair(start, tail));
+		}
+	}
+
+	/* Drop the segments within it, keeping any part of the last that runs
+	 * on past its end */
+	while (it != o.end() && it->first < end) {
+		if (it->second.end > end) {
+			struct origin tail = { it->second.end,
+				it->second.from < 0 ? -1 : it->second.from + (end - it->first) };
+
+			o.erase(it);
+			o.insert(make_pair(end, tail));
+			break;
+		}
+		it = o.erase(it);
+	}
+
+	struct origin seg = { end, from };
+	o[start] = seg;
+}
+
+/* skip_bytes(stream, len)
+ * Read past len bytes of a stream, which may be a pipe. */
+static int skip_bytes(FILE * f, uint64_t len) {
+	char buf[65536];
+
+	while (len) {
+		size_t n = len < sizeof buf ? len : sizeof buf;
+
+		if (fread(buf, 1, n, f) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/* read_delta(stream, oldlen, map, &newlen)
+ * Work out from a delta stream (see delta.h) where each byte of the new file
+ * came from. Past the end of the old file there are only zeros, which count
+ * as new data, as do copies of them. Returns 0 if successful. */
+static int read_delta(FILE * f, off_t oldlen, origin_map &o, off_t *newlen) {
+	char magic[DELTA_MAGIC_LEN];
+	uint64_t len;
+
+	if (fread(magic, 1, DELTA_MAGIC_LEN, f) != DELTA_MAGIC_LEN
+		|| memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_LEN) || !delta_get_varint(f, &len)) {
+		fprintf(stderr, "not a delta stream\n");
+		return -1;
+	}
+	*newlen = len;
+
+	/* The new file starts out as the old one, cut or zero extended */
+	off_t kept = oldlen < (off_t)len ? oldlen : (off_t)len;
+	set_origin(o, 0, kept, 0);
+	set_origin(o, kept, len, -1);
+
+	for (;;) {
+		int op = getc(f);
+		uint64_t a, b, c, d, e;
+
+		if (op == DELTA_END) {
+			return 0;
+		}
+		else if (op == DELTA_DISCARD && delta_get_varint(f, &a) && delta_get_varint(f, &b)) {
+		}
+		else if (op == DELTA_COPY && delta_get_varint(f, &a) && delta_get_varint(f, &b)
+				 && delta_get_varint(f, &c)) {
+			if (b >= len)
+				continue;
+			if (c > len - b)
+				c = len - b;
+
+			uint64_t in_old = (off_t)a < oldlen ? (oldlen - a < c ? oldlen - a : c) : 0;
+			set_origin(o, b, b + in_old, a);
+			set_origin(o, b + in_old, b + c, -1);
+		}
+		else if (op == DELTA_DATA && delta_get_varint(f, &b) && delta_get_varint(f, &c)
+				 && skip_bytes(f, c) == 0) {
+			set_origin(o, b, b + c < len ? b + c : len, -1);
+		}
+		else if (op == DELTA_ZDATA && delta_get_varint(f, &b) && delta_get_varint(f, &c)
+				 && delta_get_varint(f, &a) && delta_get_varint(f, &d) && delta_get_varint(f, &e)
+				 && skip_bytes(f, e) == 0) {
+			set_origin(o, b, b + c < len ? b + c : len, -1);
+		}
+		else {
+			fprintf(stderr, "bad or truncated delta stream\n");
+			return -1;
+		}
+	}
+}
+
+/* old_block(map, oldlen, newlen, blocksize, blockid)
+ * If the given block of the new file is, padding and all, a block of the old
+ * file, the id of that; else -1. */
+static zs_blockid old_block(const origin_map &o, off_t oldlen, off_t newlen, size_t blocksize, zs_blockid id) {
+	off_t start = id * blocksize;
+	off_t end = start + (off_t)blocksize < newlen ? start + (off_t)blocksize : newlen;
+	origin_map::const_iterator it = --o.upper_bound(start);
+
+	if (it->second.from < 0)
+		return -1;
+
+	off_t from = it->second.from + (start - it->first);
+	if (from % blocksize)
+		return -1;
+
+	/* It may span segments, if they carry on copying from the same place */
+	for (it++; it != o.end() && it->first < end; it++) {
+		if (it->second.from != from + (it->first - start))
+			return -1;
+	}
+
+	/* A short last block is only the same if it is as short */
+	if (end - start < (off_t)blocksize && oldlen - from != end - start)
+		return -1;
+	return from / blocksize;
+}
+
+/* update_level(self, old, map, oldlen, newlen, newfd)
+ * Fill in the block sums of a level of the new file: those of old blocks
+ * that it kept whole, where the old control file has as many bytes of them as
+ * the new one needs, and ones calculated from the file for the rest.
+ * Returns the number of blocks kept, or -1 on error. */
+static zs_blockid update_level(struct level *lv, const struct old_level *ol, const origin_map &o,
+							   off_t oldlen, off_t newlen, int newfd) {
+	struct blocksums *bs = &lv->bs;
+	size_t blocksize = ol->blocksize;
+	size_t reclen = ol->rsum_len + ol->checksum_len;
+	int reuse;
+	zs_blockid kept = 0;
+
+	hash_lengths(newlen, blocksize, &lv->seq_matches, &lv->rsum_len, &lv->checksum_len);
+	reuse = lv->rsum_len <= ol->rsum_len && lv->checksum_len <= ol->checksum_len;
+
+	bs->blocksize = blocksize;
+	bs->nblocks = bs->maxblocks = (newlen + blocksize - 1) / blocksize;
+	bs->rsums = (struct rsum *)calloc(bs->nblocks, sizeof *bs->rsums);
+	bs->checksums = (unsigned char *)calloc(bs->nblocks, CHECKSUM_SIZE);
+	bs->lens = NULL;
+	bs->shactx = NULL;
+
+	unsigned char *buf = (unsigned char *)malloc(blocksize * BLOCKS_PER_CHUNK);
+	if (!bs->rsums || !bs->checksums || !buf) {
+		free(buf);
+		return -1;
+	}
+
+	for (zs_blockid id = 0; id < (zs_blockid)bs->nblocks;) {
+		zs_blockid old = reuse ? old_block(o, oldlen, newlen, blocksize, id) : -1;
+
+		if (old >= 0) {
+			const unsigned char *rec = ol->records.data() + old * reclen;
+			uint32_t r = 0;
+
+			for (int i = 0; i < ol->rsum_len; i++)
+				r = r << 8 | rec[i];
+			bs->rsums[id].a = r >> 16;
+			bs->rsums[id].b = r;
+			memcpy(bs->checksums + id * CHECKSUM_SIZE, rec + ol->rsum_len, ol->checksum_len);
+			kept++;
+			id++;
+			continue;
+		}
+
+		/* Read and sum the run of blocks that weren't kept, a chunk at a time */
+		zs_blockid n = 1;
+		while (id + n < (zs_blockid)bs->nblocks && n < BLOCKS_PER_CHUNK
+			   && (!reuse || old_block(o, oldlen, newlen, blocksize, id + n) < 0))
+			n++;
+
+		off_t start = id * blocksize;
+		size_t len = start + n * (off_t)blocksize < newlen ? n * blocksize : newlen - start;
+		if (pread(newfd, buf, len, start) != (ssize_t)len) {
+			free(buf);
+			return -1;
+		}
+		memset(buf + len, 0, n * blocksize - len);
+
+		rcksum_calc_rsum_blocks(bs->rsums + id, buf, blocksize, n);
+		for (zs_blockid i = 0; i < n; i++) {
+			rcksum_calc_checksum(hash_algo, bs->checksums + (id + i) * CHECKSUM_SIZE,
+								 buf + i * blocksize, blocksize);
+		}
+		id += n;
+	}
+	free(buf);
+	return kept;
+}
+
+/* sha1_file(stream, digest)
+ * SHA-1 of the whole of a stream. Returns 0 if successful. */
+static int sha1_file(FILE * f, unsigned char *digest) {
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned char buf[65536];
+	size_t n;
+
+	if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)) {
+		EVP_MD_CTX_free(ctx);
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+		EVP_DigestUpdate(ctx, buf, n);
+	EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_free(ctx);
+	return ferror(f) ? -1 : 0;
+}
+
+/* update_control_file(old.zsync, delta, new file, out)
+ * Make the control file of the new file from the old file's and the delta
+ * stream that made the new file from the old one: the block sums of blocks
+ * that the delta moved whole, or left in place, are taken from the old
+ * control file, and only the rest are read and summed. The SHA-1 can't be
+ * patched, so unless the delta left the file as it was, it is worked out
+ * from the whole file while the blocks are summed. Returns 0 if
+ * successful. */
+static int update_control_file(const char *oldpath, const char *deltapath, const char *newpath,
+							   const char *outpath) {
+	struct old_control oc;
+	origin_map o;
+	off_t newlen;
+
+	FILE *f = fopen(oldpath, "rb");
+	if (!f) {
+		perror(oldpath);
+		return -1;
+	}
+	int rc = read_old_control(f, &oc);
+	fclose(f);
+	if (rc != 0)
+		return -1;
+
+	f = strcmp(deltapath, "-") ? fopen(deltapath, "rb") : stdin;
+	if (!f) {
+		perror(deltapath);
+		return -1;
+	}
+	rc = read_delta(f, oc.len, o, &newlen);
+	if (f != stdin)
+		fclose(f);
+	if (rc != 0)
+		return -1;
+
+	FILE *fin = fopen(newpath, "rb");
+	if (!fin) {
+		perror(newpath);
+		return -1;
+	}
+	if (get_len(fin) != newlen || !newlen) {
+		fprintf(stderr, "%s isn't the file the delta makes\n", newpath);
+		fclose(fin);
+		return -1;
+	}
+
+	/* Nothing moved, and nothing new */
+	int same = newlen == oc.len && oc.have_sha1;
+	for (origin_map::const_iterator it = o.begin(); same && it != o.end(); it++)
+		same = it->second.from == it->first;
+
+	unsigned char sha1[20];
+	thread sha1_thread;
+	int sha1_rc = 0;
+
+	if (same)
+		memcpy(sha1, oc.sha1, sizeof sha1);
+	else
+		sha1_thread = thread([&] { sha1_rc = sha1_file(fin, sha1); });
+
+	hash_algo = oc.hash_algo;
+
+	vector<struct level> levels(oc.levels.size());
+	zs_blockid kept = 0, total = 0;
+	rc = 0;
+	for (size_t i = 0; i < levels.size() && rc == 0; i++) {
+		zs_blockid k = update_level(&levels[i], &oc.levels[i], o, oc.len, newlen, fileno(fin));
+
+		if (k < 0)
+			rc = -1;
+		kept += k;
+		total += levels[i].bs.nblocks;
+	}
+	if (sha1_thread.joinable())
+		sha1_thread.join();
+	fclose(fin);
+	if (rc != 0 || sha1_rc != 0) {
+		fprintf(stderr, "failed to read %s\n", newpath);
+		return -1;
+	}
+
+	/* Write beside the output and rename over it, so that it is never seen
+	 * half written */
+	string tmp = string(outpath) + ".new";
+	FILE *fout = fopen(tmp.c_str(), "wb");
+	if (!fout) {
+		perror(tmp.c_str());
+		return -1;
+	}
+	write_text(fout, &levels[0].bs, newlen, levels[0].seq_matches, levels[0].rsum_len,
+			   levels[0].checksum_len, NULL, levels.data() + 1, levels.size() - 1, sha1);
+	if (fclose(fout) != 0 || rename(tmp.c_str(), outpath) != 0) {
+		perror(outpath);
+		unlink(tmp.c_str());
+		return -1;
+	}
+
+	for (size_t i = 0; i < levels.size(); i++) {
+		free(levels[i].bs.rsums);
+		free(levels[i].bs.checksums);
+	}
+	printf("%lld of %lld blocks kept, %s\n", kept, total,
+		   same ? "SHA-1 unchanged" : "SHA-1 of the whole file");
+	return 0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-j jobs] [-H MD4|XXH3-128|BLAKE3] [-b blocksize] [-L coarse-blocksize]... [-B [-I]] <file> <file.zsync>\n"
+			"       %s [-j jobs] [-H MD4|XXH3-128|BLAKE3] -C avg-chunk <file> <file.zsync>\n"
+			"       %s --update <old.zsync> <delta|-> <new file> [<new.zsync>]\n", prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int binary = 0, with_index = 0;
+	size_t chunk_avg = 0, fixed_blocksize = 0;
+	struct cdc_params cdc;
+	vector<size_t> level_sizes;
+	int update = 0;
+	int opt;
+
+	static const struct option long_options[] = {
+		{ "update", no_argument, NULL, 'U' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "j:H:BIC:b:L:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'U':
+			update = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "nonsensical number of jobs %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'H':
+			hash_algo = rcksum_hash_by_name(optarg);
+			if (hash_algo < 0) {
+				fprintf(stderr, "unknown or unsupported hash algorithm %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			binary = 1;
+			break;
+		case 'I':
+			binary = with_index = 1;
+			break;
+		case 'C':
+			/* Chunks from a quarter to eight times the average */
+			chunk_avg = atol(optarg);
+			if (cdc_init(&cdc, chunk_avg / 4, chunk_avg, chunk_avg * 8) != 0) {
+				fprintf(stderr, "nonsensical chunk size %s - it must be a power of two of at least 64\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+		case 'L': {
+			size_t size = atol(optarg);
+
+			if (size < 64 || (size & (size - 1))) {
+				fprintf(stderr, "nonsensical block size %s - it must be a power of two of at least 64\n", optarg);
+				return 1;
+			}
+			if (opt == 'b')
+				fixed_blocksize = size;
+			else
+				level_sizes.push_back(size);
+			break;
+		}
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (jobs < 1)
+		jobs = 1;
+
+	/* The new control file is written over the old one unless given */
+	if (update) {
+		if (argc - optind < 3 || argc - optind > 4) {
+			usage(argv[0]);
+			return 1;
+		}
+		return update_control_file(argv[optind], argv[optind + 1], argv[optind + 2],
+								   argv[optind + (argc - optind == 4 ? 3 : 0)]) == 0 ? 0 : 1;
+	}
+	if (chunk_avg && binary) {
+		fprintf(stderr, "binary control files can't have content-defined chunks\n");
+		return 1;
+	}
+	if (chunk_avg && fixed_blocksize) {
+		fprintf(stderr, "-C sets the block size from the average chunk size, so it can't go with -b\n");
+		return 1;
+	}
+	if (!level_sizes.empty() && (binary || chunk_avg)) {
+		fprintf(stderr, "coarse levels can't go in binary or chunked control files\n");
+		return 1;
+	}
+	if (level_sizes.size() > RCKSUM_MAX_LEVELS) {
+		fprintf(stderr, "at most %d coarse levels\n", RCKSUM_MAX_LEVELS);
+		return 1;
+	}
+	sort(level_sizes.begin(), level_sizes.end());
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	FILE *instream = fopen(argv[optind], "rb");
+	if (!instream) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	off_t inlen = get_len(instream);
+
+	/* Larger blocks for larger files, and as large as it takes to keep the
+	 * number of blocks within what the client can index */
+	blocksize = (inlen < 100000000) ? 2048 : 4096;
+	while (inlen / (off_t)blocksize >= RCKSUM_MAX_BLOCKS)
+		blocksize *= 2;
+	if (chunk_avg)
+		blocksize = chunk_avg;
+	if (fixed_blocksize) {
+		if (inlen / (off_t)fixed_blocksize >= RCKSUM_MAX_BLOCKS) {
+			fprintf(stderr, "block size %zu is too small for a file this size\n", fixed_blocksize);
+			return 1;
+		}
+		blocksize = fixed_blocksize;
+	}
+	for (size_t i = 0; i < level_sizes.size(); i++) {
+		if (level_sizes[i] <= (i ? level_sizes[i - 1] : blocksize)) {
+			fprintf(stderr, "coarse block sizes must all differ and be larger than %zu\n", blocksize);
+			return 1;
+		}
+	}
+
+	struct blocksums bs;
+	bs.blocksize = blocksize;
+	bs.nblocks = 0;
+	bs.maxblocks = inlen / blocksize + 1;
+	bs.rsums = chunk_avg ? NULL : (struct rsum *)malloc(bs.maxblocks * sizeof *bs.rsums);
+	bs.checksums = (unsigned char *)malloc(bs.maxblocks * CHECKSUM_SIZE);
+	bs.lens = chunk_avg ? (uint32_t *)malloc(bs.maxblocks * sizeof *bs.lens) : NULL;
+	bs.shactx = EVP_MD_CTX_new();
+
+	if ((!bs.rsums && !bs.lens) || !bs.checksums || !bs.shactx
+		|| !EVP_DigestInit_ex(bs.shactx, EVP_sha1(), NULL)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	off_t flen = chunk_avg ? read_stream_chunksums(&bs, instream, &cdc)
+		: read_stream_blocksums(&bs, instream, jobs);
+	if (flen < 0 || ferror(instream)) {
+		fprintf(stderr, "failed to read %s\n", argv[optind]);
+		return 1;
+	}
+
+	/* Each coarser level takes another pass over the file */
+	vector<struct level> levels(level_sizes.size());
+	for (size_t i = 0; i < levels.size(); i++) {
+		if (read_level(&levels[i], instream, level_sizes[i], flen, jobs) != 0) {
+			fprintf(stderr, "failed to read %s\n", argv[optind]);
+			return 1;
+		}
+	}
+	fclose(instream);
+
+	off_t len = flen;
+
+	if (chunk_avg && bs.nblocks > RCKSUM_MAX_BLOCKS) {
+		fprintf(stderr, "too many chunks (%zu) - use a larger average chunk size\n", bs.nblocks);
+		return 1;
+	}
+
+	int seq_matches, rsum_len, checksum_len;
+
+	hash_lengths(len, blocksize, &seq_matches, &rsum_len, &checksum_len);
+
+	/* Chunks are looked up by checksum alone, which stands in for the rsum
+	 * as well, so it has to tell apart any two of them */
+	if (chunk_avg) {
+		seq_matches = 1;
+		rsum_len = 4;
+		checksum_len = ceil((20 + (log(1 + len) + log(1 + bs.nblocks)) / log(2)) / 8);
+		if (checksum_len < 4)
+			checksum_len = 4;
+		if (checksum_len > 16)
+			checksum_len = 16;
+	}
+
+	FILE *fout = fopen(argv[optind + 1], "wb");
+	if (!fout) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+
+	EVP_DigestFinal_ex(bs.shactx, digest, &digest_len);
+
+	if (binary) {
+		if (write_binary(&bs, fout, len, seq_matches, rsum_len, checksum_len, digest, with_index) != 0
+			|| fclose(fout) != 0) {
+			perror(argv[optind + 1]);
+			return 1;
+		}
+		EVP_MD_CTX_free(bs.shactx);
+		free(bs.rsums);
+		free(bs.checksums);
+		return 0;
+	}
+
+	write_text(fout, &bs, len, seq_matches, rsum_len, checksum_len, chunk_avg ? &cdc : NULL,
+			   levels.data(), levels.size(), digest);
+
+	if (fclose(fout) != 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	EVP_MD_CTX_free(bs.shactx);
+	free(bs.rsums);
+	free(bs.checksums);
+	free(bs.lens);
+	for (size_t i = 0; i < levels.size(); i++) {
+		free(levels[i].bs.rsums);
+		free(levels[i].bs.checksums);
+	}
 
 	return 0;
 }
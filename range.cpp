@@ -15,8 +15,10 @@
  *   COPYING file for details.
  */
 
-/* Manage storage of the set of ranges in the target file that we have so far
- * got data for. */
+/* Manage storage of the set of blocks in the target file that we have so far
+ * got data for: a bitmap with one bit per block, so marking a block is O(1)
+ * however scattered the matches are, and runs of blocks we have or don't
+ * have are found a 64-bit word at a time. */
 
 #include <stdlib.h>
 #include <string.h>
@@ -27,96 +29,44 @@
 
 using namespace std;
 
-/* r = range_before_block(self, x)
- * This determines which of the existing known ranges x falls in.
- * It returns -1 if it is inside an existing range (it doesn't tell you which
- *  one; if you already have it, that usually is enough to know).
- * Or it returns 0 if x is before the 1st range;
- * 1 if it is between ranges 1 and 2 (array indexes 0 and 1)
- * ...
- * numranges if it is after the last range
- */
-static int range_before_block(const struct rcksum_state* rs, zs_blockid x) {
-	/* Lowest number and highest number block that it could be inside (0 based) */
-	register int min = 0, max = rs->numranges-1;
-
-	/* By bisection */
-	for (; min<=max;) {
-		/* Range number to compare against */
-		register int r = (max+min)/2;
-
-		if (x > rs->ranges[2*r+1]) min = r+1;  /* After range r */
-		else if (x < rs->ranges[2*r]) max = r-1;/* Before range r */
-			else return -1;					 /* In range r */
-	}
+#define GOT_WORD(x) ((x) >> 6)
+#define GOT_BIT(x) (1ULL << ((x) & 63))
 
-	/* If we reach here, we know min = max + 1 and we were below range max+1
-	 * and above range min-1.
-	 * So we're between range max and max + 1
-	 * So we return max + 1  (return value is 1 based)  ( = min )
-	 */
-	return min;
+/* mark_block_got(rs, blockid)
+ * Mark the given blockid as known */
+void mark_block_got(struct rcksum_state *rs, zs_blockid x) {
+	rs->gotmap[GOT_WORD(x)] |= GOT_BIT(x);
 }
 
-/* add_to_ranges(rs, blockid)
- * Mark the given blockid as known, updating the stored known ranges
- * appropriately */
-void add_to_ranges(struct rcksum_state *rs, zs_blockid x) {
-	int r = range_before_block(rs, x);
+/* already_got_block
+ * Return true iff blockid x of the target file is already known */
+int already_got_block(const struct rcksum_state *rs, zs_blockid x) {
+	return (rs->gotmap[GOT_WORD(x)] & GOT_BIT(x)) != 0;
+}
 
-	if (r == -1) {
-		/* Already have this block */
-	}
-	else {
-		rs->gotblocks++;
-
-		/* If between two ranges and exactly filling the hole between them,
-		 * merge them */
-		if (r > 0 && r < rs->numranges
-			&& rs->ranges[2 * (r - 1) + 1] == x - 1
-			&& rs->ranges[2 * r] == x + 1) {
-
-			// This block fills the gap between two areas that we have got completely. Merge the adjacent ranges
-			rs->ranges[2 * (r - 1) + 1] = rs->ranges[2 * r + 1];
-			memmove(&rs->ranges[2 * r], &rs->ranges[2 * r + 2],
-					(rs->numranges - r - 1) * sizeof(rs->ranges[0]) * 2);
-			rs->numranges--;
-		}
+/* next_block(self, blockid, want)
+ * Returns the first block from x on whose bit is want, or rs->blocks if
+ * there is none. Whole words of the other value are skipped at once. */
+static zs_blockid next_block(const struct rcksum_state *rs, zs_blockid x, int want) {
+	zs_blockid words = GOT_WORD(rs->blocks + 63);
+	zs_blockid w = GOT_WORD(x);
 
-		/* If adjoining a range below, add to it */
-		else if (r > 0 && rs->numranges && rs->ranges[2 * (r - 1) + 1] == x - 1) {
-			rs->ranges[2 * (r - 1) + 1] = x;
-		}
+	if (x >= rs->blocks)
+		return rs->blocks;
 
-		/* If adjoining a range above, add to it */
-		else if (r < rs->numranges && rs->ranges[2 * r] == x + 1) {
-			rs->ranges[2 * r] = x;
-		}
+	/* Flip the bits if looking for a zero, and ignore those before x */
+	unsigned long long bits = (want ? rs->gotmap[w] : ~rs->gotmap[w]) & (~0ULL << (x & 63));
 
-		else { /* New range for this block alone */
-			rs->ranges = (zs_blockid *)
-				realloc(rs->ranges,
-						(rs->numranges + 1) * 2 * sizeof(rs->ranges[0]));
-			memmove(&rs->ranges[2 * r + 2], &rs->ranges[2 * r],
-					(rs->numranges - r) * 2 * sizeof(rs->ranges[0]));
-			rs->ranges[2 * r] = rs->ranges[2 * r + 1] = x;
-			rs->numranges++;
-		}
-	}
-#if 0
-	{
-		int i;
-		for (i = 0; i < rs->numranges; i++)
-			fprintf(stderr, "%d-%d,", rs->ranges[i * 2], rs->ranges[i * 2 + 1]);
-		fprintf(stderr, " are the current ranges got (added %d, %d)\n\n", x, r);
+	while (!bits) {
+		if (++w == words)
+			return rs->blocks;
+		bits = want ? rs->gotmap[w] : ~rs->gotmap[w];
 	}
-#endif
-}
 
-/* already_got_block
- * Return true iff blockid x of the target file is already known */
-int already_got_block(struct rcksum_state *rs, zs_blockid x) {
-	return (range_before_block(rs, x) == -1);
+	/* The bits after the last block are never set, so when looking for a
+	 * zero we can land on one of them */
+	x = w * 64 + __builtin_ctzll(bits);
+	return x < rs->blocks ? x : rs->blocks;
 }
 
 /* next_blockid = next_known_block(rs, blockid)
@@ -126,74 +76,56 @@ int already_got_block(struct rcksum_state *rs, zs_blockid x) {
  * If no later blocks are known, it returns rs->numblocks (i.e. the block after
  * the end of the file).
  */
-zs_blockid next_known_block(struct rcksum_state *rs, zs_blockid x) {
-	int r = range_before_block(rs, x);
-	if (r == -1)
-		return x;
-	if (r == rs->numranges) {
-		return rs->blocks;
-	}
-	/* Else return first block of next known range. */
-	return rs->ranges[2*r];
+zs_blockid next_known_block(const struct rcksum_state *rs, zs_blockid x) {
+	return next_block(rs, x, 1);
+}
+
+/* next_blockid = next_needed_block(rs, blockid)
+ * As next_known_block, for the next block we don't have data for. */
+zs_blockid next_needed_block(const struct rcksum_state *rs, zs_blockid x) {
+	return next_block(rs, x, 0);
+}
+
+/* rcksum_blocks_got(self)
+ * Returns how many blocks of the target we have data for. */
+zs_blockid rcksum_blocks_got(const struct rcksum_state *rs) {
+	zs_blockid n = 0;
+
+	for (zs_blockid w = 0; w < GOT_WORD(rs->blocks + 63); w++)
+		n += __builtin_popcountll(rs->gotmap[w]);
+	return n;
 }
 
 /* rcksum_needed_block_ranges
- * Return the block ranges needed to complete the target file */
-zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, int *num) {
-	int i, n;
-	int alloc_n = 100;
+ * Return the block ranges needed to complete the target file, as pairs of the
+ * first block and the block after the last, in a malloc()ed array */
+zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, zs_blockid *num) {
+	zs_blockid n = 0;
+	zs_blockid alloc_n = 100;
 	zs_blockid *r = (zs_blockid *)malloc(2 * alloc_n * sizeof(zs_blockid));
 
 	if (!r)
 		return NULL;
 
-	zs_blockid from = 0;
-	zs_blockid to = rs->blocks;
-	r[0] = from;
-	r[1] = to;
-	n = 1;
-	/* Note r[2*n-1] is the last range in our prospective list */
-
-	for (i = 0; i < rs->numranges; i++) {
-		if (rs->ranges[2 * i] > r[2 * n - 1])
-			continue;
-		if (rs->ranges[2 * i + 1] < from)
-			continue;
-
-		/* Okay, they intersect */
-		if (n == 1 && rs->ranges[2 * i] <= from) {	   /* Overlaps the start of our window */
-			r[0] = rs->ranges[2 * i + 1] + 1;
-		}
-		else {
-			/* If the last block that we still (which is the last window end -1, due
-			 * to half-openness) then this range just cuts the end of our window */
-			if (rs->ranges[2 * i + 1] >= r[2 * n - 1] - 1) {
-				r[2 * n - 1] = rs->ranges[2 * i];
-			}
-			else {
-				/* In the middle of our range, split it */
-				r[2 * n] = rs->ranges[2 * i + 1] + 1;
-				r[2 * n + 1] = r[2 * n - 1];
-				r[2 * n - 1] = rs->ranges[2 * i];
-				n++;
-				if (n == alloc_n) {
-					zs_blockid *r2;
-					alloc_n += 100;
-					r2 = (zs_blockid *)realloc(r, 2 * alloc_n * sizeof *r);
-					if (!r2) {
-						free(r);
-						return NULL;
-					}
-					r = r2;
-				}
+	for (zs_blockid x = next_needed_block(rs, 0); x < rs->blocks;) {
+		zs_blockid end = next_known_block(rs, x);
+
+		if (n == alloc_n) {
+			zs_blockid *r2;
+			alloc_n *= 2;
+			r2 = (zs_blockid *)realloc(r, 2 * alloc_n * sizeof *r);
+			if (!r2) {
+				free(r);
+				return NULL;
 			}
+			r = r2;
 		}
+		r[2 * n] = x;
+		r[2 * n + 1] = end;
+		n++;
+		x = next_needed_block(rs, end);
 	}
-	r = (zs_blockid *)realloc(r, 2 * n * sizeof *r);
-	if (n == 1 && r[0] >= r[1])
-		n = 0;
 
 	*num = n;
 	return r;
 }
-
@@ -23,7 +23,16 @@
 
 struct rcksum_state;
 
-typedef int zs_blockid;
+/* Block ids and counts are 64-bit, so that offsets worked out from them
+ * don't overflow for large files. The rsum hash table indexes blocks with
+ * 32 bits though, so a target can have at most RCKSUM_MAX_BLOCKS blocks;
+ * zsyncmake picks a blocksize large enough for that. */
+typedef long long zs_blockid;
+
+#define RCKSUM_MAX_BLOCKS 0x7fffffffLL
+
+/* Most coarser levels of blocks a target can have (see rcksum_add_level) */
+#define RCKSUM_MAX_LEVELS 4
 
 struct rsum {
 	unsigned short	a;
@@ -32,15 +41,87 @@ struct rsum {
 
 #define CHECKSUM_SIZE 16
 
+/* Strong checksum algorithms, as named in the Hash-Algo header */
+enum rcksum_hash {
+	RCKSUM_HASH_MD4,
+	RCKSUM_HASH_XXH3_128,
+	RCKSUM_HASH_BLAKE3,
+};
+
+int rcksum_hash_by_name(const char* name);
+const char* rcksum_hash_name(int hash);
+int rcksum_hash_supported(int hash);
+
 struct rcksum_state* rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_butes, int checksum_bytes, int require_consecutive_matches);
 void rcksum_end(struct rcksum_state* z);
 
+/* The block sums and hash index as an rcksum_state keeps them in memory, for
+ * binary control files that are used straight from a mapping (zsyncbin.h).
+ * An index is only valid for the same RCKSUM_INDEX_VERSION; change it
+ * whenever the layout or the hashing of the index changes. */
+#define RCKSUM_INDEX_VERSION 1
+
+size_t rcksum_rsums_size(const struct rcksum_state* z);
+size_t rcksum_checksums_size(const struct rcksum_state* z);
+const void* rcksum_rsums(const struct rcksum_state* z);
+const void* rcksum_checksums(const struct rcksum_state* z);
+size_t rcksum_index_size(struct rcksum_state* z);
+int rcksum_get_index(struct rcksum_state* z, void* buf);
+
+/* As rcksum_init, but with the block sums at rsums and checksums rather than
+ * added block by block; they must stay mapped while the state is in use */
+struct rcksum_state* rcksum_init_mapped(zs_blockid nblocks, size_t blocksize, int rsum_bytes, int checksum_bytes, int require_consecutive_matches, void* rsums, void* checksums);
+
+/* Use a saved index of rcksum_index_size() bytes for the first scan, instead
+ * of building it. It is updated in place, so it must be writable. Returns
+ * non-zero, leaving the index to be built, if it isn't one for these blocks. */
+int rcksum_use_index(struct rcksum_state* z, void* index, size_t len);
+
+/* Use content-defined chunks of the given sizes (see cdc.h) instead of fixed
+ * size blocks; their lengths and checksums are then added in order with
+ * rcksum_add_target_chunk. Source files are cut into chunks the same way and
+ * looked up by checksum, in one pass, whatever the number of threads. */
+int rcksum_set_chunking(struct rcksum_state* z, size_t min, size_t avg, size_t max);
+void rcksum_add_target_chunk(struct rcksum_state* z, zs_blockid b, size_t len, void* checksum);
+
+/* Add a coarser level of blocks of the same target, nblocks of blocksize, a
+ * multiple of the coarsest level's so far. Its block sums are added with
+ * rcksum_add_target_block on the state returned, which belongs to z. Source
+ * files are scanned for the coarsest blocks first, and then the parts that
+ * are left unmatched for the finer ones in turn, down to z's. */
+struct rcksum_state* rcksum_add_level(struct rcksum_state* z, zs_blockid nblocks, size_t blocksize, int rsum_bytes, int checksum_bytes, int require_consecutive_matches);
+
+/* Where a block of the target starts (or for nblocks, the end of the last) */
+off_t rcksum_block_start(const struct rcksum_state* z, zs_blockid b);
+
+/* Scan source files with this many threads (default 1) */
+void rcksum_set_threads(struct rcksum_state* z, int threads);
+
+/* Strong checksum algorithm of the block checksums (default MD4) */
+void rcksum_set_hash_algo(struct rcksum_state* z, int hash);
+
 void rcksum_add_target_block(struct rcksum_state* z, zs_blockid b, struct rsum r, void* checksum);
 
 int rcksum_submit_source_file(struct rcksum_state* z, FILE* f);
 
+/* The blocks of the target that no source data has matched so far, as pairs
+ * of the first block and the block after the last, in a malloc()ed array */
+zs_blockid* rcksum_needed_block_ranges(const struct rcksum_state* z, zs_blockid* num);
+
+/* How many blocks of the target have been matched */
+zs_blockid rcksum_blocks_got(const struct rcksum_state* z);
+
+struct mapfile;
+size_t rcksum_source_pad(const struct rcksum_state* z);
+int rcksum_submit_source_map(struct rcksum_state* z, const struct mapfile* m);
+
+/* Scan a mapped file and send the changes to the upload as the scan goes */
+int rcksum_stream_source_map(struct rcksum_state* z, const struct mapfile* m, upload* u, size_t maxops);
+
 /* For preparing rcksum control files - in both cases len is the block size. */
 struct rsum __attribute__((pure)) rcksum_calc_rsum_block(const unsigned char* data, size_t len);
-void rcksum_calc_checksum(unsigned char *c, const unsigned char* data, size_t len);
-void parseAdd(struct rcksum_state *z, FILE *fnew, size_t ne_len, upload *u);
-void parseMove(struct rcksum_state *z, upload *u);
+void rcksum_calc_rsum_blocks(struct rsum* r, const unsigned char* data, size_t len, size_t nblocks);
+void rcksum_calc_checksum(int hash, unsigned char *c, const unsigned char* data, size_t len);
+void parseAdd(struct rcksum_state *z, const struct mapfile *m, upload *u);
+int parseCopy(struct rcksum_state *z, const struct mapfile *m, int fd);
+void parseMove(struct rcksum_state *z, const struct mapfile *m, upload *u);
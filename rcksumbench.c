@@ -0,0 +1,153 @@
+/* rcksumbench - time lookups in the block index for targets of various sizes.
+ *
+ * For each target size, fills an rcksum_state with random block sums, as
+ * zsyncmake would lay out for a file of that size, builds the hash tables and
+ * then times lookups of blocks that are in the target and of rsums that are
+ * not. The cost per lookup should not depend on the size of the target.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rcksum.h"
+#include "internal.h"
+
+#define LOOKUPS 2000000
+
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned int random32(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng >> 32;
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* find_block(self, rsums, &probes)
+ * Walk the hash table as check_checksum does, up to the first block with the
+ * given rsums; returns its id, or -1 if there is none. Adds the number of
+ * slots looked at to *probes. */
+static zs_blockid find_block(const struct rcksum_state *z, const struct rsum *r, long long *probes) {
+	unsigned long long key = calc_rkey(z, r[0], r[1]);
+	unsigned int hash = calc_rhash2(key);
+
+	if (!bloom_test(z, key))
+		return -1;
+
+	for (unsigned int n = hash_slot_index(z, hash);
+		 z->rsum_hash[n].id != HASH_EMPTY;
+		 n = (n + 1) & z->hashmask) {
+		const struct hash_slot *slot = &z->rsum_hash[n];
+
+		(*probes)++;
+		if (slot->tag != hash || slot->id == HASH_DELETED)
+			continue;
+		for (zs_blockid id = slot->id; id != -1; id = z->hash_next[id]) {
+			if (z->rsums[id].a == (r[0].a & z->rsum_a_mask)
+				&& z->rsums[id].b == r[0].b)
+				return id;
+		}
+		return -1;
+	}
+	return -1;
+}
+
+/* bench(size)
+ * Build the index for a target of the given size and print the lookup
+ * costs. Returns 0 if we ran out of memory. */
+static int bench(double size) {
+	size_t blocksize = size < 100000000 ? 2048 : 4096;
+	zs_blockid blocks = (zs_blockid)(size / blocksize);
+
+	/* Same hash lengths as zsyncmake would choose */
+	int seq_matches = 2;
+	int rsum_len = ceil(((log(size) + log(blocksize)) / log(2) - 8.6) / seq_matches / 8);
+	if (rsum_len > 4) { rsum_len = 4; }
+	if (rsum_len < 2) { rsum_len = 2; }
+
+	struct rcksum_state *z = rcksum_init(blocks, blocksize, rsum_len, 8, seq_matches);
+	if (!z)
+		return 0;
+
+	unsigned char checksum[8];
+	memset(checksum, 0, sizeof checksum);
+	for (zs_blockid id = 0; id < blocks; id++) {
+		struct rsum r;
+
+		r.a = random32();
+		r.b = random32();
+		rcksum_add_target_block(z, id, r, checksum);
+	}
+
+	double t = now();
+	if (!build_hash(z)) {
+		rcksum_end(z);
+		return 0;
+	}
+	double build = now() - t;
+
+	/* Lookups of blocks in the target */
+	long long probes = 0, found = 0;
+	t = now();
+	for (int i = 0; i < LOOKUPS; i++) {
+		zs_blockid id = random32() % blocks;
+
+		found += find_block(z, &z->rsums[id], &probes) >= 0;
+	}
+	double hit = now() - t;
+	double hitprobes = (double)probes / LOOKUPS;
+
+	/* And of rsums that are (almost certainly) not */
+	probes = 0;
+	t = now();
+	for (int i = 0; i < LOOKUPS; i++) {
+		struct rsum r[2];
+
+		r[0].a = random32();
+		r[0].b = random32();
+		r[1].a = random32();
+		r[1].b = random32();
+		found += find_block(z, r, &probes) >= 0;
+	}
+	double miss = now() - t;
+
+	printf("%10.0f MB %9lld blocks %5.2fs build  hit %6.1f ns %5.2f probes  miss %6.1f ns %5.2f probes\n",
+		   size / 1e6, blocks, build,
+		   hit * 1e9 / LOOKUPS, hitprobes,
+		   miss * 1e9 / LOOKUPS, (double)probes / LOOKUPS);
+
+	rcksum_end(z);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	static const double sizes[] = { 1e6, 1e7, 1e8, 1e9, 1e10, 5e10 };
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			if (!bench(atof(argv[i]) * 1e6)) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		if (!bench(sizes[i])) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -23,21 +23,27 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "rcksum.h"
 #include "internal.h"
+#include "mapfile.h"
+#include "xfer.h"
 
-#include <openssl/md4.h>
-
+#include <algorithm>
 #include <map>
+#include <queue>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
 #define UPDATE_RSUM(a, b, oldc, newc, bshift) do { (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc)); (b) += (a) - ((oldc) << (bshift)); } while (0)
 
-/* rcksum_calc_rsum_block(data, data_len)
- * Calculate the rsum for a single block of data. */
-struct rsum __attribute__ ((pure)) rcksum_calc_rsum_block(const unsigned char *data, size_t len) {
+/* rsum_block_scalar(data, data_len)
+ * Plain C version of the rsum calculation, used when no vector unit is
+ * available and for the tail of the block the vector versions leave over. */
+static struct rsum rsum_block_scalar(const unsigned char *data, size_t len) {
 	register unsigned short a = 0;
 	register unsigned short b = 0;
 
@@ -53,56 +59,186 @@ struct rsum __attribute__ ((pure)) rcksum_calc_rsum_block(const unsigned char *d
 	}
 }
 
-/* rcksum_calc_checksum(checksum_buf, data, data_len)
- * Returns the MD4 checksum (in checksum_buf) of the given data block */
-void rcksum_calc_checksum(unsigned char *c, const unsigned char *data,
-						  size_t len) {
-	MD4_CTX ctx;
-	MD4_Init(&ctx);
-	MD4_Update(&ctx, data, len);
-	MD4_Final(c, &ctx);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+/* The vector versions use b = sum over k of a_k, where a_k is the sum of the
+ * first k+1 bytes - which is the same as weighting byte i by (len - i). A
+ * chunk of n bytes then adds n * (a before the chunk) + sum((n - j) * c_j) to
+ * b. All arithmetic is mod 2^32 in the vector lanes, which is fine as we only
+ * want the low 16 bits in the end. */
+
+static inline unsigned int hsum_epi32(__m128i v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+static inline struct rsum rsum_finish(const unsigned char *data, size_t len,
+									  unsigned int a, unsigned int b) {
+	while (len--) {
+		a += *data++;
+		b += a;
+	}
+	{
+		struct rsum r = { (unsigned short)a, (unsigned short)b };
+		return r;
+	}
+}
+
+/* rsum_block_sse2(data, data_len)
+ * 16 bytes at a time with SSE2. */
+static struct rsum rsum_block_sse2(const unsigned char *data, size_t len) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+	__m128i vs1 = zero, vs1_prev = zero, vs2 = zero;
+	size_t n = len / 16;
+
+	while (n--) {
+		__m128i v = _mm_loadu_si128((const __m128i *)data);
+		vs1_prev = _mm_add_epi32(vs1_prev, vs1);
+		vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+		vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+		vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+		data += 16;
+	}
+	return rsum_finish(data, len % 16, hsum_epi32(vs1),
+					   (hsum_epi32(vs1_prev) << 4) + hsum_epi32(vs2));
+}
+
+/* rsum_block_avx2(data, data_len)
+ * 32 bytes at a time with AVX2. */
+__attribute__ ((target("avx2")))
+static struct rsum rsum_block_avx2(const unsigned char *data, size_t len) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+									   24, 23, 22, 21, 20, 19, 18, 17,
+									   16, 15, 14, 13, 12, 11, 10, 9,
+									   8, 7, 6, 5, 4, 3, 2, 1);
+	__m256i vs1 = zero, vs1_prev = zero, vs2 = zero;
+	size_t n = len / 32;
+
+	while (n--) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)data);
+		vs1_prev = _mm256_add_epi32(vs1_prev, vs1);
+		vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+		vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+		data += 32;
+	}
+	{
+		__m128i s1 = _mm_add_epi32(_mm256_castsi256_si128(vs1),
+								   _mm256_extracti128_si256(vs1, 1));
+		__m128i s1p = _mm_add_epi32(_mm256_castsi256_si128(vs1_prev),
+									_mm256_extracti128_si256(vs1_prev, 1));
+		__m128i s2 = _mm_add_epi32(_mm256_castsi256_si128(vs2),
+								   _mm256_extracti128_si256(vs2, 1));
+		return rsum_finish(data, len % 32, hsum_epi32(s1),
+						   (hsum_epi32(s1p) << 5) + hsum_epi32(s2));
+	}
+}
+
+/* Pick the widest implementation the CPU we're running on supports. */
+static struct rsum (*pick_rsum_block(void))(const unsigned char *, size_t) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return rsum_block_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return rsum_block_sse2;
+	return rsum_block_scalar;
+}
+#else
+static struct rsum (*pick_rsum_block(void))(const unsigned char *, size_t) {
+	return rsum_block_scalar;
+}
+#endif
+
+static struct rsum (*const rsum_block)(const unsigned char *, size_t) = pick_rsum_block();
+
+/* rcksum_calc_rsum_block(data, data_len)
+ * Calculate the rsum for a single block of data. */
+struct rsum __attribute__ ((pure)) rcksum_calc_rsum_block(const unsigned char *data, size_t len) {
+	return rsum_block(data, len);
+}
+
+/* rcksum_calc_rsum_blocks(rsums, data, data_len, nblocks)
+ * Calculate the rsums of nblocks consecutive blocks of data_len bytes each. */
+void rcksum_calc_rsum_blocks(struct rsum *r, const unsigned char *data, size_t len, size_t n) {
+	while (n--) {
+		*r++ = rsum_block(data, len);
+		data += len;
+	}
 }
 
-int check_checksum(struct rcksum_state *const z, const struct hash_entry *e, const unsigned char *data, struct rsum *r, int prev_valid, zs_blockid *id) {
+/* check_checksum(self, scan, hash, data, rsums, prev_valid, &blockid)
+ * Probe the hash table from the slot for the given hash value for the chain
+ * of blocks with that tag, and look along it for a block whose checksums
+ * match the data. Blocks already claimed by this scan are passed over.
+ * Returns 1 and sets *id if one was found. */
+int check_checksum(struct rcksum_state *const z, struct rcksum_scan *s, unsigned int hash, const unsigned char *data, const struct rsum *r, int prev_valid, zs_blockid *id) {
+
+	const struct hash_slot *slot;
+	unsigned int n;
+	for (n = hash_slot_index(z, hash);
+		 (slot = &z->rsum_hash[n])->id != HASH_EMPTY;
+		 n = (n + 1) & z->hashmask) {
 
-	const struct hash_entry *e_next = e;
-	while(e_next) {
+		//Check the tag first; it rules out most other blocks in the probe
+		if (slot->tag == hash && slot->id != HASH_DELETED) {
+			break;
+		}
+	}
+	if (slot->id == HASH_EMPTY) {
+		return 0;
+	}
+	s->stats.hashhit++;
+
+	int keyed = 0;
+	for (zs_blockid _id = slot->id; _id != -1; _id = z->hash_next[_id]) {
 
-		e = e_next;
-		e_next = e->next;
-		
 		//Check weak checksum
-		if (e->r.a != (r[0].a & z->rsum_a_mask) || e->r.b != r[0].b) {
+		if (z->rsums[_id].a != (r[0].a & z->rsum_a_mask) || z->rsums[_id].b != r[0].b) {
 			continue;
 		}
+		s->stats.weakhit++;
 
-		//Get the current block id
-		zs_blockid _id = get_HE_blockid(z, e);
-
-		// If the previous block is not valid.. check the next block to verify this one..
 		//Check weak checksum of next block
-		if (!prev_valid) {
-			if (z->blockhashes[_id+1].r.a != (r[1].a & z->rsum_a_mask) || z->blockhashes[_id+1].r.b != r[1].b) {
-				continue;
-			}
+		int next_weak = z->seq_matches < 2
+			|| (z->rsums[_id+1].a == (r[1].a & z->rsum_a_mask) && z->rsums[_id+1].b == r[1].b);
+		if (next_weak && !keyed++) {
+			s->stats.rsumhit++;
+		}
+
+		//Skip blocks this scan already has
+		if (s->claimed[_id >> 3] & (1 << (_id & 7))) {
+			continue;
+		}
+
+		// If the previous block is not valid.. the next block has to match too
+		if (!prev_valid && !next_weak) {
+			continue;
 		}
 
 		//Check long checksum
-		unsigned char md4sum[MD4_DIGEST_LENGTH];
-		rcksum_calc_checksum(&md4sum[0], data, z->blocksize);
-		if (memcmp(&md4sum[0], z->blockhashes[_id].checksum, z->checksum_bytes)) {
+		unsigned char checksum[CHECKSUM_SIZE];
+		s->stats.checksummed++;
+		rcksum_calc_checksum(z->hash_algo, &checksum[0], data, z->blocksize);
+		if (memcmp(&checksum[0], get_checksum(z, _id), z->checksum_bytes)) {
 			continue;
 		}
 
 		// If the previous block is not valid.. check the next block to verify this one..
-		if (!prev_valid) {
+		if (!prev_valid && z->seq_matches > 1) {
 			//Check long checksum of next block
-			rcksum_calc_checksum(&md4sum[0], data + z->blocksize, z->blocksize);
-			if (memcmp(&md4sum[0], z->blockhashes[_id+1].checksum, z->checksum_bytes)) {
+			s->stats.checksummed++;
+			rcksum_calc_checksum(z->hash_algo, &checksum[0], data + z->blocksize, z->blocksize);
+			if (memcmp(&checksum[0], get_checksum(z, _id+1), z->checksum_bytes)) {
 				continue;
 			}
 		}
 
+		s->stats.stronghit++;
 		*id = _id;
 
 		return 1;
@@ -110,60 +246,473 @@ int check_checksum(struct rcksum_state *const z, const struct hash_entry *e, con
 	return 0;
 }
 
-int check_data(struct rcksum_state *z, unsigned char *data, size_t len, size_t offset) {
-	int x = 0;
-	register int bs = z->blocksize;
+/* check_block(self, scan, blockid, data, rsums)
+ * Return 1 if the data is the given block of the target, on its own checksums
+ * alone, and this scan hasn't already claimed that block. Unlike blocks found
+ * through the hash table, the block may already be got, by a coarser level or
+ * an earlier source file; a scan of its own checks for that too, while the
+ * merge after a parallel scan does it for the threads. */
+static int check_block(struct rcksum_state *const z, struct rcksum_scan *s, zs_blockid id, const unsigned char *data, const struct rsum *r) {
+	unsigned char checksum[CHECKSUM_SIZE];
+
+	if (s->claimed[id >> 3] & (1 << (id & 7)))
+		return 0;
+	if (!s->shared && already_got_block(z, id))
+		return 0;
+	if (z->rsums[id].a != (r[0].a & z->rsum_a_mask) || z->rsums[id].b != r[0].b)
+		return 0;
+
+	s->stats.checksummed++;
+	rcksum_calc_checksum(z->hash_algo, &checksum[0], data, z->blocksize);
+	if (memcmp(&checksum[0], get_checksum(z, id), z->checksum_bytes))
+		return 0;
+
+	s->stats.stronghit++;
+	return 1;
+}
+
+/* note_match(self, offset, blockid)
+ * Note that the data at the given offset of the source file is block id of
+ * the target. Returns 0, noting nothing, if the block was already got (by an
+ * earlier source file, say), so that the match log never holds more than
+ * one match per block. */
+static int note_match(struct rcksum_state *z, size_t offset, zs_blockid id) {
+	if (already_got_block(z, id))
+		return 0;
+
+	mark_block_got(z, id);
+	if (z->stream) {
+		stream_match(z, offset, id);
+		return 1;
+	}
+
+	struct rcksum_match match = { offset, id };
+	z->matches[z->nmatches++] = match;
+	return 1;
+}
+
+/* record_match(self, offset, blockid)
+ * As note_match, and stop looking for that block. */
+static int record_match(struct rcksum_state *z, size_t offset, zs_blockid id) {
+	int noted = note_match(z, offset, id);
+
+	remove_block_from_hash(z, id);
+	return noted;
+}
+
+/* check_data(self, scan, data, len, offset)
+ * Scan a buffer of len bytes, which starts at the given offset in the source
+ * file, for blocks of the target. The rolling checksums in s->r are carried
+ * forward one byte at a time and only recalculated from scratch after jumping
+ * over a matched block. The buffer must contain z->context bytes of lookahead
+ * past the last offset scanned; the next buffer is expected to start at
+ * len - z->context, and s->skip/s->r/s->prev_id carry our position across
+ * to it. */
+int check_data(struct rcksum_state *z, struct rcksum_scan *s, const unsigned char *data, size_t len, size_t offset) {
+	size_t x = s->skip;
+	register size_t bs = z->blocksize;
 	int got_blocks = 0;
 
-	int prev_valid = 0;
+	zs_blockid prev_id = s->prev_id;	/* block matched immediately before x */
+
+	/* Carry on where the previous buffer left off. The rsums are still valid
+	 * unless we jumped over its end after a match. */
+	if (!s->have_rsum && x + z->context <= len) {
+		s->r[0] = rcksum_calc_rsum_block(data + x, bs);
+		if (z->seq_matches > 1)
+			s->r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
+		s->have_rsum = 1;
+	}
+	s->skip = 0;
 
 	for (;;) {
 		if (x + z->context >= len) {
+			s->prev_id = prev_id;
 			return got_blocks;
 		}
 
-		struct rsum r[2];
-		r[0] = rcksum_calc_rsum_block(data + x, bs);
-		r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
+		{
+			//Get block id
+			zs_blockid id = -1;
+			int matched = 0;
+
+			/* Straight after a match the following block of the target is
+			 * the most likely one, so try that first; it only has to match on
+			 * its own, as the previous block has already matched. */
+			if (prev_id >= 0 && prev_id + 1 < z->blocks
+				&& check_block(z, s, prev_id + 1, data+x, s->r)) {
+				id = prev_id + 1;
+				matched = 1;
+			}
+			else {
+				s->stats.lookups++;
+				unsigned long long key = calc_rkey(z, s->r[0], s->r[1]);
+				if (bloom_test(z, key)) {
+					unsigned int hash = calc_rhash2(key);
+					s->stats.filterhit++;
+					matched = check_checksum(z, s, hash, data+x, s->r, prev_id >= 0, &id);
+				}
+			}
 
+			if (matched && !s->shared)
+				matched = record_match(z, offset + x, id);
+			if (matched) {
+				s->claimed[id >> 3] |= 1 << (id & 7);
+				if (s->shared) {
+					struct rcksum_match match = { offset + x, id };
+					s->matches.push_back(match);
+				}
+
+				got_blocks++;
+				prev_id = id;
+
+				x += bs;
+
+				/* If the next window runs off the end of this buffer,
+				 * remember how far into the next buffer to resume. */
+				if (x + z->context > len) {
+					s->skip = x + z->context - len;
+					s->have_rsum = 0;
+					s->prev_id = prev_id;
+					return got_blocks;
+				}
+
+				/* Jumped a whole block; recalculate the rsums afresh */
+				s->r[0] = rcksum_calc_rsum_block(data + x, bs);
+				if (z->seq_matches > 1)
+					s->r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
+				continue;
+			}
+		}
+
+		/* No match - advance the window by 1 byte, updating the rolling
+		 * checksums with the byte leaving and the byte entering each block */
 		{
-			const struct hash_entry *e;
-			unsigned int hash = calc_rhash2(z, r[0], r[1]);
-			if ((z->bithash[(hash & z->bithashmask) >> 3] & (1 << (hash & 7))) != 0
-				&& (e = z->rsum_hash[hash & z->hashmask]) != NULL) {
+			unsigned char oc = data[x];
+			unsigned char nc = data[x + bs];
+			UPDATE_RSUM(s->r[0].a, s->r[0].b, oc, nc, z->blockshift);
+			if (z->seq_matches > 1) {
+				unsigned char Nc = data[x + bs * 2];
+				UPDATE_RSUM(s->r[1].a, s->r[1].b, nc, Nc, z->blockshift);
+			}
+		}
+		x++;
+		prev_id = -1;
+	}
+	return 0;
+}
+
+/* add_stats(to, from)
+ * Add the counts from one set of stats to another. */
+static void add_stats(struct rcksum_stats *to, const struct rcksum_stats *from) {
+	to->lookups += from->lookups;
+	to->filterhit += from->filterhit;
+	to->hashhit += from->hashhit;
+	to->rsumhit += from->rsumhit;
+	to->weakhit += from->weakhit;
+	to->checksummed += from->checksummed;
+	to->stronghit += from->stronghit;
+}
+
+/* print_stats(self)
+ * Report how well the lookups were filtered. The filter's false positives
+ * are the offsets it let through for which no block had the same rsums. */
+static void print_stats(const struct rcksum_state *z) {
+	long long negatives = z->stats.lookups - z->stats.rsumhit;
+	long long falsepos = z->stats.filterhit - z->stats.rsumhit;
+
+	printf("lookups %lld, filter hits %lld (%.3f%% false positives), "
+		   "hash hits %lld, weak hits %lld, checksummed %lld, strong hits %lld\n",
+		   z->stats.lookups, z->stats.filterhit,
+		   negatives ? 100.0 * falsepos / negatives : 0.0, z->stats.hashhit,
+		   z->stats.weakhit, z->stats.checksummed, z->stats.stronghit);
+}
+
+/* init_scan(self, scan, shared)
+ * Set up the state for a new scan from the start of a buffer. Returns 0 if
+ * out of memory. */
+static int init_scan(struct rcksum_state *z, struct rcksum_scan *s, int shared) {
+	s->have_rsum = 0;
+	s->skip = 0;
+	s->prev_id = -1;
+	s->shared = shared;
+	memset(&s->stats, 0, sizeof(s->stats));
+	s->claimed = (unsigned char *)arena_alloc(z->arena, (z->blocks + 7) / 8);
+	return s->claimed != NULL;
+}
+
+/* Mapped files are scanned this much at a time, each window being dropped
+ * from our mapping once scanned, so that a scan keeps at most about this much
+ * of the file resident whatever its size. */
+#define SCAN_WINDOW (8 * 1024 * 1024)
+
+/* scan_segment(self, scan, map, start, end)
+ * Scan the offsets start..end-1 of the mapped file, window by window. The
+ * mapping's zero padding supplies the lookahead past the end of the file.
+ * Returns the number of blocks matched. */
+static int scan_segment(struct rcksum_state *z, struct rcksum_scan *s,
+						const struct mapfile *m, off_t start, off_t end) {
+	int got_blocks = 0;
+
+	for (off_t off = start; off < end; off += SCAN_WINDOW) {
+		size_t n = end - off < SCAN_WINDOW ? end - off : SCAN_WINDOW;
+
+		got_blocks += check_data(z, s, m->data + off, n + z->context, off);
+		mapfile_advise(m, off, n, MADV_DONTNEED);
+	}
+	return got_blocks;
+}
 
-				//Get block id
-				zs_blockid id = -1;
+/* scan_chunks(self, scan, map)
+ * Cut the mapped file into chunks as the target was, and look each up by its
+ * checksum: one pass over the data, with no search at other offsets. Returns
+ * the number of chunks matched. */
+static int scan_chunks(struct rcksum_state *z, struct rcksum_scan *s, const struct mapfile *m) {
+	unsigned char checksum[CHECKSUM_SIZE];
+	int got_blocks = 0;
+	off_t done = 0;
 
-				int matched = check_checksum(z, e, data+x, r, prev_valid, &id);
+	for (off_t off = 0; off < m->len;) {
+		size_t n = cdc_cut(&z->cdc, m->data + off, m->len - off);
 
-				if (matched) {
-					z->offsets->push_back(offset+x);
+		s->stats.lookups++;
+		s->stats.checksummed++;
+		rcksum_calc_checksum(z->hash_algo, &checksum[0], m->data + off, n);
 
-					if (id * z->blocksize != offset+x) {
-						long long diff = (offset+x) - id*z->blocksize;
-						(*(z->moves))[diff].push_back(id*z->blocksize);
-						//printf("%d: Add to %lld\n", id, diff);
-					}
+		zs_blockid id = find_chunk(z, &checksum[0], n);
+		if (id != -1) {
+			s->stats.stronghit++;
+			got_blocks += record_match(z, off, id);
+		}
+		off += n;
 
-					got_blocks++;
-					remove_block_from_hash(z, id);
-					prev_valid = 1;
+		if (off - done >= SCAN_WINDOW) {
+			mapfile_advise(m, done, off - done, MADV_DONTNEED);
+			done = off;
+		}
+	}
+	return got_blocks;
+}
 
-					x += bs;
+/* submit_source_map_parallel(self, map)
+ * Split the file into one segment per thread and scan them concurrently
+ * against the hash table, which is left untouched while they run. Each
+ * segment overlaps the next by z->context bytes, so the last offsets of a
+ * segment can still be matched. The matches are then merged in file order,
+ * dropping any that overlap an earlier match. A match for a block an earlier
+ * segment already matched is moved to an identical block that is still
+ * free, if there is one (as in files with runs of zeros, which every segment
+ * matches to the same first few blocks), and dropped otherwise. The hash
+ * table stays untouched until all the threads are done, so the result does
+ * not depend on how they were scheduled. */
+static int submit_source_map_parallel(struct rcksum_state *z, const struct mapfile *m) {
+	int nseg = z->threads;
+	int got_blocks = 0;
+
+	/* Don't bother with segments of less than 16 blocks */
+	if (m->len / (off_t)(z->blocksize * 16) < nseg)
+		nseg = m->len / (z->blocksize * 16);
+	if (nseg < 1)
+		nseg = 1;
+
+	vector<struct rcksum_scan> scans(nseg);
+	vector<thread> threads;
+
+	for (int i = 0; i < nseg; i++) {
+		struct rcksum_scan *s = &scans[i];
+		off_t start = m->len * i / nseg;
+		off_t end = m->len * (i + 1) / nseg;
+
+		if (!init_scan(z, s, 1)) {
+			nseg = i;
+			break;
+		}
+		threads.push_back(thread(scan_segment, z, s, m, start, end));
+	}
+
+	/* Merge in file order. Scans are in order, and each scan's matches are in
+	 * order, so this is a simple walk. Each segment is merged as soon as it
+	 * and all the ones before it are done, so that streamed uploads can get
+	 * going. */
+	{
+		size_t next_free = 0;
+		zs_blockid prev_id = -1;
 
-					if (x+z->context > len) {
-						return got_blocks;
-					}
+		for (int i = 0; i < nseg; i++) {
+			struct rcksum_scan *s = &scans[i];
+
+			threads[i].join();
+
+			for (size_t j = 0; j < s->matches.size(); j++) {
+				size_t offset = s->matches[j].offset;
+				zs_blockid id = s->matches[j].id;
+
+				if (offset < next_free)
 					continue;
+				if (already_got_block(z, id)) {
+					/* Following on from the last match is tried first, as
+					 * the sequential scan would */
+					id = find_same_block(z, id, offset == next_free ? prev_id + 1 : -1);
+					if (id == -1)
+						continue;
 				}
+
+				note_match(z, offset, id);
+				next_free = offset + z->blocksize;
+				prev_id = id;
+				got_blocks++;
 			}
+			add_stats(&z->stats, &s->stats);
 		}
 
-		x++;
-		prev_valid = 0;
+		for (zs_blockid id = next_known_block(z, 0); id < z->blocks; id = next_known_block(z, id + 1))
+			remove_block_from_hash(z, id);
 	}
-	return 0;
+	return got_blocks;
+}
+
+static bool match_before(const struct rcksum_match &a, const struct rcksum_match &b) {
+	return a.offset < b.offset;
+}
+
+/* scan_gap(self, scan, map, start, end)
+ * Scan the part of the mapped file from start to end, which coarser blocks
+ * left unmatched, for blocks that lie wholly within it, or that run on into
+ * the padding at the end of the file. Returns the number of blocks matched. */
+static int scan_gap(struct rcksum_state *z, struct rcksum_scan *s,
+					const struct mapfile *m, off_t start, off_t end) {
+	if (end < m->len)
+		end -= z->blocksize - 1;
+	if (end <= start)
+		return 0;
+
+	s->have_rsum = 0;
+	s->skip = 0;
+	s->prev_id = -1;
+	return scan_segment(z, s, m, start, end);
+}
+
+static int scan_source_map(struct rcksum_state *z, const struct mapfile *m);
+
+/* submit_source_map_levels(self, map)
+ * Scan for the coarser level's blocks first; each one matched is a run of
+ * ours. Then only the gaps between those matches are scanned for our blocks,
+ * with a hash table of just the blocks still needed, so that the fine blocks
+ * only cost time and memory where the file changed. The matches come out of
+ * file order, so for a streamed upload they are collected and handed over in
+ * order at the end. */
+static int submit_source_map_levels(struct rcksum_state *z, const struct mapfile *m) {
+	struct rcksum_state *c = z->coarse;
+	struct rcksum_stream *stream = z->stream;
+	zs_blockid ratio = c->blocksize / z->blocksize;
+	int got_blocks = 0;
+
+	z->stream = NULL;
+
+	scan_source_map(c, m);
+	for (size_t i = 0; i < c->nmatches; i++) {
+		const struct rcksum_match *cm = &c->matches[i];
+
+		for (zs_blockid j = 0; j < ratio && cm->id * ratio + j < z->blocks; j++) {
+			zs_blockid id = cm->id * ratio + j;
+
+			got_blocks += record_match(z, cm->offset + j * z->blocksize, id);
+		}
+	}
+	c->nmatches = 0;
+	add_stats(&z->stats, &c->stats);
+	memset(&c->stats, 0, sizeof(c->stats));
+
+	struct rcksum_scan s;
+	if (!build_hash(z) || !init_scan(z, &s, 0)) {
+		z->stream = stream;
+		return got_blocks;
+	}
+
+	sort(z->matches, z->matches + z->nmatches, match_before);
+
+	/* Matches of the gaps are added after these, which stay put */
+	size_t n = z->nmatches;
+	off_t next = 0, done = 0;
+
+	for (size_t i = 0; i <= n; i++) {
+		off_t start = i < n ? (off_t)z->matches[i].offset : m->len;
+
+		if (start > next)
+			got_blocks += scan_gap(z, &s, m, next, start);
+		if (i < n && start + (off_t)z->blocksize > next)
+			next = start + z->blocksize;
+
+		/* Pages around the gaps get mapped in with them, so drop all that
+		 * we have passed, as scan_segment would */
+		if (start - done >= SCAN_WINDOW || i == n) {
+			mapfile_advise(m, done, start - done, MADV_DONTNEED);
+			done = start;
+		}
+	}
+	add_stats(&z->stats, &s.stats);
+
+	z->stream = stream;
+	if (!is_sorted(z->matches, z->matches + z->nmatches, match_before))
+		sort(z->matches, z->matches + z->nmatches, match_before);
+	if (stream) {
+		for (size_t i = 0; i < z->nmatches; i++)
+			stream_match(z, z->matches[i].offset, z->matches[i].id);
+		z->nmatches = 0;
+	}
+	return got_blocks;
+}
+
+/* rcksum_source_pad(self)
+ * How many bytes of zero padding a mapped source file needs after its end. */
+size_t rcksum_source_pad(const struct rcksum_state *z) {
+	return z->context;
+}
+
+/* rcksum_submit_source_map(self, map)
+ * As rcksum_submit_source_file, but for a file that is already mapped into
+ * memory with at least rcksum_source_pad() bytes of zero padding. The data is
+ * scanned in place. */
+int rcksum_submit_source_map(struct rcksum_state *z, const struct mapfile *m) {
+	int got_blocks = scan_source_map(z, m);
+
+	printf("%d\n", got_blocks);
+	print_stats(z);
+	return got_blocks;
+}
+
+/* scan_source_map(self, map)
+ * The scan itself, for rcksum_submit_source_map and for coarser levels'. */
+static int scan_source_map(struct rcksum_state *z, const struct mapfile *m) {
+	int got_blocks;
+
+	if (z->coarse)
+		return submit_source_map_levels(z, m);
+
+	build_hash(z);
+
+	mapfile_advise(m, 0, m->len, MADV_SEQUENTIAL);
+
+	if (z->chunk_off) {
+		struct rcksum_scan s;
+		if (!init_scan(z, &s, 0))
+			return 0;
+
+		got_blocks = scan_chunks(z, &s, m);
+		add_stats(&z->stats, &s.stats);
+	}
+	else if (z->threads > 1) {
+		got_blocks = submit_source_map_parallel(z, m);
+	}
+	else {
+		struct rcksum_scan s;
+		if (!init_scan(z, &s, 0))
+			return 0;
+
+		got_blocks = scan_segment(z, &s, m, 0, m->len);
+		add_stats(&z->stats, &s.stats);
+	}
+	return got_blocks;
 }
 
 /* rcksum_submit_source_file(self, stream, progress)
@@ -176,12 +725,34 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f) {
 	int got_blocks = 0;
 	off_t in = 0;
 
-	/* Allocate buffer of 16 blocks */
-	register int bufsize = z->blocksize * 16;
-	unsigned char *buf = (unsigned char *)malloc(bufsize + z->context);
+	/* Regular files are mapped and scanned in place */
+	{
+		struct mapfile *m = mapfile_open(f, rcksum_source_pad(z));
+		if (m) {
+			got_blocks = rcksum_submit_source_map(z, m);
+			mapfile_close(m);
+			return got_blocks;
+		}
+	}
+
+	/* Chunks are only cut from mapped data */
+	if (z->chunk_off) {
+		fprintf(stderr, "content-defined chunks need a regular file to read from\n");
+		return 0;
+	}
+
+	struct rcksum_scan s;
+	if (!init_scan(z, &s, 0))
+		return 0;
 
 	build_hash(z);
 
+	/* Allocate buffer of 16 blocks */
+	register int bufsize = z->blocksize * 16;
+	unsigned char *buf = (unsigned char *)arena_alloc(z->arena, bufsize + z->context);
+	if (!buf)
+		return 0;
+
 	while (!feof(f)) {
 		size_t len;
 		off_t start_in = in;
@@ -201,7 +772,6 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f) {
 
 		if (ferror(f)) {
 			perror("fread");
-			free(buf);
 			return got_blocks;
 		}
 		if (feof(f)) {		  /* 0 pad to complete a block */
@@ -210,87 +780,383 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f) {
 		}
 
 		/* Process the data in the buffer, and report progress */
-		got_blocks += check_data(z, buf, len, start_in);
+		got_blocks += check_data(z, &s, buf, len, start_in);
 	}
 	printf("%d\n", got_blocks);
-	free(buf);
+	add_stats(&z->stats, &s.stats);
+	print_stats(z);
 	return got_blocks;
 }
 
-void parseAdd(struct rcksum_state *z, FILE *fnew, size_t new_len, upload *u) {
-	z->offsets->sort();
+/* add_range(self, map, start, len, upload)
+ * Send the given range of the new file as literal data, in pieces read into
+ * one of the upload's transfer buffers, so that sending doesn't fault the
+ * whole range into our mapping. */
+void add_range(const struct mapfile *m, size_t start, size_t len, upload *u) {
+	while (len) {
+		size_t s = len < XFER_SIZE ? len : XFER_SIZE;
+		unsigned char *buf = u->get_buffer();
+
+		if (mapfile_read(m, start, buf, s) != 0) {
+			perror("pread");
+			u->put_buffer(buf);
+			return;
+		}
+		u->add(start, s, (const char *)buf);
+		u->put_buffer(buf);
+		len -= s;
+		start += s;
+	}
+}
+
+/* parseAdd(self, map, upload)
+ * Send everything in the new file that no match covers as literal data,
+ * and what parseMove cut out of its moves, in order of offset. So when data
+ * is compressed, whatever precedes an add (and is its dictionary) is in
+ * place on the server by then. */
+void parseAdd(struct rcksum_state *z, const struct mapfile *m, upload *u) {
+	struct rcksum_match *begin = z->matches, *end = z->matches + z->nmatches;
+	const off_t *cut = z->cuts, *cutend = z->cuts + 2 * z->ncuts;
+
+	/* In order already, unless there was more than one source file */
+	if (!is_sorted(begin, end, match_before))
+		sort(begin, end, match_before);
 
 	size_t i = 0;
-	do {
-		size_t offset = z->offsets->front();
-		z->offsets->pop_front();
+	for (const struct rcksum_match *it = begin; it != end; it++) {
+		//Copy all bytes up to this block
+		if (it->offset - i) {
+			add_range(m, i, it->offset - i, u);
+		}
+
+		/* Cuts are within matches, so come between the gaps */
+		i = it->offset + block_len(z, it->id);
+		for (; cut != cutend && (size_t)cut[0] < i; cut += 2)
+			add_range(m, cut[0], cut[1], u);
+	}
 
-		if (offset - i) {
-			//Set read/write pointer at right location
-			fseek(fnew, i, SEEK_SET);
+	//If we just appended the file... fix it here
+	if (i < (size_t)m->len) {
+		add_range(m, i, m->len - i, u);
+	}
+}
 
-			//Now copy all required bytes
-			size_t left = offset-i;
+/* parseCopy(self, map, fd)
+ * Write the blocks of the target that the scan found in the source to their
+ * place in the file fd, reading runs of blocks that follow on from each other
+ * in both files in one go. The last block may run past the end of the
+ * target, which the caller cuts off. Returns 0 on success. */
+int parseCopy(struct rcksum_state *z, const struct mapfile *m, int fd) {
+	struct rcksum_match *begin = z->matches, *end = z->matches + z->nmatches;
+	unsigned char *buf = (unsigned char *)malloc(XFER_SIZE);
+	int rc = 0;
 
-			while(left) {
-				char *x = (char *)malloc(sizeof(char) * 102400);
-				size_t s = left < 102400 ? left : 102400;
-				fread(x, 1, s, fnew);
-				u->add(i, s, x);
-				free(x);
+	if (!buf)
+		return -1;
 
-				left = left - s;
-				i = i+s;
+	for (const struct rcksum_match *it = begin; it != end && rc == 0;) {
+		const struct rcksum_match *run = it + 1;
 
-			}
-			i = offset;
-		} 
+		while (run != end && run->offset == run[-1].offset + block_len(z, run[-1].id)
+			   && run->id == run[-1].id + 1)
+			run++;
 
-		i += z->blocksize;
-	} while(!z->offsets->empty());
+		size_t from = it->offset;
+		off_t to = block_start(z, it->id);
+		size_t len = block_start(z, run[-1].id) + block_len(z, run[-1].id) - to;
 
-	//If we just appended the file... fix it here
-	if (i < new_len) {
-		fseek(fnew, i, SEEK_SET);
+		while (len && rc == 0) {
+			size_t n = len < XFER_SIZE ? len : XFER_SIZE;
 
-		while(i < new_len) {
-			char *x = (char *)malloc(sizeof(char) * 102400);
-			size_t s = (new_len - i) < 102400 ? (new_len - i) : 102400;
-			fread(x, 1, s, fnew);
-			u->add(i, s, x);
-			i = i+s;
+			/* Matches at the end of the source can take in its padding */
+			size_t have = from >= (size_t)m->len ? 0 : min(n, (size_t)m->len - from);
+
+			memset(buf + have, 0, n - have);
+			if ((have && mapfile_read(m, from, buf, have) != 0)
+				|| pwrite(fd, buf, n, to) != (ssize_t)n)
+				rc = -1;
+			from += n;
+			to += n;
+			len -= n;
 		}
+		it = run;
 	}
+	free(buf);
+	return rc;
 }
 
-void parseMove(struct rcksum_state *z, upload *u) {
-	for (auto it = z->moves->begin(); it != z->moves->end(); it++) {
-		long long move = it->first;
-		list<size_t> offsets = it->second;
+/* A move of len bytes at from in the old file to to in the new one */
+struct move_op {
+	size_t from, to, len;
+};
 
-		printf("%lu\n", offsets.size());
-		for(auto it2 = offsets.begin(); it2 != offsets.end(); it2++) {
-			size_t offset = *it2;
+/* plan_moves(self, &moves)
+ * Turn the matches whose blocks have moved into moves, sorted by target,
+ * merging those that continue one another into single moves. */
+static void plan_moves(struct rcksum_state *z, vector<struct move_op> &moves) {
+	struct rcksum_match *begin = z->matches, *end = z->matches + z->nmatches;
 
-			size_t num = 1;
-			size_t prev = offset;
+	/* In order of target already, unless there was more than one source
+	 * file */
+	if (!is_sorted(begin, end, match_before))
+		sort(begin, end, match_before);
 
-			auto it3 = it2;
-			it3++;
+	for (const struct rcksum_match *it = begin; it != end; it++) {
+		size_t from = block_start(z, it->id);
+		size_t len = block_len(z, it->id);
 
-			while ( it3 != offsets.end() && (*it3) == prev + 2048 ) {
-				prev = (*it3);
-				it3++;
-				num++;
+		if (from == it->offset)
+			continue;
+		if (!moves.empty()) {
+			struct move_op &prev = moves.back();
+
+			if (prev.to + prev.len == it->offset && prev.from + prev.len == from) {
+				prev.len += len;
+				continue;
 			}
+		}
+
+		struct move_op mv = { from, it->offset, len };
+		moves.push_back(mv);
+	}
+}
+
+/* Whether a's source overlaps b's target, so that a must be applied first */
+static inline int move_reads(const struct move_op &a, const struct move_op &b) {
+	return a.from < b.to + b.len && b.to < a.from + a.len;
+}
+
+/* The graph of which moves must come before which, for order_moves */
+struct move_graph {
+	vector<struct move_op> &moves;
+	vector<vector<size_t> > succ, pred;
+	vector<size_t> indeg;
+	vector<char> done;
+
+	move_graph(vector<struct move_op> &m) : moves(m), succ(m.size()), pred(m.size()), indeg(m.size(), 0), done(m.size(), 0) {}
+
+	void link(size_t a, size_t b) {
+		if (a != b && move_reads(moves[a], moves[b])) {
+			succ[a].push_back(b);
+			pred[b].push_back(a);
+			indeg[b]++;
+		}
+	}
+
+	/* first unfinished predecessor of a, which must have one */
+	size_t waiting_on(size_t a) {
+		for (auto p = pred[a].begin(); ; p++) {
+			if (!done[*p])
+				return *p;
+		}
+	}
+
+	void cut(size_t w, size_t start, size_t end, vector<size_t> &freed);
+};
+
+/* cut(w, start, end, &freed)
+ * Take start..end-1, within its target, out of move w, which becomes up to
+ * two moves for what is either side. Their links are a subset of w's, plus
+ * possibly one between the two. Adds the moves left waiting on nothing to
+ * freed. */
+void move_graph::cut(size_t w, size_t start, size_t end, vector<size_t> &freed) {
+	vector<size_t> before, after;
+
+	for (auto p = pred[w].begin(); p != pred[w].end(); p++) {
+		if (!done[*p]) {
+			before.push_back(*p);
+			succ[*p].erase(remove(succ[*p].begin(), succ[*p].end(), w), succ[*p].end());
+		}
+	}
+	for (auto b = succ[w].begin(); b != succ[w].end(); b++) {
+		if (!done[*b]) {
+			after.push_back(*b);
+			pred[*b].erase(remove(pred[*b].begin(), pred[*b].end(), w), pred[*b].end());
+			indeg[*b]--;
+		}
+	}
+	pred[w].clear();
+	succ[w].clear();
+	indeg[w] = 0;
+
+	struct move_op mv = moves[w];
+	struct move_op right = { mv.from + (end - mv.to), end, mv.to + mv.len - end };
+	vector<size_t> pieces;
+
+	moves[w].len = start - mv.to;
+	if (moves[w].len)
+		pieces.push_back(w);
+	else
+		done[w] = 1;
+	if (right.len) {
+		moves.push_back(right);
+		succ.emplace_back();
+		pred.emplace_back();
+		indeg.push_back(0);
+		done.push_back(0);
+		pieces.push_back(moves.size() - 1);
+	}
+
+	for (auto x = pieces.begin(); x != pieces.end(); x++) {
+		for (auto p = before.begin(); p != before.end(); p++)
+			link(*p, *x);
+		for (auto b = after.begin(); b != after.end(); b++)
+			link(*x, *b);
+	}
+	if (pieces.size() == 2) {
+		link(pieces[0], pieces[1]);
+		link(pieces[1], pieces[0]);
+	}
+
+	for (auto x = pieces.begin(); x != pieces.end(); x++) {
+		if (!indeg[*x])
+			freed.push_back(*x);
+	}
+	for (auto b = after.begin(); b != after.end(); b++) {
+		if (!indeg[*b])
+			freed.push_back(*b);
+	}
+}
 
-			it2 = it3;
+/* order_moves(&moves, &order, &cuts)
+ * Order the moves (sorted by target, as from plan_moves) so that they can be
+ * applied one after another to the old file in place: each move comes before
+ * any other whose target overlaps its source, so no move reads data that an
+ * earlier one has overwritten. Where moves depend on each other in a cycle,
+ * the smallest overlap in the cycle is cut out of the target of the move that
+ * would overwrite it, splitting that move, and added to cuts to be sent as
+ * literal data after all the moves. */
+static void order_moves(vector<struct move_op> &moves, vector<size_t> &order, vector<struct move_op> &cuts) {
+	size_t n = moves.size();
+	struct move_graph g(moves);
 
-			u->move(offset, offset+move, 2048 * num);
+	/* Targets are disjoint and sorted, so their ends are sorted too; find
+	 * the targets each source overlaps */
+	for (size_t a = 0; a < n; a++) {
+		size_t start = moves[a].from, end = moves[a].from + moves[a].len;
+		size_t b = partition_point(moves.begin(), moves.end(),
+								   [start](const struct move_op &m) { return m.to + m.len <= start; }) - moves.begin();
+
+		for (; b < n && moves[b].to < end; b++)
+			g.link(a, b);
+	}
 
-			if (it2 == offsets.end()) {
+	/* Take moves whose sources nothing still to come will overwrite, in
+	 * order of target where we can, for sequential writes on the server */
+	typedef pair<size_t, size_t> ready_move;
+	priority_queue<ready_move, vector<ready_move>, greater<ready_move> > ready;
+	vector<size_t> walk(n, 0);
+	size_t next = 0, walks = 0;
+
+	for (size_t a = 0; a < n; a++) {
+		if (!g.indeg[a])
+			ready.push(ready_move(moves[a].to, a));
+	}
+
+	for (;;) {
+		if (ready.empty()) {
+			while (next < moves.size() && g.done[next])
+				next++;
+			if (next == moves.size())
 				break;
+
+			/* Everything left is waiting on something else left, so walking
+			 * back through unfinished predecessors must come round in a
+			 * cycle. Find the smallest overlap of one move's source with the
+			 * next's target on it, and cut that out. */
+			walk.resize(moves.size(), 0);
+			walks++;
+			size_t v = next;
+			while (walk[v] != walks) {
+				walk[v] = walks;
+				v = g.waiting_on(v);
 			}
+
+			size_t w = v, cut_w = v, cut_start = 0, cut_end = 0;
+			do {
+				size_t p = g.waiting_on(w);
+				size_t start = max(moves[p].from, moves[w].to);
+				size_t end = min(moves[p].from + moves[p].len, moves[w].to + moves[w].len);
+
+				if (w == v || end - start < cut_end - cut_start) {
+					cut_w = w;
+					cut_start = start;
+					cut_end = end;
+				}
+				w = p;
+			} while (w != v);
+
+			struct move_op lost = { 0, cut_start, cut_end - cut_start };
+			vector<size_t> freed;
+
+			cuts.push_back(lost);
+			g.cut(cut_w, cut_start, cut_end, freed);
+			for (auto x = freed.begin(); x != freed.end(); x++)
+				ready.push(ready_move(moves[*x].to, *x));
+			continue;
 		}
+
+		size_t a = ready.top().second;
+		ready.pop();
+		if (g.done[a])
+			continue;
+		order.push_back(a);
+		g.done[a] = 1;
+		for (auto b = g.succ[a].begin(); b != g.succ[a].end(); b++) {
+			if (!g.done[*b] && !--g.indeg[*b])
+				ready.push(ready_move(moves[*b].to, *b));
+		}
+	}
+}
+
+/* parseMove(self, map, upload)
+ * Send the moves found by the scan, merged into as few as possible. If the
+ * server applies them in place they go in an order that is safe for that
+ * (see order_moves), and the data cut out of them to break cycles is left
+ * for parseAdd to send. This must come before parseAdd, as literal data may
+ * overwrite what the moves read. A move whose source and target overlap
+ * must be applied as by memmove. */
+void parseMove(struct rcksum_state *z, const struct mapfile *m, upload *u) {
+	vector<struct move_op> moves, cuts;
+	vector<size_t> order;
+	size_t cutbytes = 0;
+
+	plan_moves(z, moves);
+	if (u->in_place()) {
+		order_moves(moves, order, cuts);
+	}
+	else {
+		for (size_t i = 0; i < moves.size(); i++)
+			order.push_back(i);
+	}
+
+	sort(cuts.begin(), cuts.end(),
+		 [](const struct move_op &a, const struct move_op &b) { return a.to < b.to; });
+	z->ncuts = 0;
+	if (!cuts.empty()) {
+		z->cuts = (off_t *)arena_alloc(z->arena, 2 * cuts.size() * sizeof(z->cuts[0]));
+		if (!z->cuts) {
+			fprintf(stderr, "out of memory\n");
+			return;
+		}
+	}
+	for (auto c = cuts.begin(); c != cuts.end(); c++) {
+		/* The last block's target can run past the end of the file */
+		size_t end = min(c->to + c->len, (size_t)m->len);
+
+		if (c->to < end) {
+			z->cuts[2 * z->ncuts] = c->to;
+			z->cuts[2 * z->ncuts + 1] = end - c->to;
+			z->ncuts++;
+			cutbytes += end - c->to;
+		}
+	}
+
+	for (auto i = order.begin(); i != order.end(); i++) {
+		u->move(moves[*i].from, moves[*i].to, moves[*i].len);
 	}
+
+	if (cutbytes)
+		fprintf(stderr, "%zu moves, %zu bytes to be sent as data to break cycles\n",
+				order.size(), cutbytes);
 }
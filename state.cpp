@@ -9,15 +9,23 @@
 #include "rcksum.h"
 #include "internal.h"
 
-/* rcksum_init(num_blocks, block_size, rsum_bytes, checksum_bytes, require_consecutive_matches)
- * Creates and returns an rcksum_state with the given properties
+/* new_state(num_blocks, block_size, rsum_bytes, checksum_bytes, require_consecutive_matches, rsums, checksums)
+ * Creates and returns an rcksum_state with the given properties, with the
+ * given block sums, or with room for them if those are NULL.
  */
-struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
-								 int rsum_bytes, int checksum_bytes,
-								 int require_consecutive_matches) {
-	/* Allocate memory for the object */
-	struct rcksum_state *z = (rcksum_state *)malloc(sizeof(struct rcksum_state));
-	if (z == NULL) return NULL;
+static struct rcksum_state *new_state(zs_blockid nblocks, size_t blocksize,
+									  int rsum_bytes, int checksum_bytes,
+									  int require_consecutive_matches,
+									  void *rsums, void *checksums) {
+	/* Allocate memory for the object, in its own arena */
+	struct arena *a = arena_new();
+	if (a == NULL) return NULL;
+	struct rcksum_state *z = (rcksum_state *)arena_alloc(a, sizeof(struct rcksum_state));
+	if (z == NULL) {
+		arena_free(a);
+		return NULL;
+	}
+	z->arena = a;
 
 	/* Enter supplied properties. */
 	z->blocksize = blocksize;
@@ -31,21 +39,25 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
 	z->context = blocksize * require_consecutive_matches;
 
 	/* Initialise to 0 various state & stats */
-	z->gotblocks = 0;
 	memset(&(z->stats), 0, sizeof(z->stats));
-	z->ranges = NULL;
-	z->numranges = 0;
+	z->threads = 1;
+	z->hash_algo = RCKSUM_HASH_MD4;
 
-	//offsets
-	z->offsets = new list<size_t>;
-	z->moves = new map<long long, list<size_t> >;
-	z->add = new map<size_t, size_t>;
+	z->stream = NULL;
+	z->nmatches = 0;
+	z->cuts = NULL;
+	z->ncuts = 0;
+	z->chunk_off = NULL;
+	z->coarse = NULL;
 
 	/* Hashes for looking up checksums are generated when needed.
 	 * So initially store NULL so we know there's nothing there yet.
 	 */
 	z->rsum_hash = NULL;
-	z->bithash = NULL;
+	z->hash_next = z->hash_prev = NULL;
+	z->hash_ready = 0;
+	z->bloom = NULL;
+	z->bloomcount = NULL;
 
 	if (!(z->blocksize & (z->blocksize - 1)) && z->blocks) {
 			{   /* Calculate bit-shift for blocksize */
@@ -57,24 +69,142 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
 					}
 			}
 
-			z->blockhashes =
-				(hash_entry *)malloc(sizeof(z->blockhashes[0]) *
-						(z->blocks + z->seq_matches));
-			if (z->blockhashes != NULL)
+			/* Zeroed, as the entries after the last block are used as the
+			 * following block's rsum when hashing the last block */
+			if (rsums) {
+				z->rsums = (struct rsum *)rsums;
+				z->checksums = (unsigned char *)checksums;
+			}
+			else {
+				z->rsums = (struct rsum *)arena_alloc(a, rcksum_rsums_size(z));
+				z->checksums = (unsigned char *)arena_alloc(a, rcksum_checksums_size(z));
+			}
+			/* Only the pages that get matches written to them are used */
+			z->matches = (struct rcksum_match *)arena_alloc(a, (size_t)z->blocks
+															* sizeof(z->matches[0]));
+			z->gotmap = (unsigned long long *)arena_alloc(a, (size_t)((z->blocks + 63) / 64)
+														 * sizeof(z->gotmap[0]));
+			if (z->rsums != NULL && z->checksums != NULL && z->matches != NULL
+				&& z->gotmap != NULL)
 				return z;
-
-			/* All below is error handling */
 	}
-	free(z);
+
+	/* All below is error handling */
+	arena_free(a);
 	return NULL;
 }
 
+/* rcksum_init(num_blocks, block_size, rsum_bytes, checksum_bytes, require_consecutive_matches)
+ * Creates and returns an rcksum_state with the given properties
+ */
+struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
+								 int rsum_bytes, int checksum_bytes,
+								 int require_consecutive_matches) {
+	return new_state(nblocks, blocksize, rsum_bytes, checksum_bytes,
+					 require_consecutive_matches, NULL, NULL);
+}
+
+/* rcksum_init_mapped(num_blocks, block_size, rsum_bytes, checksum_bytes, require_consecutive_matches, rsums, checksums)
+ * As rcksum_init, for block sums already laid out as rcksum_rsums() and
+ * rcksum_checksums() return them, which are used in place.
+ */
+struct rcksum_state *rcksum_init_mapped(zs_blockid nblocks, size_t blocksize,
+										int rsum_bytes, int checksum_bytes,
+										int require_consecutive_matches,
+										void *rsums, void *checksums) {
+	if (!rsums || !checksums)
+		return NULL;
+	return new_state(nblocks, blocksize, rsum_bytes, checksum_bytes,
+					 require_consecutive_matches, rsums, checksums);
+}
+
+/* rcksum_set_chunking(self, min, avg, max)
+ * Make the blocks of the target chunks of a content-defined chunking with the
+ * given sizes, which are added with rcksum_add_target_chunk. Returns 0 if
+ * successful. */
+int rcksum_set_chunking(struct rcksum_state *z, size_t min, size_t avg, size_t max) {
+	if (cdc_init(&z->cdc, min, avg, max) != 0)
+		return -1;
+	z->chunk_off = (off_t *)arena_alloc(z->arena, (size_t)(z->blocks + 1) * sizeof(z->chunk_off[0]));
+	if (!z->chunk_off)
+		return -1;
+	z->chunk_off[0] = 0;
+	return 0;
+}
+
+/* rcksum_add_level(self, num_blocks, block_size, rsum_bytes, checksum_bytes, require_consecutive_matches)
+ * Creates a state for a coarser level of blocks, below the coarsest so far,
+ * and returns it, or NULL if the block size isn't a larger multiple of that
+ * level's or there are RCKSUM_MAX_LEVELS already. It takes the hash
+ * algorithm and threads of self, and is freed with it. */
+struct rcksum_state *rcksum_add_level(struct rcksum_state *z, zs_blockid nblocks, size_t blocksize,
+									  int rsum_bytes, int checksum_bytes,
+									  int require_consecutive_matches) {
+	struct rcksum_state *c;
+	int levels = 0;
+
+	if (z->chunk_off)
+		return NULL;
+	for (; z->coarse; z = z->coarse)
+		levels++;
+	if (levels == RCKSUM_MAX_LEVELS || blocksize <= z->blocksize || blocksize % z->blocksize)
+		return NULL;
+
+	c = rcksum_init(nblocks, blocksize, rsum_bytes, checksum_bytes, require_consecutive_matches);
+	if (c) {
+		c->hash_algo = z->hash_algo;
+		c->threads = z->threads;
+		z->coarse = c;
+	}
+	return c;
+}
+
+/* rcksum_block_start(self, blockid) */
+off_t rcksum_block_start(const struct rcksum_state *z, zs_blockid b) {
+	return block_start(z, b);
+}
+
+/* rcksum_rsums_size(self), rcksum_checksums_size(self)
+ * Bytes of the block sums arrays, including the zeroed entries after the
+ * last block. */
+size_t rcksum_rsums_size(const struct rcksum_state *z) {
+	return (size_t)(z->blocks + z->seq_matches) * sizeof(z->rsums[0]);
+}
+
+size_t rcksum_checksums_size(const struct rcksum_state *z) {
+	return (size_t)(z->blocks + z->seq_matches) * z->checksum_bytes;
+}
+
+const void *rcksum_rsums(const struct rcksum_state *z) {
+	return z->rsums;
+}
+
+const void *rcksum_checksums(const struct rcksum_state *z) {
+	return z->checksums;
+}
+
+/* rcksum_set_threads(self, threads)
+ * Set the number of threads to use when scanning source files. */
+void rcksum_set_threads(struct rcksum_state *z, int threads) {
+	z->threads = threads < 1 ? 1 : threads;
+	if (z->coarse)
+		rcksum_set_threads(z->coarse, threads);
+}
+
+/* rcksum_set_hash_algo(self, hash)
+ * Set the algorithm (RCKSUM_HASH_*) the block checksums were made with. */
+void rcksum_set_hash_algo(struct rcksum_state *z, int hash) {
+	z->hash_algo = hash;
+	if (z->coarse)
+		rcksum_set_hash_algo(z->coarse, hash);
+}
+
 /* rcksum_end - destructor */
 void rcksum_end(struct rcksum_state *z) {
-	/* Free other allocated memory */
-	free(z->rsum_hash);
-	free(z->blockhashes);
-	free(z->bithash);
-	free(z->ranges);			// Should be NULL already
-	free(z);
+	/* Coarser levels have arenas of their own */
+	if (z->coarse)
+		rcksum_end(z->coarse);
+
+	/* Everything, z included, is in the arena */
+	arena_free(z->arena);
 }
@@ -0,0 +1,186 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Streaming uploads: send the moves and adds for the start of the file while
+ * the rest of it is still being scanned.
+ *
+ * Matches are recorded in file order, and once the scan has recorded a match
+ * nothing before it changes any more. So each match finalises the file up to
+ * its end: the gap before it is literal data, and the match itself extends or
+ * starts a move. These operations go onto a bounded queue, which an upload
+ * thread drains. The scan only waits for the network when the queue is full,
+ * so the whole sync takes about as long as the slower of the two. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "rcksum.h"
+#include "internal.h"
+#include "mapfile.h"
+
+using namespace std;
+
+/* An operation for the upload thread */
+struct stream_op {
+	enum { MOVE, ADD } type;
+	size_t from;				/* MOVE: offset in the old file */
+	size_t to;					/* Offset in the new file */
+	size_t len;
+};
+
+struct rcksum_stream {
+	/* The queue, and the upload thread's end of it */
+	mutex lock;
+	condition_variable cv;
+	deque<struct stream_op> ops;
+	size_t maxops;
+	int eof;
+
+	const struct mapfile *m;
+	upload *u;
+
+	/* The scan's end of it: the new file is finalised up to emitted, apart
+	 * from a move still being extended by following matches */
+	size_t emitted;
+	struct stream_op move;		/* move.len == 0 if there is none */
+};
+
+/* stream_push(self, op)
+ * Queue an operation, waiting for room on the queue. */
+static void stream_push(struct rcksum_stream *st, const struct stream_op &op) {
+	unique_lock<mutex> l(st->lock);
+
+	st->cv.wait(l, [st] { return st->ops.size() < st->maxops; });
+	st->ops.push_back(op);
+	st->cv.notify_all();
+}
+
+/* stream_flush_move(self)
+ * Queue the pending move, if any. */
+static void stream_flush_move(struct rcksum_stream *st) {
+	if (st->move.len) {
+		stream_push(st, st->move);
+		st->move.len = 0;
+	}
+}
+
+/* stream_add(self, end)
+ * Queue literal data for the new file from what we have sent up to end. */
+static void stream_add(struct rcksum_stream *st, size_t end) {
+	if (end > st->emitted) {
+		struct stream_op op;
+
+		stream_flush_move(st);
+		op.type = stream_op::ADD;
+		op.from = 0;
+		op.to = st->emitted;
+		op.len = end - st->emitted;
+		stream_push(st, op);
+	}
+}
+
+/* stream_match(self, offset, blockid)
+ * Called for each match, in file order, in place of recording it for
+ * parseMove and parseAdd. */
+void stream_match(struct rcksum_state *z, size_t offset, zs_blockid id) {
+	struct rcksum_stream *st = z->stream;
+	size_t from = block_start(z, id);
+	size_t len = block_len(z, id);
+
+	stream_add(st, offset);
+
+	/* A block already where it belongs needs no move; one following on from
+	 * the pending move in both files just makes it longer */
+	if (from == offset) {
+		stream_flush_move(st);
+	}
+	else if (st->move.len && st->move.from + st->move.len == from
+			 && st->move.to + st->move.len == offset) {
+		st->move.len += len;
+	}
+	else {
+		stream_flush_move(st);
+		st->move.type = stream_op::MOVE;
+		st->move.from = from;
+		st->move.to = offset;
+		st->move.len = len;
+	}
+	st->emitted = offset + len;
+}
+
+/* upload_worker(self)
+ * The upload thread - send operations as they are queued. */
+static void upload_worker(struct rcksum_stream *st) {
+	for (;;) {
+		struct stream_op op;
+		{
+			unique_lock<mutex> l(st->lock);
+			st->cv.wait(l, [st] { return !st->ops.empty() || st->eof; });
+			if (st->ops.empty())
+				return;
+			op = st->ops.front();
+			st->ops.pop_front();
+			st->cv.notify_all();
+		}
+
+		if (op.type == stream_op::MOVE)
+			st->u->move(op.from, op.to, op.len);
+		else
+			add_range(st->m, op.to, op.len, st->u);
+	}
+}
+
+/* rcksum_stream_source_map(self, map, upload, maxops)
+ * Scan the mapped file as rcksum_submit_source_map does, sending the moves
+ * and adds that bring the server's copy of the target up to date with it as
+ * the scan goes, with at most maxops of them waiting at any time. The upload
+ * must already be started. Returns the number of blocks matched. */
+int rcksum_stream_source_map(struct rcksum_state *z, const struct mapfile *m,
+							 upload *u, size_t maxops) {
+	struct rcksum_stream st;
+	int got_blocks;
+
+	st.maxops = maxops < 1 ? 1 : maxops;
+	st.eof = 0;
+	st.m = m;
+	st.u = u;
+	st.emitted = 0;
+	st.move.len = 0;
+
+	thread uploader(upload_worker, &st);
+
+	z->stream = &st;
+	got_blocks = rcksum_submit_source_map(z, m);
+	z->stream = NULL;
+
+	/* Whatever is left after the last match is literal data */
+	stream_add(&st, m->len);
+	stream_flush_move(&st);
+
+	{
+		unique_lock<mutex> l(st.lock);
+		st.eof = 1;
+		st.cv.notify_all();
+	}
+	uploader.join();
+
+	return got_blocks;
+}
@@ -0,0 +1,56 @@
+#!/bin/bash
+# download.sh - fetch files with uploadclient -g from the stand-in server,
+# answering ranged GETs with multipart/byteranges, with one range covering
+# all those asked for, with the whole file, with a 206 that doesn't say
+# which range it is, and with an error.
+
+cd "$(dirname "$0")/.." || exit 1
+. tests/lib.sh
+
+check() {
+	local name=$1 want=$2; shift 2
+
+	if [ "$want" = ok ]; then
+		./uploadclient -g $T/out "$@" $T/new.zsync $T/old http://127.0.0.1:$(cat $T/port) new u p > $T/log 2>&1 \
+			&& cmp -s $T/out $T/srv/new && grep -q "SHA1 OK" $T/log \
+			|| fail "$name: file not fetched"
+	else
+		./uploadclient -g $T/out "$@" $T/new.zsync $T/old http://127.0.0.1:$(cat $T/port) new u p > $T/log 2>&1 \
+			&& fail "$name: an error response wasn't reported"
+	fi
+	echo "$name: $(stat_of requests) requests, $(stat_of multipart) multipart, $(stat_of bytes) of $(stat -c %s $T/srv/new) bytes"
+}
+
+for seed in 1 2 3; do
+	python3 tests/mkpair.py $seed $T/old $T/srv/new
+	./zsyncmake $T/srv/new $T/new.zsync > /dev/null || fail "zsyncmake failed"
+
+	start_standin --ranges multi
+	check "seed $seed, multipart" ok -G 0
+	[ $(stat_of multipart) -gt 0 ] || fail "seed $seed: no multipart responses"
+	[ $(stat_of bytes) -lt $(stat -c %s $T/srv/new) ] || fail "seed $seed: fetched the whole file"
+	stop_standin
+
+	start_standin --ranges multi
+	check "seed $seed, one range each" ok -G 1000000000
+	stop_standin
+
+	start_standin --ranges single
+	check "seed $seed, ranges joined" ok -G 0
+	stop_standin
+
+	start_standin --ranges ignore
+	check "seed $seed, whole file" ok
+	grep -q "server sent the whole file" $T/log || fail "seed $seed: 200 not noticed"
+	stop_standin
+
+	start_standin --ranges norange
+	check "seed $seed, 206 without a range" error -G 0
+	grep -q "206 response without a Content-Range" $T/log || fail "seed $seed: 206 without a range not noticed"
+	stop_standin
+
+	start_standin --ranges error
+	check "seed $seed, error" error
+	stop_standin
+done
+echo "download: ok"
@@ -0,0 +1,43 @@
+#!/bin/bash
+# largefile.sh - sync a sparse file of over 4 GB both ways: upload it as a
+# delta stream, and download it with ranged GETs. Offsets past 2 and 4 GB
+# have to survive zsyncmake, the scan, the delta stream and the ranges.
+# Needs about 9 GB of free space under $TMPDIR, as the synced copies aren't
+# sparse.
+
+cd "$(dirname "$0")/.." || exit 1
+. tests/lib.sh
+
+edit=$(python3 tests/mksparse.py $T/old $T/new) || fail "can't make sparse files"
+size=$(stat -c %s $T/new)
+sha1=$(sha1sum < $T/new | cut -d' ' -f1)
+
+# Upload: the server has the old file
+./zsyncmake $T/old $T/old.zsync > /dev/null || fail "zsyncmake failed"
+cp --sparse=always $T/old $T/srv/f
+start_standin
+./uploadclient -d $T/old.zsync $T/new http://127.0.0.1:$(cat $T/port) f u p > $T/log 2>&1
+stop_standin
+grep -q "SHA1: $sha1" $T/log || fail "upload: wrong SHA-1 reported"
+cmp -s $T/srv/f $T/new || fail "upload: server's copy is wrong"
+rm -f $T/srv/f
+echo "upload of $size bytes: ok"
+
+# Download: the server has the new file
+./zsyncmake $T/new $T/new.zsync > /dev/null || fail "zsyncmake failed"
+grep -q "^Length: $size\$" $T/new.zsync || fail "zsyncmake: wrong length"
+cp --sparse=always $T/new $T/srv/f
+start_standin
+./uploadclient -g $T/out $T/new.zsync $T/old http://127.0.0.1:$(cat $T/port) f u p > $T/log 2>&1
+stop_standin
+grep -q "SHA1 OK" $T/log || fail "download: SHA-1 doesn't match"
+cmp -s $T/out $T/new || fail "download: wrong file"
+
+# Only the edits are fetched: the one past 4 GB, and the tail; the data
+# moved from below 4 GB comes from the local file
+awk -v e=$edit '$1 <= e && e <= $2 { found = 1 } END { exit !found }' $T/srv/ranges \
+	|| fail "download: the edit at $edit wasn't fetched"
+fetched=$(stat_of bytes)
+[ $fetched -lt 1000000 ] || fail "download: fetched $fetched bytes"
+echo "download of $size bytes: ok, fetched $fetched bytes"
+echo "largefile: ok"
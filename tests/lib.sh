@@ -0,0 +1,45 @@
+# lib.sh - helpers for the test scripts, which source it from the top of the
+# tree. Each script gets a scratch directory $T, with the stand-in server's
+# files in $T/srv.
+
+T=$(mktemp -d) || exit 1
+mkdir $T/srv
+STANDIN=
+
+cleanup() {
+	stop_standin
+	rm -rf $T
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*" >&2
+	[ -f $T/log ] && tail -5 $T/log >&2
+	exit 1
+}
+
+# start_standin [options] - start tests/standin.py serving $T/srv, with its
+# port in $T/port
+start_standin() {
+	rm -f $T/port
+	python3 tests/standin.py $T/srv $T/port "$@" &
+	STANDIN=$!
+	for i in $(seq 100); do
+		[ -f $T/port ] && return
+		sleep 0.1
+	done
+	fail "stand-in server didn't start"
+}
+
+stop_standin() {
+	if [ -n "$STANDIN" ]; then
+		kill $STANDIN
+		wait $STANDIN 2> /dev/null
+		STANDIN=
+	fi
+}
+
+# stat_of name - a count from the stand-in server's stats
+stat_of() {
+	awk -v k=$1 '$1 == k { print $2 }' $T/srv/stats
+}
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""Make an old and a new version of a file, for the tests.
+
+Usage: mkpair.py <seed> <old> <new>
+
+The old file is a few hundred KB of text-like data, which compresses. The
+new one is the old one with some regions swapped (moves whose targets and
+sources overlap in a cycle), text inserted and overwritten, and ranges
+deleted.
+"""
+
+import random
+import sys
+
+
+def main():
+    seed, oldname, newname = int(sys.argv[1]), sys.argv[2], sys.argv[3]
+    rnd = random.Random(seed)
+    words = [bytes(rnd.choice(b'abcdefghijklmnopqrstuvwxyz') for _ in range(rnd.randint(2, 9)))
+             for _ in range(3000)]
+
+    def text(n):
+        out = bytearray()
+        while len(out) < n:
+            out += rnd.choice(words) + b' '
+        return bytes(out[:n])
+
+    old = text(rnd.randint(300000, 900000))
+    new = bytearray(old)
+    for _ in range(rnd.randint(3, 12)):
+        size = len(new)
+        what = rnd.random()
+        if what < 0.35:
+            n = rnd.randint(2000, 40000)
+            a = rnd.randrange(0, size - 2 * n)
+            b = rnd.randrange(a + n, size - n)
+            new[a:a + n], new[b:b + n] = new[b:b + n], new[a:a + n]
+        elif what < 0.6:
+            at = rnd.randrange(size)
+            new[at:at] = text(rnd.randint(10, 5000))
+        elif what < 0.8:
+            at = rnd.randrange(size)
+            del new[at:at + rnd.randint(10, 8000)]
+        else:
+            at = rnd.randrange(size)
+            n = rnd.randint(10, 3000)
+            new[at:at + n] = text(n)
+
+    with open(oldname, 'wb') as f:
+        f.write(old)
+    with open(newname, 'wb') as f:
+        f.write(new)
+
+
+if __name__ == '__main__':
+    main()
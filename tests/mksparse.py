@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Make an old and a new version of a sparse file over 4 GB, for the tests.
+
+Usage: mksparse.py <old> <new>
+
+Both are mostly holes, with some random data below 2 GB, between 2 and 4 GB
+and past 4 GB. In the new one, the data from between 2 and 4 GB is moved to
+past 4 GB, and there is an edit past 4 GB and a changed tail. Prints the
+offset of the edit past 4 GB.
+"""
+
+import random
+import sys
+
+G = 1 << 30
+M = 1 << 20
+SIZE = 4 * G + 64 * M + 12345
+CHUNKS = (512 * M, 2 * G + 200 * M, 4 * G + 8 * M)
+MOVE_TO = 4 * G + 32 * M
+EDIT = 4 * G + 8 * M + 1000
+
+
+def main():
+    rnd = random.Random(19)
+    chunks = [(off, rnd.randbytes(M)) for off in CHUNKS]
+    for name in sys.argv[1:3]:
+        with open(name, 'wb') as f:
+            f.truncate(SIZE)
+            for off, data in chunks:
+                f.seek(off)
+                f.write(data)
+            if name == sys.argv[2]:
+                f.seek(chunks[1][0])
+                f.write(bytes(M))
+                f.seek(MOVE_TO)
+                f.write(chunks[1][1])
+                f.seek(EDIT)
+                f.write(rnd.randbytes(50000))
+                f.seek(SIZE - 3000)
+                f.write(b'tail' * 500)
+    print(EDIT)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,495 @@
+/* scantest - check the rolling scan against a scan that recalculates.
+ *
+ * check_data carries its rolling checksums forward a byte at a time, and
+ * across buffer refills when reading from a stream. Before it did, it
+ * calculated both rsums afresh at every offset; ref_scan here does that, and
+ * looks blocks up by comparing against every block in turn rather than
+ * through the hash table. For a range of block sizes, hash lengths and edits
+ * (moves, inserts, deletes, repeats and runs of zeros), the matches that
+ * rcksum_submit_source_map and rcksum_submit_source_file (from a pipe, so in
+ * 16 block buffers) find must be exactly the ones ref_scan does.
+ *
+ * Parallel scans split the file and can match differently at the seams, and
+ * scans with a coarser level of blocks (rcksum_add_level) match those first,
+ * so for both we only check that every match is right, none overlap and no
+ * block is matched twice.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "rcksum.h"
+#include "internal.h"
+#include "mapfile.h"
+
+using namespace std;
+
+#define CASES 60
+
+static unsigned long long rng;
+
+static unsigned int random32(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng >> 32;
+}
+
+static size_t random_below(size_t n) {
+	return n ? random32() % n : 0;
+}
+
+/* A target and its block sums, as zsyncmake would lay them out */
+struct target {
+	vector<unsigned char> data;	/* Zero padded to a whole number of blocks */
+	size_t blocksize;
+	int rsum_bytes, checksum_bytes, seq_matches;
+	zs_blockid blocks;
+	vector<struct rsum> rsums;	/* One extra, zero, entry after the last */
+	vector<unsigned char> checksums;
+};
+
+static int same_rsum(const struct target *t, struct rsum a, struct rsum b) {
+	unsigned short mask = t->rsum_bytes < 3 ? 0 : t->rsum_bytes == 3 ? 0xff : 0xffff;
+
+	return (a.a & mask) == (b.a & mask) && a.b == b.b;
+}
+
+static int same_checksum(const struct target *t, zs_blockid id, const unsigned char *data) {
+	unsigned char c[CHECKSUM_SIZE];
+
+	rcksum_calc_checksum(RCKSUM_HASH_MD4, c, data, t->blocksize);
+	return !memcmp(c, &t->checksums[id * t->checksum_bytes], t->checksum_bytes);
+}
+
+static void make_target(struct target *t, const vector<unsigned char> &data) {
+	size_t bs = t->blocksize;
+
+	t->blocks = (data.size() + bs - 1) / bs;
+	t->data = data;
+	t->data.resize(t->blocks * bs, 0);
+	t->rsums.assign(t->blocks + 1, rsum());
+	t->checksums.assign((t->blocks + 1) * t->checksum_bytes, 0);
+	for (zs_blockid id = 0; id < t->blocks; id++) {
+		unsigned char c[CHECKSUM_SIZE];
+
+		t->rsums[id] = rcksum_calc_rsum_block(&t->data[id * bs], bs);
+		rcksum_calc_checksum(RCKSUM_HASH_MD4, c, &t->data[id * bs], bs);
+		memcpy(&t->checksums[id * t->checksum_bytes], c, t->checksum_bytes);
+	}
+}
+
+/* ref_scan(target, source, &matches)
+ * Scan the source (followed by zero padding) for the target's blocks. At
+ * each offset: straight after a match, the following block of the target is
+ * tried on its own; otherwise each block not matched yet, in order, whose
+ * rsum (and, with seq_matches 2, the next block's) is that here, and whose
+ * checksum is too (and the next block's, unless following a match). */
+static void ref_scan(const struct target *t, const vector<unsigned char> &src,
+					 vector<struct rcksum_match> &matches) {
+	size_t bs = t->blocksize, len = src.size();
+	vector<unsigned char> data(src);
+	vector<char> claimed(t->blocks, 0);
+	zs_blockid prev = -1;
+
+	data.resize(len + 2 * bs, 0);
+	for (size_t x = 0; x < len;) {
+		struct rsum r0 = rcksum_calc_rsum_block(&data[x], bs);
+		struct rsum r1 = rcksum_calc_rsum_block(&data[x + bs], bs);
+		zs_blockid id = -1;
+
+		if (prev >= 0 && prev + 1 < t->blocks && !claimed[prev + 1]
+			&& same_rsum(t, t->rsums[prev + 1], r0) && same_checksum(t, prev + 1, &data[x])) {
+			id = prev + 1;
+		}
+		else {
+			for (zs_blockid c = 0; c < t->blocks && id < 0; c++) {
+				if (claimed[c] || !same_rsum(t, t->rsums[c], r0))
+					continue;
+				if (t->seq_matches > 1 && !same_rsum(t, t->rsums[c + 1], r1))
+					continue;
+				if (!same_checksum(t, c, &data[x]))
+					continue;
+				if (prev < 0 && t->seq_matches > 1
+					&& (c + 1 == t->blocks || !same_checksum(t, c + 1, &data[x + bs])))
+					continue;
+				id = c;
+			}
+		}
+
+		if (id >= 0) {
+			struct rcksum_match m = { x, id };
+
+			matches.push_back(m);
+			claimed[id] = 1;
+			prev = id;
+			x += bs;
+		}
+		else {
+			prev = -1;
+			x++;
+		}
+	}
+}
+
+static struct rcksum_state *new_state(const struct target *t, int threads) {
+	struct rcksum_state *z = rcksum_init(t->blocks, t->blocksize, t->rsum_bytes,
+										 t->checksum_bytes, t->seq_matches);
+
+	if (!z) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (zs_blockid id = 0; id < t->blocks; id++)
+		rcksum_add_target_block(z, id, t->rsums[id], (void *)&t->checksums[id * t->checksum_bytes]);
+	rcksum_set_threads(z, threads);
+	return z;
+}
+
+/* get_matches(self, &matches)
+ * The state's match log; each block in it must also be counted as got. */
+static void get_matches(const struct rcksum_state *z, vector<struct rcksum_match> &matches) {
+	matches.assign(z->matches, z->matches + z->nmatches);
+	if (rcksum_blocks_got(z) != (zs_blockid)z->nmatches) {
+		fprintf(stderr, "scantest: %zu matches logged, but %lld blocks got\n",
+				z->nmatches, rcksum_blocks_got(z));
+		exit(1);
+	}
+}
+
+/* scan_map(target, coarse, file, threads, &matches)
+ * The matches the scan finds, with the source file mapped, and with the
+ * coarse target's blocks as a level above the target's if it is given. */
+static void scan_map(const struct target *t, const struct target *coarse, const char *fn,
+					 int threads, vector<struct rcksum_match> &matches) {
+	struct rcksum_state *z = new_state(t, threads);
+
+	if (coarse) {
+		struct rcksum_state *c = rcksum_add_level(z, coarse->blocks, coarse->blocksize, coarse->rsum_bytes,
+												  coarse->checksum_bytes, coarse->seq_matches);
+
+		if (!c) {
+			fprintf(stderr, "can't add a level of %zu byte blocks\n", coarse->blocksize);
+			exit(1);
+		}
+		for (zs_blockid id = 0; id < coarse->blocks; id++)
+			rcksum_add_target_block(c, id, coarse->rsums[id],
+									(void *)&coarse->checksums[id * coarse->checksum_bytes]);
+	}
+
+	FILE *f = fopen(fn, "rb");
+	struct mapfile *m = f ? mapfile_open(f, rcksum_source_pad(z)) : NULL;
+
+	if (!m) {
+		perror(fn);
+		exit(1);
+	}
+	rcksum_submit_source_map(z, m);
+	get_matches(z, matches);
+	mapfile_close(m);
+	fclose(f);
+	rcksum_end(z);
+}
+
+/* scan_both(target, file1, file2, &matches)
+ * The matches two scans of mapped source files find for the same target,
+ * one after the other. */
+static void scan_both(const struct target *t, const char *fn1, const char *fn2,
+					  vector<struct rcksum_match> &matches) {
+	struct rcksum_state *z = new_state(t, 1);
+	const char *fns[] = { fn1, fn2 };
+
+	for (int i = 0; i < 2; i++) {
+		FILE *f = fopen(fns[i], "rb");
+		struct mapfile *m = f ? mapfile_open(f, rcksum_source_pad(z)) : NULL;
+
+		if (!m) {
+			perror(fns[i]);
+			exit(1);
+		}
+		rcksum_submit_source_map(z, m);
+		mapfile_close(m);
+		fclose(f);
+	}
+	get_matches(z, matches);
+	rcksum_end(z);
+}
+
+/* scan_pipe(target, file, &matches)
+ * The matches the scan finds, with the source file read from a pipe. */
+static void scan_pipe(const struct target *t, const char *fn, vector<struct rcksum_match> &matches) {
+	struct rcksum_state *z = new_state(t, 1);
+	char cmd[1024];
+
+	snprintf(cmd, sizeof cmd, "cat '%s'", fn);
+	FILE *f = popen(cmd, "r");
+	if (!f) {
+		perror(cmd);
+		exit(1);
+	}
+	rcksum_submit_source_file(z, f);
+	pclose(f);
+	get_matches(z, matches);
+	rcksum_end(z);
+}
+
+/* same_matches(what, expected, got)
+ * Returns 1 if the lists of matches are the same, else says where they
+ * first differ. */
+static int same_matches(const char *what, const vector<struct rcksum_match> &want,
+						const vector<struct rcksum_match> &got) {
+	for (size_t i = 0; i < want.size() || i < got.size(); i++) {
+		if (i < want.size() && i < got.size()
+			&& want[i].offset == got[i].offset && want[i].id == got[i].id)
+			continue;
+
+		fprintf(stderr, "%s: match %zu of %zu is ", what, i, want.size());
+		if (i < got.size())
+			fprintf(stderr, "block %lld at %zu", got[i].id, got[i].offset);
+		else
+			fprintf(stderr, "missing");
+		if (i < want.size())
+			fprintf(stderr, ", not block %lld at %zu\n", want[i].id, want[i].offset);
+		else
+			fprintf(stderr, ", one too many\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* valid_matches(what, target, source, matches)
+ * Returns 1 if each match is of data that is the block, no two overlap and
+ * no block is matched twice. */
+static int valid_matches(const char *what, const struct target *t, const vector<unsigned char> &src,
+						 const vector<struct rcksum_match> &matches) {
+	size_t bs = t->blocksize, end = 0;
+	vector<char> seen(t->blocks, 0);
+
+	if (matches.size() > (size_t)t->blocks) {
+		fprintf(stderr, "%s: %zu matches of %lld blocks\n", what, matches.size(), t->blocks);
+		return 0;
+	}
+	vector<unsigned char> data(src);
+
+	data.resize(src.size() + bs, 0);
+	for (size_t i = 0; i < matches.size(); i++) {
+		const struct rcksum_match *m = &matches[i];
+
+		if (m->offset < end || seen[m->id] || m->offset >= src.size()
+			|| memcmp(&data[m->offset], &t->data[m->id * bs], bs)) {
+			fprintf(stderr, "%s: bad match of block %lld at %zu\n", what, m->id, m->offset);
+			return 0;
+		}
+		seen[m->id] = 1;
+		end = m->offset + bs;
+	}
+	return 1;
+}
+
+/* distinct_matches(what, target, matches)
+ * Returns 1 if no block is matched twice, for matches in more than one
+ * source file. */
+static int distinct_matches(const char *what, const struct target *t,
+							const vector<struct rcksum_match> &matches) {
+	vector<char> seen(t->blocks, 0);
+
+	for (size_t i = 0; i < matches.size(); i++) {
+		if (seen[matches[i].id]) {
+			fprintf(stderr, "%s: block %lld matched twice\n", what, matches[i].id);
+			return 0;
+		}
+		seen[matches[i].id] = 1;
+	}
+	return 1;
+}
+
+static void random_bytes(vector<unsigned char> &v, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		v.push_back(random32() >> 24);
+}
+
+/* make_source(old, &new)
+ * The old file with edits: pieces of it in a different order, some more
+ * than once, with new data and runs of zeros in between. */
+static void make_source(const vector<unsigned char> &old, vector<unsigned char> &src) {
+	size_t pos = 0;
+
+	src.clear();
+	while (pos < old.size()) {
+		size_t n = 1 + random_below(old.size() / 4);
+		unsigned int what = random_below(10);
+
+		if (n > old.size() - pos)
+			n = old.size() - pos;
+		if (what < 5) {
+			src.insert(src.end(), old.begin() + pos, old.begin() + pos + n);
+			pos += n;
+		}
+		else if (what < 7) {
+			size_t from = random_below(old.size() - n + 1);
+
+			src.insert(src.end(), old.begin() + from, old.begin() + from + n);
+		}
+		else if (what < 8) {
+			random_bytes(src, random_below(5000));
+		}
+		else if (what < 9) {
+			src.insert(src.end(), random_below(10000), 0);
+		}
+		else {
+			pos += random_below(5000);
+		}
+	}
+}
+
+/* coarse_target(target, ratio, &coarse)
+ * The same data as the target, in blocks ratio times the size. */
+static void coarse_target(const struct target *t, size_t ratio, struct target *coarse) {
+	coarse->blocksize = t->blocksize * ratio;
+	coarse->seq_matches = t->seq_matches;
+	coarse->rsum_bytes = t->rsum_bytes;
+	coarse->checksum_bytes = t->checksum_bytes;
+	make_target(coarse, t->data);
+}
+
+static void write_file(const char *fn, const vector<unsigned char> &data) {
+	FILE *f = fopen(fn, "wb");
+
+	if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0) {
+		perror(fn);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+	static const size_t blocksizes[] = { 512, 1024, 2048 };
+	char fn[] = "/tmp/scantestXXXXXX", fn2[] = "/tmp/scantestXXXXXX";
+	int fd = mkstemp(fn), fd2 = mkstemp(fn2);
+	int failed = 0;
+	size_t total = 0;
+
+	if (fd == -1 || fd2 == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	close(fd2);
+
+	/* The scans report their stats on stdout */
+	if (!freopen("/dev/null", "w", stdout))
+		return 1;
+
+	for (int i = 0; i < CASES && !failed; i++) {
+		struct target t, coarse;
+		vector<unsigned char> old, src;
+		vector<struct rcksum_match> want, got;
+		char what[64];
+
+		rng = 88172645463325252ULL + i;
+		t.blocksize = blocksizes[i % 3];
+		t.seq_matches = 1 + (i / 3) % 2;
+		t.rsum_bytes = 2 + (i / 6) % 3;
+		t.checksum_bytes = i % 4 ? 16 : 4;
+
+		/* Random data, with some repeated blocks and zeros, so that some
+		 * blocks are the same as others */
+		random_bytes(old, 20000 + random_below(300000));
+		for (int r = 0; r < 8; r++) {
+			size_t at = random_below(old.size() / t.blocksize) * t.blocksize;
+			size_t from = random_below(old.size() / t.blocksize) * t.blocksize;
+
+			if (r < 2)
+				memset(&old[at], 0, min(t.blocksize * 3, old.size() - at));
+			else
+				memcpy(&old[at], &old[from], min(t.blocksize, old.size() - max(at, from)));
+		}
+		make_target(&t, old);
+		make_source(old, src);
+		write_file(fn, src);
+
+		ref_scan(&t, src, want);
+		total += want.size();
+
+		snprintf(what, sizeof what, "case %d, mapped", i);
+		scan_map(&t, NULL, fn, 1, got);
+		failed |= !same_matches(what, want, got);
+
+		snprintf(what, sizeof what, "case %d, from a pipe", i);
+		scan_pipe(&t, fn, got);
+		failed |= !same_matches(what, want, got);
+
+		snprintf(what, sizeof what, "case %d, 4 threads", i);
+		scan_map(&t, NULL, fn, 4, got);
+		failed |= !valid_matches(what, &t, src, got);
+
+		snprintf(what, sizeof what, "case %d, coarse level", i);
+		coarse_target(&t, 2 << (i % 2), &coarse);
+		scan_map(&t, &coarse, fn, 1, got);
+		failed |= !valid_matches(what, &t, src, got);
+
+		snprintf(what, sizeof what, "case %d, then the old file", i);
+		write_file(fn2, old);
+		scan_both(&t, fn, fn2, got);
+		failed |= !distinct_matches(what, &t, got);
+	}
+
+	/* A coarse block matched, then the gap after it running on into the
+	 * fine blocks after it again: target A-F in 2 KB blocks, and a source of
+	 * C D E F B C D E F. The gap scan must not match C to F a second time. */
+	if (!failed) {
+		struct target t, coarse;
+		vector<unsigned char> old, src;
+		vector<struct rcksum_match> got;
+
+		rng = 1;
+		t.blocksize = 2048;
+		t.seq_matches = 1;
+		t.rsum_bytes = 4;
+		t.checksum_bytes = 16;
+		random_bytes(old, 6 * t.blocksize);
+		make_target(&t, old);
+		coarse_target(&t, 2, &coarse);
+		src.insert(src.end(), old.begin() + 2 * t.blocksize, old.end());
+		src.insert(src.end(), old.begin() + t.blocksize, old.end());
+		write_file(fn, src);
+
+		scan_map(&t, &coarse, fn, 1, got);
+		failed |= !valid_matches("coarse level, repeated run", &t, src, got);
+	}
+
+	/* Two source files: X B-H, then A-H. Only A is left to match in the
+	 * second, but straight after it come B to H again. */
+	if (!failed) {
+		struct target t;
+		vector<unsigned char> old, src;
+		vector<struct rcksum_match> got;
+
+		rng = 2;
+		t.blocksize = 1024;
+		t.seq_matches = 1;
+		t.rsum_bytes = 4;
+		t.checksum_bytes = 16;
+		random_bytes(old, 8 * t.blocksize);
+		make_target(&t, old);
+		random_bytes(src, t.blocksize);
+		src.insert(src.end(), old.begin() + t.blocksize, old.end());
+		write_file(fn, src);
+		write_file(fn2, old);
+
+		scan_both(&t, fn, fn2, got);
+		failed |= !distinct_matches("two sources, repeated run", &t, got);
+		if (got.size() != 8) {
+			fprintf(stderr, "two sources, repeated run: %zu of 8 blocks got\n", got.size());
+			failed = 1;
+		}
+	}
+	unlink(fn);
+	unlink(fn2);
+
+	fprintf(stderr, "scantest: %s (%zu matches in %d cases)\n", failed ? "FAILED" : "ok", total, CASES);
+	return failed;
+}
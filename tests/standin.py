@@ -0,0 +1,317 @@
+#!/usr/bin/env python3
+"""Stand-in for the server side of a sync, for the tests.
+
+Usage: standin.py <dir> <portfile> [options]
+
+Serves the files in dir over HTTP on a free port on 127.0.0.1, which it
+writes to portfile once it is listening:
+
+  GET /remote.php/webdav/<name>
+      The file, honouring Range headers as --ranges says: "multi" answers
+      several ranges with a multipart/byteranges 206 and one with a plain
+      206, "single" answers any ranges with one 206 covering all of them,
+      "ignore" sends the whole file with a 200, "norange" answers with the
+      first range asked for in a 206 that doesn't say which range it is, and
+      "error" fails with 500.
+
+  .../deltasync/api/0.0.1/upload/{start,move,add,delta,done}/<name>
+      A sync of the file, applied the way the server does: moves and adds
+      are applied to the file in place, in the order they arrive, and a
+      delta stream is applied to a copy of it with deltaapply (see
+      --deltaapply), or in place with deltaapply -i if it has discards. Compressed adds are decompressed with the data in
+      front of them in the file so far as the dictionary. done replaces the
+      file with the result and answers with its SHA-1. With --codec, start
+      picks that codec if the client offers it; only deflate can be
+      decompressed here.
+
+After each request, counts of the connections, requests and multipart
+responses so far, the bytes of file data sent and the delta streams applied
+in place are written to <dir>/stats. The first and last byte of each range asked for are added to
+<dir>/ranges.
+"""
+
+import argparse
+import hashlib
+import http.server
+import os
+import re
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import urllib.parse
+import zlib
+
+API = '/index.php/apps/deltasync/api/0.0.1/upload/'
+DAV = '/remote.php/webdav/'
+BOUNDARY = 'STANDIN_BOUNDARY'
+DELTA_MAGIC = b'ZSDELTA1'
+DELTA_DISCARD = 4
+
+opts = None
+lock = threading.Lock()
+stats = {'connections': 0, 'requests': 0, 'multipart': 0, 'bytes': 0, 'in_place': 0}
+syncs = {}
+
+
+def write_stats():
+    with open(os.path.join(opts.dir, 'stats'), 'w') as f:
+        for k in ('connections', 'requests', 'multipart', 'bytes', 'in_place'):
+            f.write('%s %d\n' % (k, stats[k]))
+
+
+def sha1_of(path):
+    h = hashlib.sha1()
+    with open(path, 'rb') as f:
+        for block in iter(lambda: f.read(1 << 20), b''):
+            h.update(block)
+    return h.hexdigest()
+
+
+def has_discards(body):
+    """Whether a delta stream starts with a discard, after the magic and the
+    length, and so can be applied in place."""
+    i = len(DELTA_MAGIC)
+    while body[i] & 0x80:
+        i += 1
+    return body[i + 1] == DELTA_DISCARD
+
+
+class Sync:
+    """A sync in progress. The file is only read into memory for moves and
+    adds; a delta stream is applied from the file on disk, so that large
+    (sparse) files can be synced too."""
+
+    def __init__(self, name, size):
+        self.path = os.path.join(opts.dir, name)
+        self.size = size
+        self.data = None
+        self.result = None
+
+    def load(self):
+        if self.data is None:
+            with open(self.path, 'rb') as f:
+                self.data = bytearray(f.read())
+        return self.data
+
+    def grow(self, end):
+        if len(self.load()) < end:
+            self.data.extend(bytes(end - len(self.data)))
+
+    def move(self, frm, to, size):
+        src = bytes(self.load()[frm:frm + size])
+        src += bytes(size - len(src))
+        self.grow(to + size)
+        self.data[to:to + size] = src
+
+    def add(self, start, size, data, encoding=None, dictlen=0):
+        if encoding:
+            if encoding != 'deflate' or start < dictlen:
+                raise ValueError('can\'t decompress %s' % encoding)
+            self.grow(start)
+            zdict = bytes(self.data[start - dictlen:start])
+            d = zlib.decompressobj(-15, zdict=zdict) if dictlen else zlib.decompressobj(-15)
+            data = d.decompress(data) + d.flush()
+        if len(data) != size:
+            raise ValueError('add of %d bytes at %d has %d' % (size, start, len(data)))
+        self.grow(start + size)
+        self.data[start:start + size] = data
+
+    def delta(self, body):
+        with tempfile.NamedTemporaryFile() as stream:
+            stream.write(body)
+            stream.flush()
+            if has_discards(body):
+                self.result = self.path
+                args = ['-i', self.path, stream.name]
+                with lock:
+                    stats['in_place'] += 1
+            else:
+                self.result = self.path + '.new'
+                args = [self.path, stream.name, self.result]
+            subprocess.run([opts.deltaapply] + args, check=True, stdout=subprocess.DEVNULL)
+
+    def done(self):
+        if self.result:
+            if self.result != self.path:
+                os.rename(self.result, self.path)
+        else:
+            del self.load()[self.size:]
+            self.grow(self.size)
+            with open(self.path, 'wb') as f:
+                f.write(self.data)
+        return sha1_of(self.path)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        with lock:
+            stats['connections'] += 1
+        super().setup()
+
+    def log_message(self, *args):
+        pass
+
+    def read_body(self):
+        if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+            parts = []
+            while True:
+                n = int(self.rfile.readline().split(b';')[0], 16)
+                if n == 0:
+                    while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                        pass
+                    return b''.join(parts)
+                parts.append(self.rfile.read(n))
+                self.rfile.readline()
+        return self.rfile.read(int(self.headers.get('Content-Length') or 0))
+
+    def reply(self, status, body=b'', headers=()):
+        self.send_response(status)
+        for k, v in headers:
+            self.send_header(k, v)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def handle_request(self):
+        body = self.read_body()
+        url = urllib.parse.urlparse(self.path)
+        try:
+            if url.path.startswith(DAV) and self.command == 'GET':
+                self.get(url.path[len(DAV):])
+            elif url.path.startswith(API):
+                op, name = url.path[len(API):].split('/', 1)
+                self.sync(op, name, urllib.parse.parse_qs(url.query), body)
+            else:
+                self.reply(404)
+        except Exception as e:
+            print('standin: %s %s: %s' % (self.command, self.path, e), file=sys.stderr)
+            self.reply(500)
+        with lock:
+            stats['requests'] += 1
+            write_stats()
+
+    do_GET = do_POST = do_PUT = do_PATCH = handle_request
+
+    def get(self, name):
+        with open(os.path.join(opts.dir, name), 'rb') as f:
+            self.get_file(f, os.fstat(f.fileno()).st_size)
+
+    def get_file(self, f, size):
+        def data(first, last):
+            f.seek(first)
+            return f.read(last - first + 1)
+
+        ranges = []
+        m = re.match(r'bytes=(.*)', self.headers.get('Range', ''))
+        if m:
+            for r in m.group(1).split(','):
+                first, last = r.strip().split('-')
+                ranges.append((int(first), min(int(last), size - 1)))
+            with lock, open(os.path.join(opts.dir, 'ranges'), 'a') as log:
+                for first, last in ranges:
+                    log.write('%d %d\n' % (first, last))
+
+        if opts.ranges == 'error':
+            self.reply(500, b'no ranges today')
+            return
+        if opts.ranges == 'ignore' or not ranges:
+            self.reply(200, data(0, size - 1))
+            with lock:
+                stats['bytes'] += size
+            return
+        if opts.ranges == 'single':
+            ranges = [(ranges[0][0], ranges[-1][1])]
+
+        if opts.ranges == 'norange':
+            first, last = ranges[0]
+            self.reply(206, data(first, last))
+            sent = last - first + 1
+        elif len(ranges) == 1:
+            first, last = ranges[0]
+            self.reply(206, data(first, last),
+                       [('Content-Range', 'bytes %d-%d/%d' % (first, last, size))])
+            sent = last - first + 1
+        else:
+            parts = []
+            sent = 0
+            for first, last in ranges:
+                parts.append(('\r\n--%s\r\nContent-Type: application/octet-stream\r\n'
+                              'Content-Range: bytes %d-%d/%d\r\n\r\n'
+                              % (BOUNDARY, first, last, size)).encode())
+                parts.append(data(first, last))
+                sent += last - first + 1
+            parts.append(('\r\n--%s--\r\n' % BOUNDARY).encode())
+            self.reply(206, b''.join(parts),
+                       [('Content-Type', 'multipart/byteranges; boundary=' + BOUNDARY)])
+            with lock:
+                stats['multipart'] += 1
+        with lock:
+            stats['bytes'] += sent
+
+    def sync(self, op, name, query, body):
+        form = {}
+        ctype = self.headers.get('Content-Type', '')
+        if op != 'delta' and 'octet-stream' not in ctype:
+            form = urllib.parse.parse_qs(body.decode('latin-1'), keep_blank_values=True,
+                                         encoding='latin-1')
+        arg = lambda k: int((query.get(k) or form.get(k))[0])
+
+        if op == 'start':
+            syncs[name] = Sync(name, arg('size'))
+            headers = []
+            offer = self.headers.get('X-Deltasync-Compression', '')
+            if opts.codec and opts.codec in [c.strip() for c in offer.split(',')]:
+                headers.append(('X-Deltasync-Compression', opts.codec))
+            self.reply(200, b'', headers)
+            return
+
+        s = syncs[name]
+        if op == 'move':
+            s.move(arg('from'), arg('to'), arg('size'))
+        elif op == 'add':
+            if 'data' in form:
+                s.add(arg('start'), arg('size'), form['data'][0].encode('latin-1'))
+            else:
+                enc = query.get('encoding', [None])[0]
+                s.add(arg('start'), arg('size'), body, enc,
+                      arg('dict') if enc else 0)
+        elif op == 'delta':
+            s.delta(body)
+        elif op == 'done':
+            self.reply(200, s.done().encode())
+            del syncs[name]
+            return
+        else:
+            raise ValueError('unknown operation ' + op)
+        self.reply(200)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def main():
+    global opts
+    p = argparse.ArgumentParser()
+    p.add_argument('dir')
+    p.add_argument('portfile')
+    p.add_argument('--ranges', default='multi', choices=('multi', 'single', 'ignore', 'norange', 'error'))
+    p.add_argument('--codec')
+    p.add_argument('--deltaapply', default='./deltaapply')
+    opts = p.parse_args()
+
+    server = Server(('127.0.0.1', 0), Handler)
+    with lock:
+        write_stats()
+    with open(opts.portfile + '.tmp', 'w') as f:
+        f.write('%d\n' % server.server_address[1])
+    os.rename(opts.portfile + '.tmp', opts.portfile)
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
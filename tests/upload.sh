@@ -0,0 +1,58 @@
+#!/bin/bash
+# upload.sh - sync files to the stand-in server with uploadclient in each of
+# its modes, check that the server ends up with the new file, that a delta
+# stream with discards is applied in place, and that the requests of a sync
+# all go over one connection.
+
+cd "$(dirname "$0")/.." || exit 1
+. tests/lib.sh
+
+for seed in 1 2 3 4; do
+	python3 tests/mkpair.py $seed $T/old $T/new
+	./zsyncmake $T/old $T/old.zsync > /dev/null || fail "zsyncmake failed"
+	sha1=$(sha1sum < $T/new | cut -d' ' -f1)
+
+	for flags in "" "-b" "-b -z 6" "-d" "-d -z 6" "-d -s" "-d -s -z 1 -j 4"; do
+		cp $T/old $T/srv/f
+		start_standin --codec deflate
+		./uploadclient $flags $T/old.zsync $T/new http://127.0.0.1:$(cat $T/port) f u p > $T/log 2>&1
+		stop_standin
+
+		name="seed $seed, uploadclient $flags"
+		cmp -s $T/srv/f $T/new || fail "$name: server's copy is wrong"
+		grep -q "SHA1: $sha1" $T/log || fail "$name: wrong SHA-1 reported"
+
+		# A delta stream with discards is applied in place
+		if grep -q " [1-9][0-9]* ranges of .* discarded" $T/log; then
+			[ $(stat_of in_place) -eq 1 ] || fail "$name: discards sent, but not applied in place"
+		fi
+
+		conns=$(stat_of connections)
+		[ $conns -eq 1 ] || fail "$name: $conns connections for $(stat_of requests) requests"
+		echo "$name: $(stat_of requests) requests over $conns connections"
+	done
+done
+# A binary control file with its hash index, then with every id in the
+# index out of range; that index must be rebuilt rather than used
+python3 tests/mkpair.py 5 $T/old $T/new
+./zsyncmake -B -I $T/old $T/old.zbin > /dev/null || fail "zsyncmake -B -I failed"
+for index in good bad; do
+	if [ $index = bad ]; then
+		python3 -c '
+import struct, sys
+with open(sys.argv[1], "r+b") as f:
+    off, n = struct.unpack("=QQ", f.read(128)[112:128])
+    f.seek(off)
+    f.write(b"\x7f" * n)' $T/old.zbin
+	fi
+	cp $T/old $T/srv/f
+	start_standin
+	./uploadclient -d $T/old.zbin $T/new http://127.0.0.1:$(cat $T/port) f u p > $T/log 2>&1
+	stop_standin
+	cmp -s $T/srv/f $T/new || fail "$index index: server's copy is wrong"
+	if [ $index = bad ]; then
+		grep -q "ignoring a hash index" $T/log || fail "bad index: not ignored"
+	fi
+	echo "binary control file, $index index: ok"
+done
+echo "upload: ok"
@@ -1,5 +1,10 @@
 #include "upload.h"
+#include "delta.h"
+#include "compress.h"
+#include "mapfile.h"
+#include "xfer.h"
 #include <sys/types.h>
+#include <strings.h>
 
 
 #include <curl/curl.h>
@@ -9,41 +14,178 @@
 
 char *__hash;
 
+/* Size of the buffer between delta_write and the request sending it */
+#define DELTA_PIPE_SIZE (1024 * 1024)
+
 using namespace std;
 
-void upload::start(size_t size) {
-	CURL *h = curl_easy_init();
+upload::upload(const char *host, const char *user, const char *pass, const char *path) {
+	_host = host;
+	_user = user;
+	_pass = pass;
+	_path = path;
+	_connects = 0;
+	_requests = 0;
+	_binary = false;
+	_xfer = xfer_ring_new();
+	_delta = false;
+	_discarded = false;
+	_pipehead = _pipelen = 0;
+	_pipeclosed = false;
+	_compress = false;
+	_level = 0;
+	_source = NULL;
+	_compressor = NULL;
+	_rawbytes = _zbytes = 0;
+
+	_share = curl_share_init();
+	if (_share) {
+		curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, share_lock);
+		curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+		curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	}
+}
 
-	string url = _host;
-	url = url + "/index.php/apps/deltasync/api/0.0.1/upload/start/" + _path;
+upload::~upload() {
+	for (size_t i = 0; i < _handles.size(); i++) {
+		curl_easy_cleanup(_handles[i]);
+	}
+	if (_share) {
+		curl_share_cleanup(_share);
+	}
+	compressor_free(_compressor);
+	xfer_ring_free(_xfer);
+}
+
+unsigned char *upload::get_buffer() {
+	return xfer_get(_xfer);
+}
+
+void upload::put_buffer(unsigned char *buf) {
+	xfer_put(_xfer, buf);
+}
+
+void upload::share_lock(CURL *h, curl_lock_data data, curl_lock_access access, void *userptr) {
+	((upload *)userptr)->_sharelock[data].lock();
+}
+
+void upload::share_unlock(CURL *h, curl_lock_data data, void *userptr) {
+	((upload *)userptr)->_sharelock[data].unlock();
+}
+
+/* get_handle(url)
+ * Returns a handle set up for a request to the given URL, reusing an idle one
+ * (and its connection) if there is one. */
+CURL *upload::get_handle(const string &url) {
+	CURL *h = NULL;
+
+	{
+		lock_guard<mutex> l(_lock);
+		if (!_handles.empty()) {
+			h = _handles.back();
+			_handles.pop_back();
+		}
+	}
+	if (!h) {
+		h = curl_easy_init();
+	}
 
 	curl_easy_setopt(h, CURLOPT_URL, url.c_str());
 	curl_easy_setopt(h, CURLOPT_USERNAME, _user);
 	curl_easy_setopt(h, CURLOPT_PASSWORD, _pass);
+	curl_easy_setopt(h, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(h, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	if (_share) {
+		curl_easy_setopt(h, CURLOPT_SHARE, _share);
+	}
+
+	return h;
+}
+
+/* put_handle(handle)
+ * Done with a request; keep the handle for the next one. */
+void upload::put_handle(CURL *h) {
+	long connects = 0;
+
+	curl_easy_getinfo(h, CURLINFO_NUM_CONNECTS, &connects);
+
+	/* Reset clears the options of this request, but keeps the connection */
+	curl_easy_reset(h);
+
+	lock_guard<mutex> l(_lock);
+	_connects += connects;
+	_requests++;
+	_handles.push_back(h);
+}
+
+void upload::start(size_t size) {
+	string url = _host;
+	url = url + "/index.php/apps/deltasync/api/0.0.1/upload/start/" + _path;
+
+	CURL *h = get_handle(url);
 	curl_easy_setopt(h, CURLOPT_POST, 1);
 
 	string data = "size=" + to_string(size);
 	curl_easy_setopt(h, CURLOPT_POSTFIELDS, data.c_str());
 
+	/* Offer the codecs we can compress with, best first; the server answers
+	 * with the one it wants, if any */
+	struct curl_slist *headers = NULL;
+	if (_compress && (_binary || _delta)) {
+		string offer = "X-Deltasync-Compression: ";
+		for (int codec = COMPRESS_ZSTD; codec > COMPRESS_NONE; codec--) {
+			if (compress_supported(codec)) {
+				offer = offer + compress_name(codec) + (codec > COMPRESS_DEFLATE ? ", " : "");
+			}
+		}
+		headers = curl_slist_append(headers, offer.c_str());
+		curl_easy_setopt(h, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, start_header);
+		curl_easy_setopt(h, CURLOPT_HEADERDATA, this);
+	}
+
 	CURLcode res = curl_easy_perform(h);
 
 	if (res != CURLE_OK) {
 		printf("ERROR\n");
 	}
 	printf("\n\nStarted delta sync\n");
+	if (_compressor) {
+		printf("Compressing added data with %s\n", compress_name(compressor_codec(_compressor)));
+	}
 
-	curl_easy_cleanup(h);
+	put_handle(h);
+	curl_slist_free_all(headers);
+
+	if (_delta) {
+		unsigned char header[DELTA_MAGIC_LEN + DELTA_MAX_VARINT];
+
+		memcpy(header, DELTA_MAGIC, DELTA_MAGIC_LEN);
+		size_t n = DELTA_MAGIC_LEN + delta_put_varint(header + DELTA_MAGIC_LEN, size);
+
+		_pipe.resize(DELTA_PIPE_SIZE);
+		_pipehead = _pipelen = 0;
+		_pipeclosed = false;
+		delta_write(header, n);
+		_sender = thread(&upload::delta_send, this);
+	}
 }
 
 void upload::move(size_t from, size_t to, size_t size) {
-	CURL *h = curl_easy_init();
+	if (_delta) {
+		unsigned char op[DELTA_MAX_OP];
+
+		delta_write(op, delta_put_copy(op, from, to, size));
+		return;
+	}
 
 	string url = _host;
 	url = url + "/index.php/apps/deltasync/api/0.0.1/upload/move/" + _path;
 
-	curl_easy_setopt(h, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(h, CURLOPT_USERNAME, _user);
-	curl_easy_setopt(h, CURLOPT_PASSWORD, _pass);
+	CURL *h = get_handle(url);
 	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, "PATCH");
 
 	string data = "from=" + to_string(from) + "&to=" + to_string(to) + "&size=" + to_string(size);;
@@ -56,24 +198,132 @@ void upload::move(size_t from, size_t to, size_t size) {
 	}
 	printf("Moved %lu bytes at %lu to %lu\n", size, from, to);
 
-	curl_easy_cleanup(h);
+	put_handle(h);
 }
 
-void upload::add(size_t start, size_t size, const char *data) {
-	CURL *h = curl_easy_init();
+void upload::discard(size_t from, size_t size) {
+	unsigned char op[DELTA_MAX_OP];
+
+	delta_write(op, delta_put_discard(op, from, size));
+	_discarded = true;
+}
 
+/* A request body being sent straight from the caller's buffer */
+struct body {
+	const char *data;
+	size_t left;
+};
+
+static size_t readBody(char *ptr, size_t size, size_t nmemb, void *stream) {
+	struct body *b = (struct body *)stream;
+	size_t n = size * nmemb < b->left ? size * nmemb : b->left;
+
+	memcpy(ptr, b->data, n);
+	b->data += n;
+	b->left -= n;
+	return n;
+}
+
+void upload::add(size_t start, size_t size, const char *data) {
 	string url = _host;
 	url = url + "/index.php/apps/deltasync/api/0.0.1/upload/add/" + _path;
 
-	curl_easy_setopt(h, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(h, CURLOPT_USERNAME, _user);
-	curl_easy_setopt(h, CURLOPT_PASSWORD, _pass);
+	if (_delta) {
+		unsigned char op[DELTA_MAX_ZOP];
+		unsigned char *zdata;
+		size_t dictlen;
+		size_t zlen = compress_add(start, size, data, &zdata, &dictlen);
+
+		if (zlen) {
+			delta_write(op, delta_put_zdata(op, start, size, compressor_codec(_compressor), dictlen, zlen));
+			delta_write(zdata, zlen);
+			put_buffer(zdata);
+		}
+		else {
+			delta_write(op, delta_put_data(op, start, size));
+			delta_write(data, size);
+		}
+		return;
+	}
+	if (_binary) {
+		add_binary(url, start, size, data);
+		return;
+	}
+	add_form(url, start, size, data);
+}
+
+/* A form body being percent-encoded on the fly from the caller's buffer,
+ * after the fields before it */
+struct form_body {
+	string prefix;
+	size_t sent;			/* Bytes of prefix sent */
+	const unsigned char *data;
+	size_t left;
+};
+
+/* Bytes left alone by percent-encoding, as by curl_easy_escape */
+static inline bool unreserved(unsigned char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		|| c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static size_t readForm(char *ptr, size_t size, size_t nmemb, void *stream) {
+	static const char hex[] = "0123456789ABCDEF";
+	struct form_body *b = (struct form_body *)stream;
+	size_t room = size * nmemb, n = 0;
+
+	if (b->sent < b->prefix.size()) {
+		n = b->prefix.size() - b->sent < room ? b->prefix.size() - b->sent : room;
+		memcpy(ptr, b->prefix.data() + b->sent, n);
+		b->sent += n;
+	}
+
+	/* Never split an escape across calls */
+	while (b->left && n < room) {
+		unsigned char c = *b->data;
+
+		if (unreserved(c)) {
+			ptr[n++] = c;
+		}
+		else {
+			if (room - n < 3)
+				break;
+			ptr[n++] = '%';
+			ptr[n++] = hex[c >> 4];
+			ptr[n++] = hex[c & 15];
+		}
+		b->data++;
+		b->left--;
+	}
+	return n;
+}
+
+/* add_form(url, start, size, data)
+ * Send an add as a urlencoded form, encoding the data as it is sent rather
+ * than into a copy of the whole body. */
+void upload::add_form(string url, size_t start, size_t size, const char *data) {
+	struct form_body b;
+
+	b.prefix = "start=" + to_string(start) + "&size=" + to_string(size) + "&data=";
+	b.sent = 0;
+	b.data = (const unsigned char *)data;
+	b.left = size;
+
+	curl_off_t len = b.prefix.size();
+	for (size_t i = 0; i < size; i++)
+		len += unreserved(b.data[i]) ? 1 : 3;
+
+	CURL *h = get_handle(url);
 	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, "PATCH");
 
-	char *data2 = curl_easy_escape(h, data, size);
+	curl_easy_setopt(h, CURLOPT_POST, 1L);
+	curl_easy_setopt(h, CURLOPT_READFUNCTION, readForm);
+	curl_easy_setopt(h, CURLOPT_READDATA, &b);
+	curl_easy_setopt(h, CURLOPT_POSTFIELDSIZE_LARGE, len);
 
-	string pdata = "start=" + to_string(start) + "&size=" + to_string(size) + "&data=" + data2;
-	curl_easy_setopt(h, CURLOPT_POSTFIELDS, pdata.c_str());
+	struct curl_slist *headers = NULL;
+	headers = curl_slist_append(headers, "Expect:");
+	curl_easy_setopt(h, CURLOPT_HTTPHEADER, headers);
 
 	CURLcode res = curl_easy_perform(h);
 
@@ -82,19 +332,74 @@ void upload::add(size_t start, size_t size, const char *data) {
 	}
 	printf("Added %lu bytes at %lu\n", size, start);
 
-	curl_easy_cleanup(h);
+	put_handle(h);
+	curl_slist_free_all(headers);
 }
 
-char * upload::done() {
+/* add_binary(url, start, size, data)
+ * Send an add with start and size in the query string and the data as the
+ * raw request body, read straight from the caller's buffer. */
+void upload::add_binary(string url, size_t start, size_t size, const char *data) {
+	url = url + "?start=" + to_string(start) + "&size=" + to_string(size);
+
+	/* A compressed body says how, and how much of the new file before it
+	 * to use as the dictionary */
+	unsigned char *zdata;
+	size_t dictlen;
+	size_t zlen = compress_add(start, size, data, &zdata, &dictlen);
+	struct body b = { data, size };
+
+	if (zlen) {
+		url = url + "&encoding=" + compress_name(compressor_codec(_compressor)) + "&dict=" + to_string(dictlen);
+		b.data = (const char *)zdata;
+		b.left = zlen;
+	}
+
+	CURL *h = get_handle(url);
+	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, "PATCH");
+
+	curl_easy_setopt(h, CURLOPT_POST, 1L);
+	curl_easy_setopt(h, CURLOPT_READFUNCTION, readBody);
+	curl_easy_setopt(h, CURLOPT_READDATA, &b);
+	curl_easy_setopt(h, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)b.left);
+
+	/* No Expect: 100-continue round trip before the body */
+	struct curl_slist *headers = NULL;
+	headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
+	headers = curl_slist_append(headers, "Expect:");
+	curl_easy_setopt(h, CURLOPT_HTTPHEADER, headers);
+
+	CURLcode res = curl_easy_perform(h);
 
-	CURL *h = curl_easy_init();
+	if (res != CURLE_OK) {
+		printf("ERROR\n");
+	}
+	printf("Added %lu bytes at %lu\n", size, start);
+
+	put_handle(h);
+	curl_slist_free_all(headers);
+	if (zlen) {
+		put_buffer(zdata);
+	}
+}
+
+char * upload::done() {
+	if (_delta) {
+		unsigned char op = DELTA_END;
+
+		delta_write(&op, 1);
+		{
+			lock_guard<mutex> l(_pipelock);
+			_pipeclosed = true;
+			_pipecv.notify_all();
+		}
+		_sender.join();
+	}
 
 	string url = _host;
 	url = url + "/index.php/apps/deltasync/api/0.0.1/upload/done/" + _path;
 
-	curl_easy_setopt(h, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(h, CURLOPT_USERNAME, _user);
-	curl_easy_setopt(h, CURLOPT_PASSWORD, _pass);
+	CURL *h = get_handle(url);
 	curl_easy_setopt(h, CURLOPT_POST, 1);
 	curl_easy_setopt(h, CURLOPT_POSTFIELDS, "");
 
@@ -105,7 +410,12 @@ char * upload::done() {
 	if (res != CURLE_OK) {
 		printf("ERROR\n");
 	}
-	curl_easy_cleanup(h);
+	put_handle(h);
+
+	printf("%ld requests over %ld connections\n", _requests, _connects);
+	if (_compressor) {
+		printf("Compressed %lu bytes of added data to %lu\n", _rawbytes, _zbytes);
+	}
 	return __hash;
 }
 
@@ -117,3 +427,156 @@ size_t writeHash(void *ptr, size_t size, size_t nmemb, void *stream) {
 	return size*nmemb;
 }
 
+/* delta_write(data, len)
+ * Append to the delta stream, waiting for the sender to make room. Data is
+ * dropped if the request has already failed. */
+void upload::delta_write(const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *)data;
+	unique_lock<mutex> l(_pipelock);
+
+	while (len) {
+		_pipecv.wait(l, [this] { return _pipelen < _pipe.size() || _pipeclosed; });
+		if (_pipeclosed)
+			return;
+
+		/* Copy into the free space after the data, up to the end of the ring */
+		size_t tail = (_pipehead + _pipelen) % _pipe.size();
+		size_t n = _pipe.size() - _pipelen;
+		if (n > _pipe.size() - tail)
+			n = _pipe.size() - tail;
+		if (n > len)
+			n = len;
+
+		memcpy(&_pipe[tail], p, n);
+		_pipelen += n;
+		p += n;
+		len -= n;
+		_pipecv.notify_all();
+	}
+}
+
+/* delta_read(buf, size, nmemb, self)
+ * curl's read callback for the delta request: wait for stream data and hand
+ * it over, or end the body once the stream is closed and drained. */
+size_t upload::delta_read(char *ptr, size_t size, size_t nmemb, void *stream) {
+	upload *u = (upload *)stream;
+	unique_lock<mutex> l(u->_pipelock);
+
+	u->_pipecv.wait(l, [u] { return u->_pipelen || u->_pipeclosed; });
+
+	size_t n = u->_pipelen;
+	if (n > u->_pipe.size() - u->_pipehead)
+		n = u->_pipe.size() - u->_pipehead;
+	if (n > size * nmemb)
+		n = size * nmemb;
+
+	memcpy(ptr, &u->_pipe[u->_pipehead], n);
+	u->_pipehead = (u->_pipehead + n) % u->_pipe.size();
+	u->_pipelen -= n;
+	u->_pipecv.notify_all();
+	return n;
+}
+
+/* delta_send()
+ * The sender thread - POST the delta stream as it is written. */
+void upload::delta_send() {
+	string url = _host;
+	url = url + "/index.php/apps/deltasync/api/0.0.1/upload/delta/" + _path;
+
+	CURL *h = get_handle(url);
+	curl_easy_setopt(h, CURLOPT_POST, 1L);
+	curl_easy_setopt(h, CURLOPT_READFUNCTION, delta_read);
+	curl_easy_setopt(h, CURLOPT_READDATA, this);
+
+	struct curl_slist *headers = NULL;
+	headers = curl_slist_append(headers, "Content-Type: application/x-zsync-delta");
+	headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+	headers = curl_slist_append(headers, "Expect:");
+	curl_easy_setopt(h, CURLOPT_HTTPHEADER, headers);
+
+	CURLcode res = curl_easy_perform(h);
+
+	if (res != CURLE_OK) {
+		printf("ERROR\n");
+	}
+	printf("Sent delta stream\n");
+
+	put_handle(h);
+	curl_slist_free_all(headers);
+
+	/* Nobody is reading any more, so don't let writers wait for us */
+	lock_guard<mutex> l(_pipelock);
+	_pipeclosed = true;
+	_pipecv.notify_all();
+}
+
+/* start_header(buf, size, nitems, self)
+ * Header callback for the start request: look for the codec the server
+ * picked from those we offered. */
+size_t upload::start_header(char *buf, size_t size, size_t nitems, void *userdata) {
+	upload *u = (upload *)userdata;
+	size_t len = size * nitems;
+	const char *name = "X-Deltasync-Compression:";
+	size_t n = strlen(name);
+
+	if (len > n && !strncasecmp(buf, name, n)) {
+		string value(buf + n, len - n);
+		size_t first = value.find_first_not_of(" \t");
+		size_t last = value.find_last_not_of(" \t\r\n");
+
+		if (first != string::npos) {
+			int codec = compress_by_name(value.substr(first, last - first + 1).c_str());
+
+			if (codec > COMPRESS_NONE && compress_supported(codec) && !u->_compressor) {
+				u->_compressor = compressor_new(codec, u->_level);
+			}
+		}
+	}
+	return len;
+}
+
+/* compress_add(start, size, data, &zdata, &dictlen)
+ * Compress added data into a transfer buffer, primed with what precedes it in
+ * the new file. Returns the compressed length, with the buffer in zdata to be
+ * put back once sent, or 0 to send the data as it is, which is also what
+ * happens when compressing doesn't make it smaller. */
+size_t upload::compress_add(size_t start, size_t size, const char *data, unsigned char **zdata, size_t *dictlen) {
+	*dictlen = 0;
+	*zdata = NULL;
+	if (!_compressor) {
+		return 0;
+	}
+
+	*dictlen = compress_max_dict(compressor_codec(_compressor));
+	if (*dictlen > XFER_SIZE) {
+		*dictlen = XFER_SIZE;
+	}
+	if (*dictlen > start || !_source) {
+		*dictlen = _source ? start : 0;
+	}
+
+	unsigned char *dict = NULL;
+	if (*dictlen) {
+		dict = get_buffer();
+		if (mapfile_read(_source, start - *dictlen, dict, *dictlen) != 0) {
+			perror("pread");
+			*dictlen = 0;
+		}
+	}
+
+	unsigned char *out = get_buffer();
+	size_t zlen = compress_block(_compressor, out, size < XFER_SIZE ? size : XFER_SIZE,
+								 (const unsigned char *)data, size, dict, *dictlen);
+	if (dict) {
+		put_buffer(dict);
+	}
+
+	_rawbytes += size;
+	_zbytes += zlen ? zlen : size;
+	if (!zlen) {
+		put_buffer(out);
+		return 0;
+	}
+	*zdata = out;
+	return zlen;
+}
@@ -3,7 +3,15 @@
 
 #include <stdlib.h>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
+#include <curl/curl.h>
+
+struct mapfile;
+struct xfer_ring;
 
 size_t writeHash(void *ptr, size_t size, size_t nmemb, void *stream);
 
@@ -12,23 +20,104 @@ using namespace std;
 class upload {
 
 public:
-	upload(const char *host, const char *user, const char *pass, const char *path) {
-		_host = host;
-		_user = user;
-		_pass = pass;
-		_path = path;
-	};
+	upload(const char *host, const char *user, const char *pass, const char *path);
+	~upload();
 
 	void start(size_t size);
 	void move(size_t from, size_t to, size_t size);
 	void add(size_t start, size_t size, const char *data);
 	char * done();
 
+	/* Tell the server that no move reads the size bytes at from in the old
+	 * file, so it may free them (or cut them off, at the end of the file)
+	 * before applying the rest. Only before any moves and adds, and only in
+	 * delta mode; there is no request for it on its own. The stream may then
+	 * be applied in place, so the moves after it must be in_place() ones. */
+	void discard(size_t from, size_t size);
+
+	/* Send add data as a raw request body rather than a form field */
+	void set_binary(bool binary) { _binary = binary; }
+
+	/* Send all moves and adds as one delta instruction stream (see delta.h)
+	 * rather than a request each */
+	void set_delta(bool delta) { _delta = delta; }
+
+	/* Whether the server may apply each move to the file in place, so that
+	 * a move must not read what an earlier one overwrote. Copies in a delta
+	 * stream read the old file as it was, unless it has discards (see
+	 * delta.h). */
+	bool in_place() const { return !_delta || _discarded; }
+
+	/* Compress added data, with whichever codec the server accepts when the
+	 * upload is started, at the given level (0 for the codec's default). The
+	 * added data must be from the new file m, which supplies the compression
+	 * dictionary. Only in binary and delta modes. */
+	void set_compression(int level, const struct mapfile *m) {
+		_compress = true;
+		_level = level;
+		_source = m;
+	}
+
+	/* Transfer buffers of XFER_SIZE bytes for add data (see xfer.h). Adds
+	 * must be made from one thread at a time, holding at most one buffer. */
+	unsigned char *get_buffer();
+	void put_buffer(unsigned char *buf);
+
 private:
+	size_t compress_add(size_t start, size_t size, const char *data, unsigned char **zdata, size_t *dictlen);
+	static size_t start_header(char *buf, size_t size, size_t nitems, void *userdata);
+
+	void add_binary(string url, size_t start, size_t size, const char *data);
+	void add_form(string url, size_t start, size_t size, const char *data);
+
+	void delta_write(const void *data, size_t len);
+	void delta_send();
+	static size_t delta_read(char *ptr, size_t size, size_t nmemb, void *stream);
+
+	CURL *get_handle(const string &url);
+	void put_handle(CURL *h);
+
+	static void share_lock(CURL *h, curl_lock_data data, curl_lock_access access, void *userptr);
+	static void share_unlock(CURL *h, curl_lock_data data, void *userptr);
+
 	const char *_host;
 	const char *_user;
 	const char *_pass;
 	const char *_path;
+
+	/* Idle handles, which keep their connections open for the next request,
+	 * and the DNS, TLS session and connection caches they all share */
+	mutex _lock;
+	vector<CURL *> _handles;
+	CURLSH *_share;
+	mutex _sharelock[CURL_LOCK_DATA_LAST];
+
+	bool _binary;
+
+	/* Buffers for reading, compressing and sending added data */
+	struct xfer_ring *_xfer;
+
+	/* In delta mode, moves and adds are encoded into a pipe, which a thread
+	 * sends as the chunked body of a single request */
+	bool _delta;
+	bool _discarded;			/* Discards were sent, so it may be in place */
+	thread _sender;
+	mutex _pipelock;
+	condition_variable _pipecv;
+	vector<unsigned char> _pipe;
+	size_t _pipehead, _pipelen;
+	bool _pipeclosed;
+
+	/* Compression of added data; _compressor is NULL unless the server
+	 * accepted one of our codecs */
+	bool _compress;
+	int _level;
+	const struct mapfile *_source;
+	struct compressor *_compressor;
+	size_t _rawbytes, _zbytes;
+
+	long _connects;				/* Connections opened so far */
+	long _requests;
 };
 
 #endif
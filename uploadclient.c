@@ -1,12 +1,12 @@
 #include <stdio.h>
 #include <sys/types.h> 
 #include <sys/stat.h> 
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h> 
 #include <math.h> 
 
-#include <openssl/md4.h>
 #include <openssl/sha.h> 
 #include <arpa/inet.h> 
 
@@ -14,8 +14,10 @@
 
 #include "zsync.h"
 #include "upload.h"
+#include "download.h"
+#include "mapfile.h"
 
-int get_len(FILE * f) {
+off_t get_len(FILE * f) {
 	struct stat s;
 
 	if (fstat(fileno(f), &s) == -1) {
@@ -37,64 +39,223 @@ struct zsync_state *read_zsync_control_file(const char *fn) {
 	return zs;
 }
 
-void read_seed_file(struct zsync_state *z, const char *fname) {
+struct mapfile *map_seed_file(struct zsync_state *z, const char *fname) {
 	FILE *f = fopen(fname, "r");
-	zsync_submit_source_file(z, f);
+	if (!f) {
+		perror(fname);
+		return NULL;
+	}
+
+	struct mapfile *m = mapfile_open(f, zsync_source_pad(z));
+	if (!m) {
+		perror(fname);
+	}
 	fclose(f);
+
+	return m;
 }
 
-void fix_input(struct zsync_state *z, const char *nameFnew, upload *u) {
-	FILE *fnew = fopen(nameFnew, "r");
+void read_seed_file(struct zsync_state *z, const struct mapfile *m) {
+	zsync_submit_source_map(z, m);
+}
 
-	int len = get_len(fnew);
+/* Operations the scan may get ahead of the upload by when streaming */
+#define STREAM_QUEUE 256
 
-	u->start(len);
+void fix_input(struct zsync_state *z, const struct mapfile *m, upload *u) {
+	u->start(m->len);
 
-	zsync_parseMove(z, u);
-	zsync_parseAdd(z, fnew, len, u);
+	/* Discards are hints in the delta stream; a server taking a request per
+	 * move and add has no use for them. Once they are sent, the moves are
+	 * ordered so that the stream can be applied in place. */
+	if (!u->in_place()) {
+		zsync_parseDiscard(z, u);
+	}
+	zsync_parseMove(z, m, u);
+	zsync_parseAdd(z, m, u);
 
 	printf("SHA1: %s\n", u->done());
+}
+
+/* stream_input(self, map, upload)
+ * Scan the seed file and fix the input at the same time. Nothing is
+ * discarded, as what no move reads is only known once the scan is done.
+ * The moves aren't ordered as parseMove orders them, so the upload must not
+ * apply them in place. */
+void stream_input(struct zsync_state *z, const struct mapfile *m, upload *u) {
+	u->start(m->len);
 
-	fclose(fnew);
+	printf("READING AND SENDING\n");
+	zsync_stream_source_map(z, m, u, STREAM_QUEUE);
+
+	printf("SHA1: %s\n", u->done());
+}
+
+/* Ranged GETs a download keeps in flight */
+#define DOWNLOAD_WINDOW 8
+
+/* fetch_output(self, map, download, out)
+ * Download the server's copy of the file into out: the blocks the scan found
+ * in the local file are copied from it, and only the rest is fetched. */
+int fetch_output(struct zsync_state *z, const struct mapfile *m, download *d, const char *out) {
+	struct stat so, sm;
+	int rc = -1;
+
+	if (stat(out, &so) == 0 && fstat(m->fd, &sm) == 0
+		&& so.st_dev == sm.st_dev && so.st_ino == sm.st_ino) {
+		fprintf(stderr, "%s: can't download over the local file\n", out);
+		return -1;
+	}
+
+	int fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		perror(out);
+		return -1;
+	}
+
+	int nrange;
+	off_t *ranges;
+	if (zsync_parseCopy(z, m, fd) == 0 && (ranges = zsync_needed_byte_ranges(z, &nrange))) {
+		if (d->fetch(ranges, nrange, fd, DOWNLOAD_WINDOW) == 0) {
+			switch (zsync_verify(z, fd)) {
+			case 1:
+				printf("SHA1 OK\n");
+				rc = 0;
+				break;
+			case 0:
+				printf("No SHA1 to check\n");
+				rc = 0;
+				break;
+			default:
+				printf("SHA1 MISMATCH\n");
+				break;
+			}
+		}
+		free(ranges);
+	}
+
+	if (close(fd) != 0) {
+		perror(out);
+		rc = -1;
+	}
+	return rc;
 }
 
 int main(int argc, char **argv) {
+	int threads = 1;
+	int streaming = 0;
+	int binary = 0;
+	int delta = 0;
+	int level = -1;
+	const char *out = NULL;
+	long gap = -1;
+	int opt;
 
-	if (argc < 5) {
-		printf("Usage: %s <file.zsync> <file.new> <host> <path> <user> <pass>\n", argv[0]);
+	while ((opt = getopt(argc, argv, "j:sbdz:g:G:")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			streaming = 1;
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		case 'd':
+			delta = 1;
+			break;
+		case 'z':
+			level = atoi(optarg);
+			break;
+		case 'g':
+			out = optarg;
+			break;
+		case 'G':
+			gap = atol(optarg);
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+
+	if (argc - optind < 6) {
+		printf("Usage: %s [-j threads] [-d [-s]] [-b] [-z level] <file.zsync> <file.new> <host> <path> <user> <pass>\n", argv[0]);
+		printf("       %s -g <out> [-G gap] [-j threads] <file.zsync> <file.old> <host> <path> <user> <pass>\n", argv[0]);
 		return 0;
 	}
+	argv += optind - 1;
 
 	struct zsync_state *zs = read_zsync_control_file(argv[1]);
+	if (!zs) {
+		return 1;
+	}
+	zsync_set_threads(zs, threads);
 	
 	char *fin = (char *)malloc(sizeof(char) * strlen(argv[2]) + 1);
 
 	strcpy(fin, argv[2]);
 
 	//Step 2 fill availble local data
-	printf("READING %s\n", fin);
-	read_seed_file(zs, fin);
-	printf("DONE READING\n");
+	struct mapfile *m = map_seed_file(zs, fin);
+	if (!m) {
+		return 1;
+	}
 
 	// Init curl
 	curl_global_init(CURL_GLOBAL_DEFAULT);
 
+	if (out) {
+		//Step 3 get the server's copy, with what we have of it from here
+		download *d = new download(argv[3], argv[5], argv[6], argv[4]);
+		if (gap >= 0) {
+			d->set_gap(gap);
+		}
+
+		printf("READING %s\n", fin);
+		read_seed_file(zs, m);
+		printf("DONE READING\n");
+
+		int rc = fetch_output(zs, m, d, out);
+
+		mapfile_close(m);
+		delete d;
+		return rc == 0 ? 0 : 1;
+	}
+
 	upload *u = new upload(argv[3], argv[5], argv[6], argv[4]);
+	u->set_binary(binary);
+	u->set_delta(delta);
+	if (level >= 0) {
+		u->set_compression(level, m);
+	}
 
-	//Step 3 fix input file
-	fix_input(zs, argv[2], u);
+	/* Moves are streamed in the order the scan finds them, which is only
+	 * safe if they read the old file as it was */
+	if (streaming && u->in_place()) {
+		fprintf(stderr, "streaming (-s) needs a delta upload (-d)\n");
+		mapfile_close(m);
+		delete u;
+		return 1;
+	}
 
+	if (streaming) {
+		//Step 3 fix input file as we read it
+		stream_input(zs, m, u);
+	}
+	else {
+		printf("READING %s\n", fin);
+		read_seed_file(zs, m);
+		printf("DONE READING\n");
 
-	return 1;
-	//Step 3 Get required byte ranges
-	/*
-	int nrange;
-	off_t *zbyterange = zsync_needed_byte_ranges(zs, &nrange);
+		//Step 3 fix input file
+		fix_input(zs, m, u);
+	}
 
-	printf("------\n");
-	printf("%d Ranges need to be removed\n", nrange);
-	for (unsigned int i = 0; i < nrange; i++) {
-		printf("%d -- %d\n", zbyterange[i*2], zbyterange[i*2+1]);
-	}*/
+	mapfile_close(m);
+	delete u;
 
+
+	return 1;
 }
@@ -0,0 +1,75 @@
+/* Ring of reusable transfer buffers; see xfer.h. */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+
+#include "xfer.h"
+
+using namespace std;
+
+struct xfer_ring {
+	unsigned char *mem;			/* All the buffers, one after another */
+	unsigned int next;			/* Buffer to hand out next, if free */
+	bool busy[XFER_BUFS];
+	mutex lock;
+	condition_variable freed;
+};
+
+/* xfer_ring_new()
+ * Returns a ring with all its buffers free, or NULL if out of memory. */
+struct xfer_ring *xfer_ring_new(void) {
+	struct xfer_ring *r = new xfer_ring;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	void *p;
+
+	if (posix_memalign(&p, pagesize, (size_t)XFER_SIZE * XFER_BUFS) != 0) {
+		delete r;
+		return NULL;
+	}
+	r->mem = (unsigned char *)p;
+	r->next = 0;
+	for (int i = 0; i < XFER_BUFS; i++)
+		r->busy[i] = false;
+	return r;
+}
+
+void xfer_ring_free(struct xfer_ring *r) {
+	if (!r)
+		return;
+	free(r->mem);
+	delete r;
+}
+
+/* xfer_get(self)
+ * Free buffers are handed out in turn, so the same few pages are reused over
+ * and over. */
+unsigned char *xfer_get(struct xfer_ring *r) {
+	unique_lock<mutex> l(r->lock);
+	unsigned int i;
+
+	for (;;) {
+		for (i = 0; i < XFER_BUFS; i++) {
+			if (!r->busy[(r->next + i) % XFER_BUFS])
+				break;
+		}
+		if (i < XFER_BUFS)
+			break;
+		r->freed.wait(l);
+	}
+
+	i = (r->next + i) % XFER_BUFS;
+	r->busy[i] = true;
+	r->next = (i + 1) % XFER_BUFS;
+	return r->mem + (size_t)i * XFER_SIZE;
+}
+
+void xfer_put(struct xfer_ring *r, unsigned char *buf) {
+	{
+		lock_guard<mutex> l(r->lock);
+		r->busy[(buf - r->mem) / XFER_SIZE] = false;
+	}
+	r->freed.notify_one();
+}
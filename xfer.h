@@ -0,0 +1,25 @@
+#ifndef XFER_H
+#define XFER_H
+
+#include <stddef.h>
+
+/* A fixed ring of page aligned transfer buffers, allocated once and reused
+ * for reading data from the new file and preparing it to be sent, so that
+ * what a sync holds in memory for that doesn't depend on the file size.
+ *
+ * Adds are sent in pieces of at most XFER_SIZE bytes. One add needs at most
+ * three buffers at once: its data, a compression dictionary, and the
+ * compressed data. */
+#define XFER_SIZE (128 * 1024)
+#define XFER_BUFS 4
+
+struct xfer_ring;
+
+struct xfer_ring *xfer_ring_new(void);
+void xfer_ring_free(struct xfer_ring *r);
+
+/* Take the next buffer, waiting for one to be put back if all are in use */
+unsigned char *xfer_get(struct xfer_ring *r);
+void xfer_put(struct xfer_ring *r, unsigned char *buf);
+
+#endif
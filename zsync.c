@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
@@ -44,8 +46,10 @@
 
 #include "rcksum.h"
 #include "zsync.h"
+#include "zsyncbin.h"
+#include "cdc.h"
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 /* Probably we really want a table of compression methods here. But I've only
  * implemented SHA1 so this is it for now. */
@@ -64,13 +68,34 @@ struct zsync_state {
 	struct rcksum_state *rs;	/* rsync algorithm state, with block checksums and
 								 * holding the in-progress local version of the target */
 	off_t filelen;				/* Length of the remote file */
-	int blocks;					/* Number of blocks in the remote file */
+	zs_blockid blocks;			/* Number of blocks in the remote file */
 	size_t blocksize;			/* Blocksize */
+	size_t chunking[3];			/* Min, avg and max size of content-defined
+								 * chunks, if the blocks are those */
+
+	/* Coarser levels of blocks, whose block sums follow ours in the control
+	 * file, in order */
+	struct {
+		size_t blocksize;
+		int seq_matches, rsum_bytes, checksum_bytes;
+	} levels[RCKSUM_MAX_LEVELS];
+	int nlevels;
+
+	unsigned char sha1[20];		/* SHA-1 of the remote file, if have_sha1 */
+	int have_sha1;
+
+	/* A binary control file, which rs uses in place */
+	void *map;
+	size_t maplen;
 };
 
 static int zsync_read_blocksums(struct zsync_state *zs, FILE * f,
 								int rsum_bytes, int checksum_bytes,
-								int seq_matches);
+								int seq_matches, int hash_algo);
+static int read_block_records(struct rcksum_state *rs, FILE * f, zs_blockid blocks,
+							  int rsum_bytes, int checksum_bytes);
+static int zsync_read_chunksums(struct zsync_state *zs, FILE * f, int checksum_bytes);
+static struct zsync_state *zsync_begin_binary(FILE * f);
 
 /* Constructor */
 struct zsync_state *zsync_begin(FILE * f) {
@@ -78,6 +103,8 @@ struct zsync_state *zsync_begin(FILE * f) {
 	 * rcksum_state. These are the defaults from versions of zsync before these
 	 * were variable. */
 	int checksum_bytes = 16, rsum_bytes = 4, seq_matches = 2;
+	int hash_algo = RCKSUM_HASH_MD4;
+	zs_blockid chunks = 0;
 
 	/* Field names that we can ignore if present and not
 	 * understood. This allows new headers to be added without breaking
@@ -85,6 +112,17 @@ struct zsync_state *zsync_begin(FILE * f) {
 	 * backwards compat and have old clients give meaningful errors. */
 	char *safelines = NULL;
 
+	/* Binary control files are told apart by their first byte */
+	{
+		int c = getc(f);
+
+		if (c == EOF)
+			return NULL;
+		ungetc(c, f);
+		if (c == (unsigned char)ZSYNC_BIN_MAGIC[0])
+			return zsync_begin_binary(f);
+	}
+
 	/* Allocate memory for the object */
 	struct zsync_state *zs = (zsync_state *)calloc(sizeof *zs, 1);
 
@@ -122,6 +160,42 @@ struct zsync_state *zsync_begin(FILE * f) {
 					return NULL;
 				}
 			}
+			else if (!strcmp(buf, "Chunking")) {
+				unsigned long min, avg, max;
+				struct cdc_params cdc;
+
+				if (sscanf(p, "FastCDC %lu,%lu,%lu", &min, &avg, &max) != 3
+					|| cdc_init(&cdc, min, avg, max) != 0) {
+					fprintf(stderr, "unsupported chunking %s - you need a newer version of zsync.\n", p);
+					free(zs);
+					return NULL;
+				}
+				zs->chunking[0] = min;
+				zs->chunking[1] = avg;
+				zs->chunking[2] = max;
+			}
+			else if (!strcmp(buf, "Chunks")) {
+				chunks = atoll(p);
+			}
+			else if (!strcmp(buf, "Coarse-Level")) {
+				int i = zs->nlevels;
+				unsigned long bs;
+
+				if (i == RCKSUM_MAX_LEVELS
+					|| sscanf(p, "%lu %d,%d,%d", &bs, &zs->levels[i].seq_matches,
+							  &zs->levels[i].rsum_bytes, &zs->levels[i].checksum_bytes) != 4
+					|| !bs || (bs & (bs - 1))
+					|| bs <= (i ? zs->levels[i - 1].blocksize : zs->blocksize)
+					|| zs->levels[i].rsum_bytes < 1 || zs->levels[i].rsum_bytes > 4
+					|| zs->levels[i].checksum_bytes < 3 || zs->levels[i].checksum_bytes > 16
+					|| zs->levels[i].seq_matches > 2 || zs->levels[i].seq_matches < 1) {
+					fprintf(stderr, "nonsensical coarse level line %s\n", p);
+					free(zs);
+					return NULL;
+				}
+				zs->levels[i].blocksize = bs;
+				zs->nlevels++;
+			}
 			else if (!strcmp(buf, "Hash-Lengths")) {
 				if (sscanf
 					(p, "%d,%d,%d", &seq_matches, &rsum_bytes,
@@ -133,7 +207,29 @@ struct zsync_state *zsync_begin(FILE * f) {
 					return NULL;
 				}
 			}
+			else if (!strcmp(buf, "Hash-Algo")) {
+				hash_algo = rcksum_hash_by_name(p);
+				if (hash_algo < 0) {
+					fprintf(stderr, "unsupported block hash algorithm %s - you need a zsync built with it.\n", p);
+					free(zs);
+					return NULL;
+				}
+			}
 			else if (!strcmp(buf, ckmeth_sha1)) {
+				if (strlen(p) != 2 * sizeof zs->sha1) {
+					fprintf(stderr, "SHA-1 digest from control file is wrong length.\n");
+				}
+				else {
+					size_t i;
+					unsigned int x;
+
+					for (i = 0; i < sizeof zs->sha1; i++) {
+						if (sscanf(p + 2 * i, "%2x", &x) != 1)
+							break;
+						zs->sha1[i] = x;
+					}
+					zs->have_sha1 = i == sizeof zs->sha1;
+				}
 			}
 			else if (!safelines || !strstr(safelines, buf)) {
 				fprintf(stderr,
@@ -156,55 +252,242 @@ struct zsync_state *zsync_begin(FILE * f) {
 		free(zs);
 		return NULL;
 	}
-	if (zsync_read_blocksums(zs, f, rsum_bytes, checksum_bytes, seq_matches) != 0) {
+	if (zs->chunking[0] && zs->nlevels) {
+		fprintf(stderr, "chunked control files can't have coarse levels\n");
+		free(zs);
+		return NULL;
+	}
+	if (zs->chunking[0]) {
+		/* The rsum of a chunk is the start of its checksum */
+		if (chunks < 1 || seq_matches != 1 || checksum_bytes < 4) {
+			fprintf(stderr, "nonsensical Chunks or Hash-Lengths for chunked control file\n");
+			free(zs);
+			return NULL;
+		}
+		zs->blocks = chunks;
+	}
+	if (zs->blocks > RCKSUM_MAX_BLOCKS) {
+		fprintf(stderr, "too many blocks (%lld) - the blocksize is too small for a file this size\n",
+				zs->blocks);
+		free(zs);
+		return NULL;
+	}
+	if (zsync_read_blocksums(zs, f, rsum_bytes, checksum_bytes, seq_matches, hash_algo) != 0) {
 		free(zs);
 		return NULL;
 	}
 	return zs;
 }
 
-/* zsync_read_blocksums(self, FILE*, rsum_bytes, checksum_bytes, seq_matches)
+/* zsync_read_blocksums(self, FILE*, rsum_bytes, checksum_bytes, seq_matches, hash_algo)
  * Called during construction only, this creates the rcksum_state that stores
  * the per-block checksums of the target file and holds the local working copy
  * of the in-progress target. And it populates the per-block checksums from the
  * given file handle, which must be reading from the .zsync at the start of the
  * checksums. 
- * rsum_bytes, checksum_bytes, seq_matches are settings for the checksums,
- * passed through to the rcksum_state. */
+ * rsum_bytes, checksum_bytes, seq_matches, hash_algo are settings for the
+ * checksums, passed through to the rcksum_state. */
 static int zsync_read_blocksums(struct zsync_state *zs, FILE * f,
 								int rsum_bytes, int checksum_bytes,
-								int seq_matches) {
+								int seq_matches, int hash_algo) {
 	/* Make the rcksum_state first */
 	if (!(zs->rs = rcksum_init(zs->blocks, zs->blocksize, rsum_bytes,
 							   checksum_bytes, seq_matches))) {
 		return -1;
 	}
+	rcksum_set_hash_algo(zs->rs, hash_algo);
 
-	/* Now read in and store the checksums */
-	zs_blockid id = 0;
-	for (; id < zs->blocks; id++) {
+	if (zs->chunking[0])
+		return zsync_read_chunksums(zs, f, checksum_bytes);
+
+	/* Now read in and store the checksums, ours and then each level's */
+	if (read_block_records(zs->rs, f, zs->blocks, rsum_bytes, checksum_bytes) != 0) {
+		rcksum_end(zs->rs);
+		return -1;
+	}
+	for (int i = 0; i < zs->nlevels; i++) {
+		size_t bs = zs->levels[i].blocksize;
+		zs_blockid blocks = (zs->filelen + bs - 1) / bs;
+		struct rcksum_state *c = rcksum_add_level(zs->rs, blocks, bs, zs->levels[i].rsum_bytes,
+												  zs->levels[i].checksum_bytes,
+												  zs->levels[i].seq_matches);
+
+		if (!c || read_block_records(c, f, blocks, zs->levels[i].rsum_bytes,
+									 zs->levels[i].checksum_bytes) != 0) {
+			rcksum_end(zs->rs);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* read_block_records(rcksum, FILE*, blocks, rsum_bytes, checksum_bytes)
+ * Read the rsum and checksum of each of the given number of blocks into the
+ * rcksum_state. Returns 0 if successful. */
+static int read_block_records(struct rcksum_state *rs, FILE * f, zs_blockid blocks,
+							  int rsum_bytes, int checksum_bytes) {
+	for (zs_blockid id = 0; id < blocks; id++) {
 		struct rsum r = { 0, 0 };
 		unsigned char checksum[CHECKSUM_SIZE];
 
 		/* Read in */
 		if (fread(((char *)&r) + 4 - rsum_bytes, rsum_bytes, 1, f) < 1
 			|| fread((void *)&checksum, checksum_bytes, 1, f) < 1) {
-
-			/* Error - free the rcksum_state and tell the caller to bail */
 			fprintf(stderr, "short read on control file; %s\n",
 					strerror(ferror(f)));
-			rcksum_end(zs->rs);
 			return -1;
 		}
 
 		/* Convert to host endian and store */
 		r.a = ntohs(r.a);
 		r.b = ntohs(r.b);
-		rcksum_add_target_block(zs->rs, id, r, checksum);
+		rcksum_add_target_block(rs, id, r, checksum);
+	}
+	return 0;
+}
+
+/* zsync_read_chunksums(self, FILE*, checksum_bytes)
+ * As zsync_read_blocksums, for content-defined chunks: each has its length, as
+ * 4 bytes in network order, and then its checksum. The lengths must add up
+ * to the length of the file. */
+static int zsync_read_chunksums(struct zsync_state *zs, FILE * f, int checksum_bytes) {
+	off_t total = 0;
+
+	if (rcksum_set_chunking(zs->rs, zs->chunking[0], zs->chunking[1], zs->chunking[2]) != 0) {
+		rcksum_end(zs->rs);
+		return -1;
+	}
+
+	for (zs_blockid id = 0; id < zs->blocks; id++) {
+		uint32_t len;
+		unsigned char checksum[CHECKSUM_SIZE];
+
+		if (fread(&len, sizeof len, 1, f) < 1
+			|| fread((void *)&checksum, checksum_bytes, 1, f) < 1) {
+			fprintf(stderr, "short read on control file; %s\n",
+					strerror(ferror(f)));
+			rcksum_end(zs->rs);
+			return -1;
+		}
+
+		len = ntohl(len);
+		if (!len || len > zs->chunking[2]) {
+			fprintf(stderr, "nonsensical chunk length %u in control file\n", len);
+			rcksum_end(zs->rs);
+			return -1;
+		}
+		rcksum_add_target_chunk(zs->rs, id, len, checksum);
+		total += len;
+	}
+	if (total != zs->filelen) {
+		fprintf(stderr, "chunks in control file don't add up to its Length\n");
+		rcksum_end(zs->rs);
+		return -1;
 	}
 	return 0;
 }
 
+/* bin_section(header, offset, length, maplen)
+ * Whether a section of a binary control file is aligned and within the file. */
+static int bin_section(uint64_t off, uint64_t len, size_t maplen) {
+	return off % ZSYNC_BIN_ALIGN == 0 && off <= maplen && len <= maplen - off;
+}
+
+/* zsync_begin_binary(stream)
+ * Constructor for a binary control file (see zsyncbin.h). The file is mapped
+ * privately, and the block sums and the index, if there is a usable one, are
+ * used from the mapping; scans change the index in place, which only copies
+ * the pages they touch. */
+static struct zsync_state *zsync_begin_binary(FILE * f) {
+	struct stat st;
+	const struct zsync_bin_header *h;
+
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode)
+		|| (size_t)st.st_size < sizeof *h) {
+		fprintf(stderr, "binary control files must be regular files\n");
+		return NULL;
+	}
+
+	struct zsync_state *zs = (zsync_state *)calloc(sizeof *zs, 1);
+	if (!zs)
+		return NULL;
+
+	zs->maplen = st.st_size;
+	zs->map = mmap(NULL, zs->maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	if (zs->map == MAP_FAILED) {
+		perror("mmap");
+		free(zs);
+		return NULL;
+	}
+	h = (const struct zsync_bin_header *)zs->map;
+
+	if (memcmp(h->magic, ZSYNC_BIN_MAGIC, ZSYNC_BIN_MAGIC_LEN) || h->version != ZSYNC_BIN_VERSION) {
+		fprintf(stderr, "unsupported binary control file - you need a newer version of zsync.\n");
+		goto fail;
+	}
+	if (h->byteorder != ZSYNC_BIN_BYTEORDER) {
+		fprintf(stderr, "binary control file made on a machine of different byte order; use a text one\n");
+		goto fail;
+	}
+	if (!h->length || !h->blocksize || (h->blocksize & (h->blocksize - 1))
+		|| h->blocks != (h->length + h->blocksize - 1) / h->blocksize
+		|| h->blocks > (uint64_t)RCKSUM_MAX_BLOCKS
+		|| h->rsum_bytes < 1 || h->rsum_bytes > 4
+		|| h->checksum_bytes < 3 || h->checksum_bytes > 16
+		|| h->seq_matches > 2 || h->seq_matches < 1
+		|| !bin_section(h->rsums_off, h->rsums_len, zs->maplen)
+		|| !bin_section(h->checksums_off, h->checksums_len, zs->maplen)
+		|| !bin_section(h->index_off, h->index_len, zs->maplen)) {
+		fprintf(stderr, "nonsensical binary control file header\n");
+		goto fail;
+	}
+	if (h->hash_algo > RCKSUM_HASH_BLAKE3 || !rcksum_hash_supported(h->hash_algo)) {
+		fprintf(stderr, "unsupported block hash algorithm %s - you need a zsync built with it.\n",
+				h->hash_algo > RCKSUM_HASH_BLAKE3 ? "(unknown)" : rcksum_hash_name(h->hash_algo));
+		goto fail;
+	}
+
+	zs->filelen = h->length;
+	zs->blocksize = h->blocksize;
+	zs->blocks = h->blocks;
+	memcpy(zs->sha1, h->sha1, sizeof zs->sha1);
+	zs->have_sha1 = 1;
+
+	zs->rs = rcksum_init_mapped(zs->blocks, zs->blocksize, h->rsum_bytes,
+								h->checksum_bytes, h->seq_matches,
+								(char *)zs->map + h->rsums_off,
+								(char *)zs->map + h->checksums_off);
+	if (!zs->rs)
+		goto fail;
+	rcksum_set_hash_algo(zs->rs, h->hash_algo);
+
+	if (h->rsums_len != rcksum_rsums_size(zs->rs)
+		|| h->checksums_len != rcksum_checksums_size(zs->rs)) {
+		fprintf(stderr, "short read on control file; block sums don't fit\n");
+		goto fail;
+	}
+
+	/* An index from a different version is rebuilt as if there was none */
+	if (h->index_len && h->index_version == RCKSUM_INDEX_VERSION
+		&& rcksum_use_index(zs->rs, (char *)zs->map + h->index_off, h->index_len) != 0) {
+		fprintf(stderr, "ignoring a hash index that doesn't fit the block sums\n");
+	}
+	return zs;
+
+ fail:
+	if (zs->rs)
+		rcksum_end(zs->rs);
+	munmap(zs->map, zs->maplen);
+	free(zs);
+	return NULL;
+}
+
+/* zsync_set_threads(self, threads)
+ * Set the number of threads used to scan local files. */
+void zsync_set_threads(struct zsync_state *zs, int threads) {
+	rcksum_set_threads(zs->rs, threads);
+}
+
 /* zsync_submit_source_file(self, FILE*, progress)
  * Read the given stream, applying the rsync rolling checksum algorithm to
  * identify any blocks of data in common with the target file. Blocks found are
@@ -214,12 +497,124 @@ int zsync_submit_source_file(struct zsync_state *zs, FILE * f) {
 	return rcksum_submit_source_file(zs->rs, f);
 }
 
-void zsync_parseAdd(struct zsync_state *zs, FILE *fnew, size_t new_len, upload *u) {
-	return parseAdd(zs->rs, fnew, new_len, u);
+size_t zsync_source_pad(struct zsync_state *zs) {
+	return rcksum_source_pad(zs->rs);
+}
+
+int zsync_submit_source_map(struct zsync_state *zs, const struct mapfile *m) {
+	return rcksum_submit_source_map(zs->rs, m);
 }
 
-void zsync_parseMove(struct zsync_state *zs, upload *u) {
-	return parseMove(zs->rs, u);
+int zsync_stream_source_map(struct zsync_state *zs, const struct mapfile *m, upload *u, size_t maxops) {
+	return rcksum_stream_source_map(zs->rs, m, u, maxops);
+}
+
+/* zsync_needed_byte_ranges(self, &num)
+ * Returns the byte ranges of the target that we haven't got, as first and
+ * last byte pairs, with the last block cut short at the end of the file. */
+off_t *zsync_needed_byte_ranges(struct zsync_state *zs, int *num) {
+	zs_blockid nrange;
+	zs_blockid *blrange = rcksum_needed_block_ranges(zs->rs, &nrange);
+
+	if (!blrange)
+		return NULL;
+
+	off_t *byterange = (off_t *)malloc(2 * (nrange ? nrange : 1) * sizeof *byterange);
+	if (!byterange) {
+		free(blrange);
+		return NULL;
+	}
+
+	for (zs_blockid i = 0; i < nrange; i++) {
+		byterange[2 * i] = rcksum_block_start(zs->rs, blrange[2 * i]);
+		byterange[2 * i + 1] = rcksum_block_start(zs->rs, blrange[2 * i + 1]) - 1;
+		if (byterange[2 * i + 1] >= zs->filelen)
+			byterange[2 * i + 1] = zs->filelen - 1;
+	}
+	free(blrange);
+
+	*num = nrange;
+	return byterange;
+}
+
+/* zsync_parseDiscard(self, upload)
+ * The control file is of the server's old file, so the blocks of it that
+ * nothing in the new file matched are what no move will read. Send those
+ * ranges, so the server can free them before it applies the moves, and
+ * apply those in place rather than to a copy (see delta.h). */
+void zsync_parseDiscard(struct zsync_state *zs, upload *u) {
+	int nrange;
+	off_t *r = zsync_needed_byte_ranges(zs, &nrange);
+	off_t bytes = 0;
+
+	if (!r)
+		return;
+	for (int i = 0; i < nrange; i++) {
+		u->discard(r[2 * i], r[2 * i + 1] - r[2 * i] + 1);
+		bytes += r[2 * i + 1] - r[2 * i] + 1;
+	}
+	free(r);
+
+	printf("%lld of %lld blocks referenced, %d ranges of %lld bytes discarded\n",
+		   rcksum_blocks_got(zs->rs), zs->blocks, nrange, (long long)bytes);
+}
+
+/* zsync_parseCopy(self, map, fd)
+ * Write the blocks of the remote file that we have locally into the file fd,
+ * which ends up the length of the remote file. */
+int zsync_parseCopy(struct zsync_state *zs, const struct mapfile *m, int fd) {
+	if (parseCopy(zs->rs, m, fd) != 0 || ftruncate(fd, zs->filelen) != 0) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+void zsync_parseAdd(struct zsync_state *zs, const struct mapfile *m, upload *u) {
+	return parseAdd(zs->rs, m, u);
+}
+
+void zsync_parseMove(struct zsync_state *zs, const struct mapfile *m, upload *u) {
+	return parseMove(zs->rs, m, u);
+}
+
+/* zsync_verify(self, fd)
+ * Check the file fd against the SHA-1 of the remote file from the control
+ * file. Returns -1 if it doesn't match (or can't be read), 1 if it does, and
+ * 0 if there is no checksum to check. */
+int zsync_verify(struct zsync_state *zs, int fd) {
+	unsigned char buf[65536];
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	off_t off = 0;
+	int rc = -1;
+
+	if (!zs->have_sha1)
+		return 0;
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)) {
+		EVP_MD_CTX_free(ctx);
+		return -1;
+	}
+	for (;;) {
+		ssize_t n = pread(fd, buf, sizeof buf, off);
+
+		if (n < 0) {
+			perror("read");
+			break;
+		}
+		if (n == 0) {
+			if (EVP_DigestFinal_ex(ctx, digest, &digest_len) && off == zs->filelen
+				&& digest_len == sizeof zs->sha1 && !memcmp(digest, zs->sha1, sizeof zs->sha1))
+				rc = 1;
+			break;
+		}
+		EVP_DigestUpdate(ctx, buf, n);
+		off += n;
+	}
+	EVP_MD_CTX_free(ctx);
+	return rc;
 }
 
 /* zsync_complete(self)
@@ -238,6 +633,10 @@ int zsync_complete(struct zsync_state *zs) {
 	 * librcksum and free our rcksum state. */
 	rcksum_end(zs->rs);
 	zs->rs = NULL;
+	if (zs->map) {
+		munmap(zs->map, zs->maplen);
+		zs->map = NULL;
+	}
 
 	return rc;
 }
@@ -247,6 +646,8 @@ char *zsync_end(struct zsync_state *zs) {
 	/* Free rcksum object and zmap */
 	if (zs->rs)
 		rcksum_end(zs->rs);
+	if (zs->map)
+		munmap(zs->map, zs->maplen);
 
 	free(zs);
 	return NULL;
@@ -21,10 +21,27 @@ struct zsync_state;
  */
 struct zsync_state* zsync_begin(FILE* cf);
 
+/* zsync_set_threads - scan source files with this many threads
+ */
+void zsync_set_threads(struct zsync_state* zs, int threads);
+
 /* zsync_submit_source_file - submit local file data to zsync
  */
 int zsync_submit_source_file(struct zsync_state* zs, FILE* f);
 
+/* zsync_submit_source_map - as above, for a file mapped with mapfile_open
+ * with zsync_source_pad bytes of padding.
+ */
+struct mapfile;
+size_t zsync_source_pad(struct zsync_state* zs);
+int zsync_submit_source_map(struct zsync_state* zs, const struct mapfile* m);
+
+/* zsync_stream_source_map - as above, sending the moves and adds for the
+ * upload (which must be started) while the scan is still going, with at most
+ * maxops of them queued.
+ */
+int zsync_stream_source_map(struct zsync_state* zs, const struct mapfile* m, upload* u, size_t maxops);
+
 /* zsync_complete - set file length and verify checksum if available
  * Returns -1 for failure, 1 for success, 0 for unable to verify (e.g. no checksum in the .zsync) */
 int zsync_complete(struct zsync_state* zs);
@@ -33,5 +50,29 @@ int zsync_complete(struct zsync_state* zs);
  * Returns a strdup()d pointer to the name of the file resulting from the process. */
 char* zsync_end(struct zsync_state* zs);
 
-void zsync_parseAdd(struct zsync_state *zs, FILE *fnew, size_t new_len, upload *u);
-void zsync_parseMove(struct zsync_state *zs, upload *u);
+/* zsync_needed_byte_ranges - the byte ranges of the remote file that no local
+ * data matched, as pairs of the first and last byte (as in HTTP ranges) in a
+ * malloc()ed array. Returns NULL if out of memory.
+ */
+off_t* zsync_needed_byte_ranges(struct zsync_state* zs, int* num);
+
+/* zsync_parseDiscard - tell the upload which ranges of the old file nothing
+ * is moved from; before zsync_parseMove, for delta uploads only. If there
+ * are any, zsync_parseMove then orders the moves for the stream to be
+ * applied in place.
+ */
+void zsync_parseDiscard(struct zsync_state *zs, upload *u);
+
+/* zsync_parseCopy - for downloads, write the blocks of the remote file found
+ * locally to their place in fd, and make it the remote file's length; the
+ * rest is what zsync_needed_byte_ranges returns. Returns 0 on success.
+ */
+int zsync_parseCopy(struct zsync_state *zs, const struct mapfile *m, int fd);
+
+/* zsync_verify - check a downloaded file against the remote file's SHA-1.
+ * Returns -1 for a mismatch, 1 for a match, 0 if there is no checksum.
+ */
+int zsync_verify(struct zsync_state *zs, int fd);
+
+void zsync_parseAdd(struct zsync_state *zs, const struct mapfile *m, upload *u);
+void zsync_parseMove(struct zsync_state *zs, const struct mapfile *m, upload *u);
@@ -0,0 +1,43 @@
+#ifndef ZSYNCBIN_H
+#define ZSYNCBIN_H
+
+#include <stdint.h>
+
+/* Binary control files, as written by zsyncmake -B. Instead of a text header
+ * and a block sums record per block, they hold a fixed header followed by the
+ * block sums, and optionally the rsum hash index, laid out just as an
+ * rcksum_state keeps them in memory (see rcksum_init_mapped). The client maps
+ * the file and scans straight from it, without parsing anything per block.
+ *
+ * The sections are in the byte order of the machine that wrote the file, and
+ * start at multiples of ZSYNC_BIN_ALIGN bytes. The index is only used if it
+ * was made with the client's RCKSUM_INDEX_VERSION and every block id in it is
+ * one of the file's blocks; otherwise it is built as usual. */
+
+/* The first byte isn't text, so text control files can't be mistaken for it */
+#define ZSYNC_BIN_MAGIC "\x89ZSYNC\r\n"
+#define ZSYNC_BIN_MAGIC_LEN 8
+#define ZSYNC_BIN_VERSION 1
+#define ZSYNC_BIN_BYTEORDER 0x01020304u
+#define ZSYNC_BIN_ALIGN 64
+
+struct zsync_bin_header {
+	char magic[ZSYNC_BIN_MAGIC_LEN];
+	uint32_t version;
+	uint32_t byteorder;			/* ZSYNC_BIN_BYTEORDER, as the writer stored it */
+	uint64_t length;			/* Length of the target file */
+	uint64_t blocks;
+	uint32_t blocksize;
+	uint32_t seq_matches;		/* The three Hash-Lengths */
+	uint32_t rsum_bytes;
+	uint32_t checksum_bytes;
+	uint32_t hash_algo;			/* RCKSUM_HASH_* */
+	uint32_t index_version;		/* RCKSUM_INDEX_VERSION of the index, if any */
+	unsigned char sha1[20];		/* SHA-1 of the target file */
+	uint32_t reserved;
+	uint64_t rsums_off, rsums_len;
+	uint64_t checksums_off, checksums_len;
+	uint64_t index_off, index_len;	/* index_len 0 if there is no index */
+};
+
+#endif